@@ -1,2 +1,3 @@
 from .bus import Bus
 from .device import Device
+from .functions import Priority, LockOp, Speed
@@ -18,13 +18,20 @@
 #  <http://www.gnu.org/licenses/>.                                          #
 #############################################################################
 
-from ctypes import c_int, byref
+from ctypes import c_int, byref, cast, c_void_p
 
 from forensic1394.errors import process_result
 
 from forensic1394.functions import forensic1394_alloc, forensic1394_destroy, \
                                    forensic1394_enable_sbp2, \
-                                   forensic1394_get_devices
+                                   forensic1394_get_devices, \
+                                   forensic1394_get_devices_filtered, \
+                                   forensic1394_filter, \
+                                   forensic1394_node_filter, \
+                                   forensic1394_enable_hotplug, \
+                                   forensic1394_get_hotplug_fd, \
+                                   forensic1394_process_hotplug, \
+                                   forensic1394_device_callback
 from forensic1394.device import Device
 
 import weakref
@@ -34,41 +41,124 @@ class Bus(object):
         # Allocate a new bus handle; _as_parameter_ allows passing of self
         self._as_parameter_ = forensic1394_alloc()
 
-        # Weak references to the most recent device list
-        self._wrefdev = []
+        # Weak references to the devices on the bus, keyed by their handle
+        self._wrefdev = weakref.WeakValueDictionary()
+
+        # Hotplug callbacks
+        self._onadd = None
+        self._onremove = None
 
     def enable_sbp2(self):
         # Re-raise for a cleaner stack trace
         forensic1394_enable_sbp2(self)
 
-    def devices(self):
-        # Mark any active device handles as being stale
-        for wdev in self._wrefdev:
-            if wdev():
-                wdev()._stale = True
+    def _device(self, devptr):
+        # Reuse the existing Device instance for the handle if there is one
+        d = self._wrefdev.get(devptr.value)
+
+        if d is None:
+            d = Device(self, devptr)
+            self._wrefdev[devptr.value] = d
 
-        # Clear the current list of weak references
-        self._wrefdev = []
+        return d
 
+    def devices(self, guid=None, vendor_id=None, product_id=None, match=None):
+        """
+        Returns the devices attached to the bus.  If any of guid, vendor_id or
+        product_id are given then only devices with matching properties are
+        returned.  If match is given then it is called with the configuration
+        ROM of each node and only nodes for which it returns True are included.
+        The criteria remain in effect for rescans prompted by hotplug events.
+        """
         dev = []
         ndev = c_int(0)
 
         # Query the list of devices attached to the system
-        devlist = forensic1394_get_devices(self, byref(ndev), None)
+        if guid is None and vendor_id is None and product_id is None \
+           and match is None:
+            self._matchcb = None
+            devlist = forensic1394_get_devices(self, byref(ndev), None)
+        else:
+            f = forensic1394_filter()
+            f.guid = guid or 0
+            f.vendor_id = vendor_id or 0
+            f.product_id = product_id or 0
+
+            # Keep the predicate alive for as long as it may be called
+            if match:
+                self._matchcb = forensic1394_node_filter(
+                    lambda bus, rom, data: int(bool(match(rom[:256]))))
+                f.match = cast(self._matchcb, c_void_p)
+            else:
+                self._matchcb = None
+
+            devlist = forensic1394_get_devices_filtered(self, byref(f),
+                                                        byref(ndev), None)
 
         # If ndev is < 0 then it contains a result status code
         if ndev.value < 0:
             process_result(ndev.value, forensic1394_get_devices, ())
 
-        # Create Device instances for the devices found
+        # Get Device instances for the devices found
         for i in range(0, ndev.value):
-            d = Device(self, devlist[i])
-            dev.append(d)
-            # Maintain a weak reference to this device
-            self._wrefdev.append(weakref.ref(d))
+            dev.append(self._device(devlist[i]))
+
+        # Any other device handles have been destroyed and so are stale
+        live = set(d._as_parameter_.value for d in dev)
+
+        for ptr, d in list(self._wrefdev.items()):
+            if ptr not in live:
+                d._stale = True
+                del self._wrefdev[ptr]
 
         # Return the device list
         return dev
 
+    def enable_hotplug(self, onadd=None, onremove=None):
+        """
+        Enables the monitoring of the bus for devices being added or removed,
+        making calls to devices() cheap when nothing has changed.  The
+        optional callables onadd and onremove are passed the Device being
+        added or removed.
+        """
+        self._onadd = onadd
+        self._onremove = onremove
+
+        # Keep the C callbacks alive for as long as the bus
+        self._cbadd = forensic1394_device_callback(self._hotplug_add)
+        self._cbremove = forensic1394_device_callback(self._hotplug_remove)
+
+        forensic1394_enable_hotplug(self, self._cbadd, self._cbremove)
+
+    def hotplug_fd(self):
+        """
+        Returns a file descriptor which becomes readable when devices are added
+        or removed, or -1 if the platform does not provide one.
+        """
+        return forensic1394_get_hotplug_fd(self)
+
+    def process_hotplug(self):
+        """
+        Rescans the bus if devices have been added or removed, calling the
+        hotplug callbacks as appropriate.
+        """
+        forensic1394_process_hotplug(self)
+
+    def _hotplug_add(self, bus, devptr):
+        d = self._device(devptr)
+
+        if self._onadd:
+            self._onadd(d)
+
+    def _hotplug_remove(self, bus, devptr):
+        d = self._wrefdev.pop(devptr.value, None)
+
+        if d is not None:
+            if self._onremove:
+                self._onremove(d)
+
+            # The handle is about to be destroyed
+            d._stale = True
+
     def __del__(self):
         forensic1394_destroy(self)
@@ -18,17 +18,25 @@
 #  <http://www.gnu.org/licenses/>.                                          #
 #############################################################################
 
-from ctypes import create_string_buffer, byref, cast, POINTER, \
-                   c_char, c_size_t, c_uint32, c_void_p
+from ctypes import create_string_buffer, addressof, byref, cast, sizeof, \
+                   POINTER, Array, c_char, c_int, c_size_t, c_uint32, \
+                   c_uint64, c_void_p
 
 from forensic1394.errors import process_result, Forensic1394StaleHandle
 
 from forensic1394.functions import forensic1394_open_device, \
                                    forensic1394_close_device, \
+                                   forensic1394_wait_device_ready, \
                                    forensic1394_is_device_open, \
-                                   forensic1394_read_device_v, \
-                                   forensic1394_write_device_v, \
+                                   forensic1394_read_device_v_priority, \
+                                   forensic1394_write_device_v_priority, \
+                                   forensic1394_lock_device_v_priority, \
                                    forensic1394_get_device_csr, \
+                                   forensic1394_get_device_csr_dir, \
+                                   forensic1394_get_device_csr_unit_dirs, \
+                                   forensic1394_find_device_csr_entry, \
+                                   forensic1394_get_device_csr_text, \
+                                   forensic1394_csr_entry, \
                                    forensic1394_get_device_node_id, \
                                    forensic1394_get_device_guid, \
                                    forensic1394_get_device_product_name, \
@@ -36,10 +44,95 @@ from forensic1394.functions import forensic1394_open_device, \
                                    forensic1394_get_device_vendor_name, \
                                    forensic1394_get_device_vendor_id, \
                                    forensic1394_get_device_request_size, \
-                                   forensic1394_req
-
+                                   forensic1394_get_device_speed, \
+                                   forensic1394_set_device_timeout, \
+                                   forensic1394_get_device_timeout, \
+                                   forensic1394_set_device_pipeline_depth, \
+                                   forensic1394_set_device_io_thread, \
+                                   forensic1394_get_device_pipeline_depth, \
+                                   forensic1394_fill_requests, \
+                                   forensic1394_req, \
+                                   forensic1394_lock_req, Priority
+
+from array import array
 from functools import wraps
 
+# Zero-copy views of arbitrary buffers require memoryview.cast (Python 3.3+)
+_HAVE_CAST = hasattr(memoryview, 'cast')
+
+def _nbytes(buf):
+    """
+    Returns the size in bytes of the buffer-protocol object buf.
+    """
+    m = memoryview(buf)
+    return m.nbytes if _HAVE_CAST else len(m) * m.itemsize
+
+# array.array type code corresponding to size_t
+_SIZE_T_CODE = 'L' if array('L').itemsize == sizeof(c_size_t) else 'Q'
+
+def _carray(seq, ctype, code):
+    """
+    Converts seq to a ctypes array of ctype.  Integer buffers (such as
+    array.array or numpy arrays) of the right item size are copied
+    directly; anything else is converted through an array.array of type
+    code or, should the type code be unavailable, element by element.
+    """
+    try:
+        m = memoryview(seq)
+        if m.ndim == 1 and m.c_contiguous and m.itemsize == sizeof(ctype) \
+           and m.format[-1] in 'bBhHiIlLqQnN':
+            return (ctype * len(m)).from_buffer_copy(m)
+    except (TypeError, AttributeError):
+        pass
+
+    # The 'Q' type code is missing from Python 2
+    try:
+        a = array(code, seq)
+    except ValueError:
+        seq = list(seq)
+        return (ctype * len(seq))(*seq)
+
+    return (ctype * len(a)).from_buffer(a)
+
+class RequestBatch(object):
+    """
+    A batch of (addr, len) read requests built from parallel arrays of
+    addresses and lengths, such as array.array or numpy arrays.  The C
+    request array is constructed by the library rather than element by
+    element in Python and can be reused across calls to
+    Device.readv_batch.  The data of each request immediately follows that
+    of the previous request in the buffer being read into.
+    """
+    def __init__(self, addrs, lens):
+        self._addrs = _carray(addrs, c_uint64, 'Q')
+        self._lens = _carray(lens, c_size_t, _SIZE_T_CODE)
+
+        if len(self._addrs) != len(self._lens):
+            raise ValueError("Address and length arrays differ in size")
+
+        self._creq = (forensic1394_req * len(self._addrs))()
+        self._bound = None
+
+        # Total size of the requests
+        self.nbytes = forensic1394_fill_requests(self._creq, len(self._creq),
+                                                 self._addrs, self._lens,
+                                                 None)
+
+    def __len__(self):
+        return len(self._creq)
+
+    def _bind(self, cbuf):
+        """
+        Internal function which points the requests into the ctypes array
+        cbuf.  This is a no-op if the requests already point into cbuf.
+        """
+        pbuf = addressof(cbuf)
+
+        if pbuf != self._bound:
+            forensic1394_fill_requests(self._creq, len(self._creq),
+                                       self._addrs, self._lens, pbuf)
+            self._bound = pbuf
+
 def checkStale(f):
     @wraps(f)
     def newf(self, *args, **kwargs):
@@ -80,22 +173,49 @@ class Device(object):
         self._csr = (c_uint32 * 256)()
         forensic1394_get_device_csr(self, self._csr)
 
+        # Worker used to service asynchronous requests; created on demand
+        self._executor = None
+
     def __del__(self):
         if self.isopen():
             self.close()
+        elif self._executor:
+            self._executor.shutdown(wait=False)
 
     @checkStale
-    def open(self):
+    def open(self, io_thread=False):
         """
         Attempts to open the device.  If the device can not be opened, or if the
-        device is stale, an exception is raised.
+        device is stale, an exception is raised.  If io_thread is True then the
+        device is serviced by a dedicated I/O thread, allowing it to be shared
+        efficiently by many Python threads.
         """
+        if not self.isopen():
+            forensic1394_set_device_io_thread(self, int(io_thread))
+
         forensic1394_open_device(self)
 
+        # Requests are now also limited by the speed of the path to the device
+        self._request_size = forensic1394_get_device_request_size(self)
+
+    @checkStale
+    def wait_ready(self, timeout_ms=5000):
+        """
+        Waits for up to timeout_ms milliseconds for the device to permit its
+        memory to be read, as happens shortly after SBP-2 has been enabled.  If
+        the device does not become ready an exception is raised.
+        """
+        forensic1394_wait_device_ready(self, timeout_ms)
+
     def close(self):
         """
         Closes the device.  If the device is stale this is a no-op
         """
+        # Wait for any outstanding asynchronous requests to complete
+        if self._executor:
+            self._executor.shutdown(wait=True)
+            self._executor = None
+
         if not self._stale:
             forensic1394_close_device(self)
 
@@ -109,32 +229,45 @@ class Device(object):
         else:
             return bool(forensic1394_is_device_open(self))
 
-    def _readreq(self, req, buf):
+    def _cbuffer(self, buf, numb):
+        """
+        Internal function which returns a ctypes char array sharing memory with
+        the writable buffer-protocol object buf, checking that it is at least
+        numb bytes in size.
+        """
+        # ctypes arrays can be used as-is
+        if isinstance(buf, Array):
+            cbuf = buf
+        else:
+            cbuf = (c_char * _nbytes(buf)).from_buffer(buf)
+
+        if sizeof(cbuf) < numb:
+            raise ValueError("Buffer too small; need %d bytes" % numb)
+
+        return cbuf
+
+    def _readreq(self, req, buf, prio=Priority.Bulk):
         """
         Internal low level read function.
         """
-        assert self.isopen()
+        # Split the requests into address and length arrays
+        addrs, lens = zip(*req) if req else ((), ())
 
-        # Get a pointer directly into the buffer which we can perform
-        # arithmetic on. Compared to cast(byref(buf, off), c_void_p)
-        # directly accessing the pointer gives a ~10% performance
-        # improvement for scatter requests.
-        pbuf = cast(buf, c_void_p).value
+        self._readbatch(RequestBatch(addrs, lens), buf, prio)
 
-        # Create the request tuples
-        init = []
-        for addr, numb in req:
-            init.append((addr, numb, c_void_p(pbuf)))
-            pbuf += numb
+    def _readbatch(self, batch, cbuf, prio):
+        """
+        Internal function which reads batch into the ctypes array cbuf.
+        """
+        assert self.isopen()
 
-        # Create the array of forensic1394 requests
-        creq = (forensic1394_req * len(req))(*init)
+        batch._bind(cbuf)
 
-        # Dispatch the requests
-        forensic1394_read_device_v(self, creq, len(creq))
+        forensic1394_read_device_v_priority(self, batch._creq, len(batch),
+                                            prio)
 
     @checkStale
-    def read(self, addr, numb, buf=None):
+    def read(self, addr, numb, buf=None, prio=Priority.Interactive):
         """
         Attempts to read numb bytes from the device starting at addr.
         The device must be open and the handle can not be stale.
@@ -143,44 +276,200 @@ class Device(object):
         returned.  An exception is raised should an error occur.  The
         optional buf parameter can be used to pass a specific ctypes
         c_char array to read into.  If no buffer is passed then
-        create_string_buffer will be used to allocate one.
+        create_string_buffer will be used to allocate one.  The prio
+        parameter determines the scheduling class of the requests when
+        the device is shared between threads.
         """
         if buf == None:
             # No buffer passed; allocate one
             buf = create_string_buffer(numb)
 
-        # Break the request up into rs size chunks; if numb % rs = 0 then
-        # lens may have an extra element; zip will take care of this
+        self.readinto(addr, buf, numb, prio)
+
+        return buf.raw
+
+    @checkStale
+    def readinto(self, addr, buf, numb=None, prio=Priority.Interactive):
+        """
+        Reads from the device starting at addr directly into buf, which
+        may be any writable object supporting the buffer protocol, such
+        as a bytearray, memoryview, mmap or numpy array.  If numb is
+        omitted the entire buffer is filled.  Requests larger than
+        self.request_size will automatically be broken down into smaller
+        chunks.  Returns the number of bytes read.
+        """
+        if numb is None:
+            numb = _nbytes(buf)
+
+        cbuf = self._cbuffer(buf, numb)
+
+        # Break the request up into rs size chunks
         rs = self._request_size
         addrs = range(addr, addr + numb, rs)
-        lens = [rs] * (numb // rs) + [numb % rs]
+        lens = [rs] * (numb // rs) + ([numb % rs] if numb % rs else [])
 
-        self._readreq(list(zip(addrs, lens)), buf)
+        self._readbatch(RequestBatch(addrs, lens), cbuf, prio)
 
-        return buf.raw
+        return numb
 
     @checkStale
-    def readv(self, req):
+    def readv(self, req, prio=Priority.Bulk):
         """
         Performs a batch of read requests of the form: [(addr1, len1),
         (addr2, len2), ...] and returns a generator yielding, in
         sequence, (addr1, buf1), (addr2, buf2), ..., .  This is useful
         when performing a series of `scatter reads' from a device.
         """
+        # Without zero-copy views read into a string buffer and slice it
+        if not _HAVE_CAST:
+            buf = create_string_buffer(sum(numb for _addr, numb in req))
+
+            self._readreq(req, buf, prio)
+
+            off = 0
+            for addr, numb in req:
+                yield (addr, buf.raw[off:off + numb])
+                off += numb
+
+            return
+
         # Create the request buffer
-        buf = create_string_buffer(sum(numb for _addr, numb in req))
+        buf = bytearray(sum(numb for _addr, numb in req))
+
+        for addr, view in self.readv_into(req, buf, prio):
+            yield (addr, view.tobytes())
+
+    @checkStale
+    def readv_into(self, req, buf, prio=Priority.Bulk):
+        """
+        Performs a batch of read requests of the form: [(addr1, len1),
+        (addr2, len2), ...] into buf, which may be any writable object
+        supporting the buffer protocol, with the data of each request
+        following on from that of the previous one.  Returns a generator
+        yielding, in sequence, (addr1, view1), (addr2, view2), ..., where
+        each view is a memoryview of the relevant part of buf; no data is
+        copied.  The reads are performed before the first item is yielded.
+        Requires Python 3.3 or later.
+        """
+        if not _HAVE_CAST:
+            raise NotImplementedError("readv_into requires Python 3.3+")
+
+        cbuf = self._cbuffer(buf, sum(numb for _addr, numb in req))
+
+        self._readreq(req, cbuf, prio)
+
+        return self._views(req, memoryview(cbuf).cast('B'))
+
+    @checkStale
+    def readv_batch(self, batch, buf=None, prio=Priority.Bulk):
+        """
+        Performs the read requests in the RequestBatch batch, returning
+        the buffer read into.  If buf is passed it may be any writable
+        object supporting the buffer protocol of at least batch.nbytes
+        bytes; otherwise a bytearray is allocated.  Unlike readv no
+        per-request work is done in Python, making this the fastest way of
+        performing a large number of small reads.
+        """
+        if buf is None:
+            buf = bytearray(batch.nbytes)
+
+        self._readbatch(batch, self._cbuffer(buf, batch.nbytes), prio)
+
+        return buf
+
+    @checkStale
+    def iter_read(self, addr, numb, chunk=1 << 20, prio=Priority.Bulk):
+        """
+        Reads numb bytes from the device starting at addr, returning a
+        generator yielding (addr, view) pairs of at most chunk bytes each.
+        Memory use is bounded at two chunks however large numb is: while
+        the caller processes one chunk the next is read into the other
+        buffer on the worker thread of the device.  Each view is a
+        memoryview which is only valid until the generator is next
+        resumed; it must be copied if it is to be retained.  As the reads
+        are made from the worker thread this is only supported on Linux;
+        Mac OS X requires devices to be used only by the thread which
+        opened them.
+        """
+        worker = self._worker()
+        bufs = [bytearray(min(chunk, numb)) for i in range(2)]
+
+        def submit(i, off):
+            n = min(chunk, numb - off)
+            return worker.submit(self.readinto, addr + off, bufs[i], n, prio)
+
+        off, i = 0, 0
+        fut = submit(0, 0) if numb else None
+
+        while off < numb:
+            n = min(chunk, numb - off)
+
+            # Wait for the current chunk before starting on the next one
+            fut.result()
+
+            if off + n < numb:
+                fut = submit(i ^ 1, off + n)
+
+            yield (addr + off, memoryview(bufs[i])[:n])
+
+            off, i = off + n, i ^ 1
+
+    def _worker(self):
+        """
+        Internal function returning the single-threaded executor used to
+        service asynchronous requests on the device.  As ctypes releases the
+        GIL for the duration of library calls the event loop, and any other
+        devices, are free to run while a request is in progress.  Requests
+        are made from a thread other than the one which opened the device,
+        which only the Linux backend permits.
+        """
+        # Imported here so that the module remains usable on Python 2
+        from concurrent.futures import ThreadPoolExecutor
+
+        if self._executor is None:
+            self._executor = ThreadPoolExecutor(max_workers=1)
+        return self._executor
+
+    @checkStale
+    def aread(self, addr, numb, buf=None, prio=Priority.Interactive):
+        """
+        Awaitable version of read, which must be called from within a
+        running asyncio event loop.  The read is performed on a worker
+        thread dedicated to the device so that the event loop is not
+        blocked; hence several devices can be driven concurrently from a
+        single event loop.  As Mac OS X requires devices to be used only by
+        the thread which opened them this is only supported on Linux.
+        """
+        from asyncio import wrap_future
+
+        return wrap_future(self._worker().submit(self.read, addr, numb,
+                                                 buf, prio))
 
-        # Use _readreq to read the requests into buf
-        self._readreq(req, buf)
+    @checkStale
+    def areadv(self, req, prio=Priority.Bulk):
+        """
+        Awaitable version of readv.  Returns a list of (addr, buf) pairs once
+        all of the requests have completed.  As with aread this is only
+        supported on Linux.
+        """
+        from asyncio import wrap_future
 
-        # Generate the resulting buffers
+        def worker():
+            return list(self.readv(req, prio))
+
+        return wrap_future(self._worker().submit(worker))
+
+    def _views(self, req, view):
+        """
+        Internal generator yielding (addr, view) pairs for a request list.
+        """
         off = 0
         for addr, numb in req:
-            yield (addr, buf.raw[off:off + numb])
+            yield (addr, view[off:off + numb])
             off += numb
 
     @checkStale
-    def write(self, addr, buf):
+    def write(self, addr, buf, prio=Priority.Interactive):
         """
         Attempts to write len(buf) bytes to the device starting at addr.  The
         device must be open and the handle can not be stale.  Requests larger
@@ -193,10 +482,10 @@ class Device(object):
             req.append((addr + off, buf[off:off + self._request_size]))
 
         # Dispatch
-        self.writev(req)
+        self.writev(req, prio)
 
     @checkStale
-    def writev(self, req):
+    def writev(self, req, prio=Priority.Bulk):
         assert self.isopen()
 
         # Prepare the request array (addr, len, buf)
@@ -205,13 +494,85 @@ class Device(object):
                   for addr, buf in req])
 
         # Send off the requests
-        forensic1394_write_device_v(self, creq, len(creq))
+        forensic1394_write_device_v_priority(self, creq, len(creq), prio)
+
+    @checkStale
+    def lock(self, addr, op, data, arg=None, prio=Priority.Interactive):
+        """
+        Atomically performs the lock operation op, one of LockOp, on the
+        len(data) bytes at addr, where len(data) is either 4 or 8.  The
+        argument arg, which must be the same length as data, is required by
+        all operations bar FetchAdd and LittleAdd.  Returns the value at
+        addr prior to the operation.  Uses lockv internally.
+        """
+        return self.lockv([(addr, op, data, arg)], prio)[0]
+
+    @checkStale
+    def lockv(self, req, prio=Priority.Bulk):
+        """
+        Performs each lock request (addr, op, data, arg) in req, returning a
+        list of the values prior to each operation.  The requests may be
+        performed in any order.
+        """
+        assert self.isopen()
+
+        # Keep the operands alive until the requests complete
+        bufs = [(create_string_buffer(bytes(data), len(data)),
+                 create_string_buffer(bytes(arg), len(arg)) if arg else None,
+                 create_string_buffer(len(data)))
+                for addr, op, data, arg in req]
+
+        # Prepare the request array (addr, op, len, arg, data, old)
+        creq = (forensic1394_lock_req * len(req)) \
+               (*[(addr, op, len(data), cast(a, c_void_p) if a else None,
+                   cast(d, c_void_p), cast(o, c_void_p))
+                  for (addr, op, data, arg), (d, a, o) in zip(req, bufs)])
+
+        # Send off the requests
+        forensic1394_lock_device_v_priority(self, creq, len(creq), prio)
+
+        return [o.raw for d, a, o in bufs]
+
+    @checkStale
+    def set_timeout(self, min_ms, max_ms):
+        """
+        Bounds the adaptive request timeout of the device to lie between
+        min_ms and max_ms milliseconds.
+        """
+        forensic1394_set_device_timeout(self, min_ms, max_ms)
+
+    @property
+    @checkStale
+    def timeout(self):
+        """
+        The current request timeout of the device in milliseconds.  This is
+        derived from the measured round-trip time of requests.
+        """
+        return forensic1394_get_device_timeout(self)
+
+    @property
+    @checkStale
+    def pipeline_depth(self):
+        """
+        The maximum number of requests which may be in flight to the device.
+        The number actually in flight is reduced should the device report
+        that it is busy.
+        """
+        return forensic1394_get_device_pipeline_depth(self)
+
+    @pipeline_depth.setter
+    @checkStale
+    def pipeline_depth(self, depth):
+        forensic1394_set_device_pipeline_depth(self, depth)
 
     @property
     def node_id(self):
         """
-        The node ID of the device on the bus.
+        The node ID of the device on the bus.  This may change following a bus
+        reset.
         """
+        if not self._stale:
+            self._node_id = forensic1394_get_device_node_id(self)
         return self._node_id
 
     @property
@@ -253,10 +614,23 @@ class Device(object):
     def request_size(self):
         """
         The maximum request size supported by the device in bytes; this is
-        always a power of two.
+        always a power of two.  Once the device is open this accounts for the
+        speed of the path to the device, which may change on a bus reset.
         """
+        if self.isopen():
+            self._request_size = forensic1394_get_device_request_size(self)
+
         return self._request_size
 
+    @property
+    @checkStale
+    def speed(self):
+        """
+        The speed of the path between the local node and the device, one of
+        Speed; Speed.Unknown until the device has been opened.
+        """
+        return forensic1394_get_device_speed(self)
+
     @property
     def csr(self):
         """
@@ -264,3 +638,50 @@ class Device(object):
         integers.
         """
         return self._csr
+
+    @checkStale
+    def csr_entries(self, dir=0):
+        """
+        Returns the entries of the CSR directory numbered dir, with the root
+        directory being 0.  Each entry has key, value, offset, length and dir
+        attributes; the latter being the number of the directory pointed to
+        by the entry, if any.  The ROM is parsed once and the result cached by
+        the library.  Returns None if there is no such directory.
+        """
+        entries = POINTER(forensic1394_csr_entry)()
+        n = forensic1394_get_device_csr_dir(self, dir, byref(entries))
+
+        if n < 0:
+            return None
+
+        return entries[:n]
+
+    @checkStale
+    def unit_directories(self):
+        """
+        Returns a list of the numbers of the unit directories in the CSR.
+        """
+        dirs = POINTER(c_int)()
+        n = forensic1394_get_device_csr_unit_dirs(self, byref(dirs))
+
+        return dirs[:n]
+
+    @checkStale
+    def csr_find(self, key, dir=0):
+        """
+        Returns the first entry with the 8-bit key in the CSR directory
+        numbered dir, or None if there is no such entry.
+        """
+        entry = forensic1394_find_device_csr_entry(self, dir, key)
+
+        return entry.contents if entry else None
+
+    @checkStale
+    def csr_text(self, entry):
+        """
+        Returns the textual descriptor of a CSR entry returned by csr_entries
+        or csr_find; None if the entry has no such descriptor.
+        """
+        text = forensic1394_get_device_csr_text(self, byref(entry))
+
+        return text.decode('ascii', 'replace') if text is not None else None
@@ -41,6 +41,18 @@ class busptr(c_void_p):
 class devptr(c_void_p):
     pass
 
+class watchptr(c_void_p):
+    pass
+
+# Wrap the forensic1394_csr_entry structure
+# C def: struct { int key, uint32_t value, int offset, int length, int dir }
+class forensic1394_csr_entry(Structure):
+    _fields_ = [("key", c_int),
+                ("value", c_uint32),
+                ("offset", c_int),
+                ("length", c_int),
+                ("dir", c_int)]
+
 # Wrap the forensic1394_req structure
 # C def: struct { uint64_t addr, size_t len, void *buf }
 class forensic1394_req(Structure):
@@ -48,11 +60,72 @@ class forensic1394_req(Structure):
                 ("len", c_size_t),
                 ("buf", c_void_p)]
 
+# Atomic lock operations
+# C def: enum forensic1394_lock_op
+class LockOp(object):
+    MaskSwap    = 1
+    CompareSwap = 2
+    FetchAdd    = 3
+    LittleAdd   = 4
+    BoundedAdd  = 5
+    WrapAdd     = 6
+
+# Wrap the forensic1394_lock_req structure
+# C def: struct { uint64_t addr, forensic1394_lock_op op, size_t len,
+#                 const void *arg, const void *data, void *old }
+class forensic1394_lock_req(Structure):
+    _fields_ = [("addr", c_uint64),
+                ("op", c_int),
+                ("len", c_size_t),
+                ("arg", c_void_p),
+                ("data", c_void_p),
+                ("old", c_void_p)]
+
+# Speeds of the path to a device
+# C def: enum forensic1394_speed
+class Speed(object):
+    Unknown = -1
+    S100    = 0
+    S200    = 1
+    S400    = 2
+    S800    = 3
+    S1600   = 4
+    S3200   = 5
+
+# Scheduling classes for requests
+# C def: enum forensic1394_priority
+class Priority(object):
+    Bulk        = 0
+    Interactive = 1
+
 # Wrap the forensic1394_device_callback type
 # C def: void (*forensic1394_device_callback) (forensic1394_bus *bus,
 #                                              forensic1394_dev *dev)
 forensic1394_device_callback = CFUNCTYPE(None, busptr, devptr)
 
+# Wrap the forensic1394_node_filter type
+# C def: int (*forensic1394_node_filter) (forensic1394_bus *bus,
+#                                         const uint32_t *rom,
+#                                         void *data)
+forensic1394_node_filter = CFUNCTYPE(c_int, busptr, POINTER(c_uint32), c_void_p)
+
+# Wrap the forensic1394_watch_callback type
+# C def: void (*forensic1394_watch_callback) (forensic1394_watch *watch, int i,
+#                                             const void *prev,
+#                                             const void *cur)
+forensic1394_watch_callback = CFUNCTYPE(None, watchptr, c_int, c_void_p,
+                                        c_void_p)
+
+# Wrap the forensic1394_filter structure
+# C def: struct { int64_t guid, int vendor_id, int product_id,
+#                 forensic1394_node_filter match, void *match_data }
+class forensic1394_filter(Structure):
+    _fields_ = [("guid", c_int64),
+                ("vendor_id", c_int),
+                ("product_id", c_int),
+                ("match", c_void_p),
+                ("match_data", c_void_p)]
+
 # Wrap the alloc function
 # C def: forensic1394_bus *forensic1394_alloc(void)
 forensic1394_alloc = lib.forensic1394_alloc
@@ -74,6 +147,39 @@ forensic1394_get_devices = lib.forensic1394_get_devices
 forensic1394_get_devices.argtypes = [busptr, POINTER(c_int), c_void_p]
 forensic1394_get_devices.restype = POINTER(devptr)
 
+# Wrap the get devices filtered function
+# C def: forensic1394_dev **forensic1394_get_devices_filtered(forensic1394_bus *bus,
+#                                                             const forensic1394_filter *filter,
+#                                                             int *ndev,
+#                                                             forensic1394_device_callback ondestroy)
+forensic1394_get_devices_filtered = lib.forensic1394_get_devices_filtered
+forensic1394_get_devices_filtered.argtypes = [busptr,
+                                              POINTER(forensic1394_filter),
+                                              POINTER(c_int), c_void_p]
+forensic1394_get_devices_filtered.restype = POINTER(devptr)
+
+# Wrap the enable hotplug function
+# C def: forensic1394_result forensic1394_enable_hotplug(forensic1394_bus *bus,
+#                                                        forensic1394_device_callback onadd,
+#                                                        forensic1394_device_callback onremove)
+forensic1394_enable_hotplug = lib.forensic1394_enable_hotplug
+forensic1394_enable_hotplug.argtypes = [busptr, c_void_p, c_void_p]
+forensic1394_enable_hotplug.restype = c_int
+forensic1394_enable_hotplug.errcheck = process_result
+
+# Wrap the get hotplug fd function
+# C def: int forensic1394_get_hotplug_fd(forensic1394_bus *bus)
+forensic1394_get_hotplug_fd = lib.forensic1394_get_hotplug_fd
+forensic1394_get_hotplug_fd.argtypes = [busptr]
+forensic1394_get_hotplug_fd.restype = c_int
+
+# Wrap the process hotplug function
+# C def: forensic1394_result forensic1394_process_hotplug(forensic1394_bus *bus)
+forensic1394_process_hotplug = lib.forensic1394_process_hotplug
+forensic1394_process_hotplug.argtypes = [busptr]
+forensic1394_process_hotplug.restype = c_int
+forensic1394_process_hotplug.errcheck = process_result
+
 # Wrap the destroy function
 # C def: void forensic1394_destroy(forensic1394_bus *bus)
 forensic1394_destroy = lib.forensic1394_destroy
@@ -87,6 +193,14 @@ forensic1394_open_device.argtypes = [devptr]
 forensic1394_open_device.restype = c_int
 forensic1394_open_device.errcheck = process_result
 
+# Wrap the wait device ready function
+# C def: forensic1394_result forensic1394_wait_device_ready(forensic1394_dev *dev,
+#                                                           int timeout_ms)
+forensic1394_wait_device_ready = lib.forensic1394_wait_device_ready
+forensic1394_wait_device_ready.argtypes = [devptr, c_int]
+forensic1394_wait_device_ready.restype = c_int
+forensic1394_wait_device_ready.errcheck = process_result
+
 # Wrap the close device function
 # C def: void forensic1394_close_device(forensic1394_dev *dev)
 forensic1394_close_device = lib.forensic1394_close_device
@@ -119,6 +233,20 @@ forensic1394_read_device_v.argtypes = [devptr,
 forensic1394_read_device_v.restype = c_int
 forensic1394_read_device_v.errcheck = process_result
 
+# Wrap the vectorised read device with priority function
+# C def: forensic1394_result
+#        forensic1394_read_device_v_priority(forensic1394_dev *dev,
+#                                            forensic1394_req *req,
+#                                            size_t nreq,
+#                                            forensic1394_priority prio)
+forensic1394_read_device_v_priority = lib.forensic1394_read_device_v_priority
+forensic1394_read_device_v_priority.argtypes = [devptr,
+                                                POINTER(forensic1394_req),
+                                                c_size_t,
+                                                c_int]
+forensic1394_read_device_v_priority.restype = c_int
+forensic1394_read_device_v_priority.errcheck = process_result
+
 # Wrap the write device function
 # C def: forensic1394_result forensic1394_write_device(forensic1394_dev *dev,
 #                                                      uint64_t addr,
@@ -139,12 +267,185 @@ forensic1394_write_device_v.argtypes = [devptr,
 forensic1394_write_device_v.restype = c_int
 forensic1394_write_device_v.errcheck = process_result
 
+# Wrap the vectorised write device with priority function
+# C def: forensic1394_result
+#        forensic1394_write_device_v_priority(forensic1394_dev *dev,
+#                                             forensic1394_req *req,
+#                                             size_t nreq,
+#                                             forensic1394_priority prio)
+forensic1394_write_device_v_priority = lib.forensic1394_write_device_v_priority
+forensic1394_write_device_v_priority.argtypes = [devptr,
+                                                 POINTER(forensic1394_req),
+                                                 c_size_t,
+                                                 c_int]
+forensic1394_write_device_v_priority.restype = c_int
+forensic1394_write_device_v_priority.errcheck = process_result
+
+# Wrap the lock device function
+# C def: forensic1394_result forensic1394_lock_device(forensic1394_dev *dev,
+#                                                     uint64_t addr,
+#                                                     forensic1394_lock_op op,
+#                                                     size_t len,
+#                                                     const void *arg,
+#                                                     const void *data,
+#                                                     void *old)
+forensic1394_lock_device = lib.forensic1394_lock_device
+forensic1394_lock_device.argtypes = [devptr, c_uint64, c_int, c_size_t,
+                                     c_void_p, c_void_p, c_void_p]
+forensic1394_lock_device.restype = c_int
+forensic1394_lock_device.errcheck = process_result
+
+# Wrap the vectorised lock device function
+# C def: forensic1394_result
+#        forensic1394_lock_device_v(forensic1394_dev *dev,
+#                                   const forensic1394_lock_req *req,
+#                                   size_t nreq)
+forensic1394_lock_device_v = lib.forensic1394_lock_device_v
+forensic1394_lock_device_v.argtypes = [devptr, POINTER(forensic1394_lock_req),
+                                       c_size_t]
+forensic1394_lock_device_v.restype = c_int
+forensic1394_lock_device_v.errcheck = process_result
+
+# Wrap the vectorised lock device with priority function
+# C def: forensic1394_result
+#        forensic1394_lock_device_v_priority(forensic1394_dev *dev,
+#                                            const forensic1394_lock_req *req,
+#                                            size_t nreq,
+#                                            forensic1394_priority prio)
+forensic1394_lock_device_v_priority = lib.forensic1394_lock_device_v_priority
+forensic1394_lock_device_v_priority.argtypes = [devptr,
+                                                POINTER(forensic1394_lock_req),
+                                                c_size_t,
+                                                c_int]
+forensic1394_lock_device_v_priority.restype = c_int
+forensic1394_lock_device_v_priority.errcheck = process_result
+
+# Wrap the map device function
+# C def: const void *forensic1394_map_device(forensic1394_dev *dev,
+#                                            uint64_t base, size_t len)
+forensic1394_map_device = lib.forensic1394_map_device
+forensic1394_map_device.argtypes = [devptr, c_uint64, c_size_t]
+forensic1394_map_device.restype = c_void_p
+
+# Wrap the refresh device map function
+# C def: forensic1394_result
+#        forensic1394_refresh_device_map(forensic1394_dev *dev,
+#                                        const void *addr, size_t len)
+forensic1394_refresh_device_map = lib.forensic1394_refresh_device_map
+forensic1394_refresh_device_map.argtypes = [devptr, c_void_p, c_size_t]
+forensic1394_refresh_device_map.restype = c_int
+forensic1394_refresh_device_map.errcheck = process_result
+
+# Wrap the invalidate device map function
+# C def: forensic1394_result
+#        forensic1394_invalidate_device_map(forensic1394_dev *dev,
+#                                           const void *addr, size_t len)
+forensic1394_invalidate_device_map = lib.forensic1394_invalidate_device_map
+forensic1394_invalidate_device_map.argtypes = [devptr, c_void_p, c_size_t]
+forensic1394_invalidate_device_map.restype = c_int
+forensic1394_invalidate_device_map.errcheck = process_result
+
+# Wrap the unmap device function
+# C def: void forensic1394_unmap_device(forensic1394_dev *dev,
+#                                       const void *addr)
+forensic1394_unmap_device = lib.forensic1394_unmap_device
+forensic1394_unmap_device.argtypes = [devptr, c_void_p]
+forensic1394_unmap_device.restype = None
+
+# Wrap the request filling function
+# C def: size_t forensic1394_fill_requests(forensic1394_req *req, size_t nreq,
+#                                          const uint64_t *addr,
+#                                          const size_t *len, void *buf)
+forensic1394_fill_requests = lib.forensic1394_fill_requests
+forensic1394_fill_requests.argtypes = [POINTER(forensic1394_req), c_size_t,
+                                       POINTER(c_uint64), POINTER(c_size_t),
+                                       c_void_p]
+forensic1394_fill_requests.restype = c_size_t
+
+# Wrap the watch alloc function
+# C def: forensic1394_watch *forensic1394_watch_alloc(forensic1394_dev *dev,
+#                                                     forensic1394_watch_callback onchange)
+forensic1394_watch_alloc = lib.forensic1394_watch_alloc
+forensic1394_watch_alloc.argtypes = [devptr, forensic1394_watch_callback]
+forensic1394_watch_alloc.restype = watchptr
+
+# Wrap the watch add function; returns an index rather than a result
+# C def: int forensic1394_watch_add(forensic1394_watch *watch, uint64_t addr,
+#                                   size_t len)
+forensic1394_watch_add = lib.forensic1394_watch_add
+forensic1394_watch_add.argtypes = [watchptr, c_uint64, c_size_t]
+forensic1394_watch_add.restype = c_int
+
+# Wrap the watch poll function
+# C def: forensic1394_result forensic1394_watch_poll(forensic1394_watch *watch)
+forensic1394_watch_poll = lib.forensic1394_watch_poll
+forensic1394_watch_poll.argtypes = [watchptr]
+forensic1394_watch_poll.restype = c_int
+forensic1394_watch_poll.errcheck = process_result
+
+# Wrap the watch run function
+# C def: forensic1394_result forensic1394_watch_run(forensic1394_watch *watch,
+#                                                   int rate, int nsample)
+forensic1394_watch_run = lib.forensic1394_watch_run
+forensic1394_watch_run.argtypes = [watchptr, c_int, c_int]
+forensic1394_watch_run.restype = c_int
+forensic1394_watch_run.errcheck = process_result
+
+# Wrap the watch stop function
+# C def: void forensic1394_watch_stop(forensic1394_watch *watch)
+forensic1394_watch_stop = lib.forensic1394_watch_stop
+forensic1394_watch_stop.argtypes = [watchptr]
+forensic1394_watch_stop.restype = None
+
+# Wrap the watch data function
+# C def: const void *forensic1394_watch_get_data(forensic1394_watch *watch,
+#                                                int i)
+forensic1394_watch_get_data = lib.forensic1394_watch_get_data
+forensic1394_watch_get_data.argtypes = [watchptr, c_int]
+forensic1394_watch_get_data.restype = c_void_p
+
+# Wrap the watch destroy function
+# C def: void forensic1394_watch_destroy(forensic1394_watch *watch)
+forensic1394_watch_destroy = lib.forensic1394_watch_destroy
+forensic1394_watch_destroy.argtypes = [watchptr]
+forensic1394_watch_destroy.restype = None
+
 # Wrap the device CSR function
 # C def: void forensic1394_get_device_csr(forensic1394_dev *dev, uint32_t *rom)
 forensic1394_get_device_csr = lib.forensic1394_get_device_csr
 forensic1394_get_device_csr.argtypes = [devptr, POINTER(c_uint32)]
 forensic1394_get_device_csr.restype = None
 
+# Wrap the CSR directory function
+# C def: int forensic1394_get_device_csr_dir(forensic1394_dev *dev, int dir,
+#                                            const forensic1394_csr_entry **entries)
+forensic1394_get_device_csr_dir = lib.forensic1394_get_device_csr_dir
+forensic1394_get_device_csr_dir.argtypes = [devptr, c_int,
+                                            POINTER(POINTER(forensic1394_csr_entry))]
+forensic1394_get_device_csr_dir.restype = c_int
+
+# Wrap the CSR unit directory function
+# C def: int forensic1394_get_device_csr_unit_dirs(forensic1394_dev *dev,
+#                                                  const int **dirs)
+forensic1394_get_device_csr_unit_dirs = lib.forensic1394_get_device_csr_unit_dirs
+forensic1394_get_device_csr_unit_dirs.argtypes = [devptr, POINTER(POINTER(c_int))]
+forensic1394_get_device_csr_unit_dirs.restype = c_int
+
+# Wrap the CSR entry search function
+# C def: const forensic1394_csr_entry *
+#        forensic1394_find_device_csr_entry(forensic1394_dev *dev, int dir, int key)
+forensic1394_find_device_csr_entry = lib.forensic1394_find_device_csr_entry
+forensic1394_find_device_csr_entry.argtypes = [devptr, c_int, c_int]
+forensic1394_find_device_csr_entry.restype = POINTER(forensic1394_csr_entry)
+
+# Wrap the CSR text function
+# C def: const char *
+#        forensic1394_get_device_csr_text(forensic1394_dev *dev,
+#                                         const forensic1394_csr_entry *entry)
+forensic1394_get_device_csr_text = lib.forensic1394_get_device_csr_text
+forensic1394_get_device_csr_text.argtypes = [devptr, POINTER(forensic1394_csr_entry)]
+forensic1394_get_device_csr_text.restype = c_char_p
+
 # Wrap the device node id function
 # C def: uint16_t forensic1394_get_device_node_id(forensic1394_dev *dev)
 forensic1394_get_device_node_id = lib.forensic1394_get_device_node_id
@@ -187,6 +488,58 @@ forensic1394_get_device_request_size  = lib.forensic1394_get_device_request_size
 forensic1394_get_device_request_size.argtypes = [devptr]
 forensic1394_get_device_request_size.restype = c_int
 
+# Wrap the get device speed function
+# C def: forensic1394_speed forensic1394_get_device_speed(forensic1394_dev *dev);
+forensic1394_get_device_speed = lib.forensic1394_get_device_speed
+forensic1394_get_device_speed.argtypes = [devptr]
+forensic1394_get_device_speed.restype = c_int
+
+# Wrap the set device timeout function
+# C def: void forensic1394_set_device_timeout(forensic1394_dev *dev,
+#                                             int min_ms, int max_ms);
+forensic1394_set_device_timeout = lib.forensic1394_set_device_timeout
+forensic1394_set_device_timeout.argtypes = [devptr, c_int, c_int]
+forensic1394_set_device_timeout.restype = None
+
+# Wrap the get device timeout function
+# C def: int forensic1394_get_device_timeout(forensic1394_dev *dev);
+forensic1394_get_device_timeout = lib.forensic1394_get_device_timeout
+forensic1394_get_device_timeout.argtypes = [devptr]
+forensic1394_get_device_timeout.restype = c_int
+
+# Wrap the set device pipeline depth function
+# C def: void forensic1394_set_device_pipeline_depth(forensic1394_dev *dev,
+#                                                    int depth);
+forensic1394_set_device_pipeline_depth = lib.forensic1394_set_device_pipeline_depth
+forensic1394_set_device_pipeline_depth.argtypes = [devptr, c_int]
+forensic1394_set_device_pipeline_depth.restype = None
+
+# Wrap the get device pipeline depth function
+# C def: int forensic1394_get_device_pipeline_depth(forensic1394_dev *dev);
+forensic1394_get_device_pipeline_depth = lib.forensic1394_get_device_pipeline_depth
+forensic1394_get_device_pipeline_depth.argtypes = [devptr]
+forensic1394_get_device_pipeline_depth.restype = c_int
+
+# Wrap the set device read-ahead function
+# C def: void forensic1394_set_device_read_ahead(forensic1394_dev *dev,
+#                                                size_t window);
+forensic1394_set_device_read_ahead = lib.forensic1394_set_device_read_ahead
+forensic1394_set_device_read_ahead.argtypes = [devptr, c_size_t]
+forensic1394_set_device_read_ahead.restype = None
+
+# Wrap the get device read-ahead function
+# C def: size_t forensic1394_get_device_read_ahead(forensic1394_dev *dev);
+forensic1394_get_device_read_ahead = lib.forensic1394_get_device_read_ahead
+forensic1394_get_device_read_ahead.argtypes = [devptr]
+forensic1394_get_device_read_ahead.restype = c_size_t
+
+# Wrap the set device I/O thread function
+# C def: void forensic1394_set_device_io_thread(forensic1394_dev *dev,
+#                                               int enable);
+forensic1394_set_device_io_thread = lib.forensic1394_set_device_io_thread
+forensic1394_set_device_io_thread.argtypes = [devptr, c_int]
+forensic1394_set_device_io_thread.restype = None
+
 # Wrap the error string function
 # C def: const char *forensic1394_get_result_str(forensic1394_result r);
 forensic1394_get_result_str = lib.forensic1394_get_result_str
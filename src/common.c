@@ -19,6 +19,7 @@
 
 #include "forensic1394.h"
 #include "common.h"
+#include "csr.h"
 
 #include <assert.h>
 
@@ -26,6 +27,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <time.h>
+#include <sys/time.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
 #define ARRAY_E(a) (sizeof(a) / sizeof(*a))
 
 /*
@@ -69,6 +76,39 @@ static const char *result_str[] =
 
 static void forensic1394_destroy_all_devices(forensic1394_bus *bus);
 
+/**
+ * Closes and destroys the device \a dev, which must already have been removed
+ *  from the device list of \a bus.
+ */
+static void destroy_device(forensic1394_bus *bus, forensic1394_dev *dev);
+
+/**
+ * Rescans \a bus, merging the devices found with those already on the bus.
+ *  Devices no longer attached are destroyed and new devices appended.
+ */
+static forensic1394_result rescan_devices(forensic1394_bus *bus);
+
+/**
+ * Rebuilds the NULL-terminated device array of \a bus from its linked list.
+ */
+static void update_device_array(forensic1394_bus *bus);
+
+/**
+ * Reads \a len bytes at \a addr of \a dev into \a buf, serving the read from
+ *  the read-ahead window if it continues a sequential stream and otherwise
+ *  refilling the window.  The read-ahead state must be held.
+ *
+ *  \return A result status code.
+ */
+static forensic1394_result read_ahead(forensic1394_dev *dev, uint64_t addr,
+                                      size_t len, void *buf);
+
+/**
+ * Discards any data read ahead from \a dev.  This is safe to call while
+ *  another thread holds the read-ahead state.
+ */
+static void invalidate_read_ahead(forensic1394_dev *dev);
+
 forensic1394_bus *forensic1394_alloc(void)
 {
     forensic1394_bus *b = malloc(sizeof(forensic1394_bus));
@@ -89,6 +129,17 @@ forensic1394_bus *forensic1394_alloc(void)
     // No ondestroy callback
     b->ondestroy = NULL;
 
+    // No hotplug monitoring
+    b->hotplug = 0;
+    b->onadd = NULL;
+    b->onremove = NULL;
+
+    b->scanned = 0;
+    b->scan_ret = FORENSIC1394_RESULT_SUCCESS;
+
+    // Every device is wanted
+    b->filtered = 0;
+
     // Delegate to the platform-specific allocation routine
     b->pbus = platform_bus_alloc();
 
@@ -156,35 +207,48 @@ forensic1394_dev **forensic1394_get_devices(forensic1394_bus *bus,
                                             int *ndev,
                                             forensic1394_device_callback ondestroy)
 {
-    int i = 0;
-
-    forensic1394_result ret;
-    forensic1394_dev *cdev;
+    return forensic1394_get_devices_filtered(bus, NULL, ndev, ondestroy);
+}
 
+forensic1394_dev **forensic1394_get_devices_filtered(forensic1394_bus *bus,
+                                                     const forensic1394_filter *filter,
+                                                     int *ndev,
+                                                     forensic1394_device_callback ondestroy)
+{
     assert(bus);
 
-    // Void the current device list, freeing any memory associated with it
-    forensic1394_destroy_all_devices(bus);
-
-    // Update the device list
-    ret = platform_update_device_list(bus);
+    // A change of filter requires a rescan
+    if (!filter != !bus->filtered
+     || (filter && (filter->guid != bus->filter.guid
+                 || filter->vendor_id != bus->filter.vendor_id
+                 || filter->product_id != bus->filter.product_id
+                 || filter->match != bus->filter.match
+                 || filter->match_data != bus->filter.match_data)))
+    {
+        bus->scanned = 0;
+    }
 
-    // Allocate space for the device array and sentinel
-    bus->dev = malloc(sizeof(forensic1394_dev *) * (bus->ndev + 1));
+    bus->filtered = (filter != NULL);
 
-    // Copy the linked list of devices to the array
-    for (cdev = bus->dev_link; cdev; cdev = cdev->next)
+    if (filter)
     {
-	bus->dev[i++] = cdev;
+        bus->filter = *filter;
     }
 
-    // NULL terminate the last item in the list
-    bus->dev[bus->ndev] = NULL;
+    /*
+     * Rescan unless the bus is being monitored and nothing has been added or
+     * removed since it was last scanned.
+     */
+    if (!bus->hotplug || !bus->scanned || platform_poll_hotplug(bus))
+    {
+        bus->scan_ret = rescan_devices(bus);
+        update_device_array(bus);
+    }
 
     // If ndev was passed populate it with the number of devices
     if (ndev)
     {
-        *ndev = (bus->ndev > 0) ? bus->ndev : ret;
+        *ndev = (bus->ndev > 0) ? bus->ndev : bus->scan_ret;
     }
 
     // Save the ondestroy callback for later (may be NULL)
@@ -193,6 +257,62 @@ forensic1394_dev **forensic1394_get_devices(forensic1394_bus *bus,
     return bus->dev;
 }
 
+forensic1394_result forensic1394_enable_hotplug(forensic1394_bus *bus,
+                                                forensic1394_device_callback onadd,
+                                                forensic1394_device_callback onremove)
+{
+    assert(bus);
+
+    if (!bus->hotplug)
+    {
+        forensic1394_result ret = platform_enable_hotplug(bus);
+
+        if (ret != FORENSIC1394_RESULT_SUCCESS)
+        {
+            return ret;
+        }
+
+        // Changes prior to now were missed; so the next call must rescan
+        bus->hotplug = 1;
+        bus->scanned = 0;
+    }
+
+    bus->onadd = onadd;
+    bus->onremove = onremove;
+
+    return FORENSIC1394_RESULT_SUCCESS;
+}
+
+int forensic1394_get_hotplug_fd(forensic1394_bus *bus)
+{
+    assert(bus);
+    assert(bus->hotplug);
+
+    return platform_get_hotplug_fd(bus);
+}
+
+forensic1394_result forensic1394_process_hotplug(forensic1394_bus *bus)
+{
+    assert(bus);
+    assert(bus->hotplug);
+
+    if (!bus->scanned || platform_poll_hotplug(bus))
+    {
+        bus->scan_ret = rescan_devices(bus);
+        update_device_array(bus);
+
+        // Having no devices is not an error here
+        if (bus->scan_ret == FORENSIC1394_RESULT_NO_PERM && bus->ndev > 0)
+        {
+            return FORENSIC1394_RESULT_SUCCESS;
+        }
+
+        return bus->scan_ret;
+    }
+
+    return FORENSIC1394_RESULT_SUCCESS;
+}
+
 forensic1394_result forensic1394_open_device(forensic1394_dev *dev)
 {
     forensic1394_result ret;
@@ -217,6 +337,46 @@ forensic1394_result forensic1394_open_device(forensic1394_dev *dev)
     return ret;
 }
 
+forensic1394_result forensic1394_wait_device_ready(forensic1394_dev *dev,
+                                                   int timeout_ms)
+{
+    uint32_t quad;
+    forensic1394_result ret;
+    int64_t now, deadline;
+    int64_t delay_us = FORENSIC1394_READY_BACKOFF_MIN_MS * 1000;
+
+    assert(dev);
+    assert(dev->is_open);
+    assert(timeout_ms >= 0);
+
+    deadline = common_get_time_us() + (int64_t) timeout_ms * 1000;
+
+    for (;;)
+    {
+        // Probe with the cheapest read possible
+        ret = forensic1394_read_device(dev, FORENSIC1394_READY_PROBE_ADDR,
+                                       sizeof(quad), &quad);
+
+        now = common_get_time_us();
+
+        if (ret == FORENSIC1394_RESULT_SUCCESS || now >= deadline)
+        {
+            return ret;
+        }
+
+        // A bus reset may well be the device reacting; so start over
+        if (platform_wait_bus_reset(dev, MIN(delay_us, deadline - now)))
+        {
+            delay_us = FORENSIC1394_READY_BACKOFF_MIN_MS * 1000;
+        }
+        else
+        {
+            delay_us = MIN(2 * delay_us,
+                           FORENSIC1394_READY_BACKOFF_MAX_MS * 1000);
+        }
+    }
+}
+
 void forensic1394_close_device(forensic1394_dev *dev)
 {
     assert(dev);
@@ -227,8 +387,14 @@ void forensic1394_close_device(forensic1394_dev *dev)
         return;
     }
 
+    // Mappings can not be served once the device is closed
+    platform_unmap_device(dev, NULL);
+
     platform_close_device(dev);
 
+    // Memory may well have changed by the time the device is reopened
+    invalidate_read_ahead(dev);
+
     // The device is now closed
     dev->is_open = 0;
 }
@@ -253,27 +419,52 @@ forensic1394_result forensic1394_read_device(forensic1394_dev *dev,
                                              void *buf)
 {
     forensic1394_req r;
+    forensic1394_result ret;
 
     assert(dev);
     assert(dev->is_open);
 
+    /*
+     * Only one thread at a time can read ahead; others, which are unlikely to
+     * be continuing the same stream anyway, read directly from the device.
+     */
+    if (len < dev->ra.window
+     && !__atomic_test_and_set(&dev->ra.busy, __ATOMIC_ACQUIRE))
+    {
+        ret = read_ahead(dev, addr, len, buf);
+
+        __atomic_clear(&dev->ra.busy, __ATOMIC_RELEASE);
+
+        return ret;
+    }
+
     // Fill out a request structure
     r.addr  = addr;
     r.len   = len;
     r.buf   = buf;
 
-    return platform_send_requests(dev, REQUEST_TYPE_READ, &r, 1);
+    return platform_send_requests(dev, REQUEST_TYPE_READ,
+                                  FORENSIC1394_PRIORITY_INTERACTIVE, &r, 1);
 }
 
 forensic1394_result forensic1394_read_device_v(forensic1394_dev *dev,
                                                forensic1394_req *req,
                                                size_t nreq)
+{
+    return forensic1394_read_device_v_priority(dev, req, nreq,
+                                               FORENSIC1394_PRIORITY_BULK);
+}
+
+forensic1394_result forensic1394_read_device_v_priority(forensic1394_dev *dev,
+                                                        forensic1394_req *req,
+                                                        size_t nreq,
+                                                        forensic1394_priority prio)
 {
     assert(dev);
     assert(dev->is_open);
     assert(req);
 
-    return platform_send_requests(dev, REQUEST_TYPE_READ, req, nreq);
+    return platform_send_requests(dev, REQUEST_TYPE_READ, prio, req, nreq);
 }
 
 forensic1394_result forensic1394_write_device(forensic1394_dev *dev,
@@ -291,17 +482,150 @@ forensic1394_result forensic1394_write_device(forensic1394_dev *dev,
     r.len   = len;
     r.buf   = buf;
 
-    return platform_send_requests(dev, REQUEST_TYPE_WRITE, &r, 1);
+    invalidate_read_ahead(dev);
+
+    return platform_send_requests(dev, REQUEST_TYPE_WRITE,
+                                  FORENSIC1394_PRIORITY_INTERACTIVE, &r, 1);
 }
 
 forensic1394_result forensic1394_write_device_v(forensic1394_dev *dev,
                                                 const forensic1394_req *req,
                                                 size_t nreq)
+{
+    return forensic1394_write_device_v_priority(dev, req, nreq,
+                                                FORENSIC1394_PRIORITY_BULK);
+}
+
+forensic1394_result forensic1394_write_device_v_priority(forensic1394_dev *dev,
+                                                         const forensic1394_req *req,
+                                                         size_t nreq,
+                                                         forensic1394_priority prio)
+{
+    assert(dev);
+    assert(dev->is_open);
+
+    invalidate_read_ahead(dev);
+
+    return platform_send_requests(dev, REQUEST_TYPE_WRITE, prio, req, nreq);
+}
+
+forensic1394_result forensic1394_lock_device(forensic1394_dev *dev,
+                                             uint64_t addr,
+                                             forensic1394_lock_op op,
+                                             size_t len,
+                                             const void *arg,
+                                             const void *data,
+                                             void *old)
+{
+    forensic1394_lock_req r;
+
+    // Fill out a request structure
+    r.addr  = addr;
+    r.op    = op;
+    r.len   = len;
+    r.arg   = arg;
+    r.data  = data;
+    r.old   = old;
+
+    return forensic1394_lock_device_v_priority(dev, &r, 1,
+                                               FORENSIC1394_PRIORITY_INTERACTIVE);
+}
+
+forensic1394_result forensic1394_lock_device_v(forensic1394_dev *dev,
+                                               const forensic1394_lock_req *req,
+                                               size_t nreq)
+{
+    return forensic1394_lock_device_v_priority(dev, req, nreq,
+                                               FORENSIC1394_PRIORITY_BULK);
+}
+
+forensic1394_result forensic1394_lock_device_v_priority(forensic1394_dev *dev,
+                                                        const forensic1394_lock_req *req,
+                                                        size_t nreq,
+                                                        forensic1394_priority prio)
+{
+    size_t i;
+
+    assert(dev);
+    assert(dev->is_open);
+    assert(nreq == 0 || req);
+
+    for (i = 0; i < nreq; i++)
+    {
+        assert(req[i].op >= FORENSIC1394_LOCK_MASK_SWAP
+            && req[i].op <= FORENSIC1394_LOCK_WRAP_ADD);
+        assert(req[i].len == 4 || req[i].len == 8);
+        assert(req[i].addr % req[i].len == 0);
+        assert(req[i].data);
+        assert(req[i].arg || !common_lock_has_arg(req[i].op));
+    }
+
+    invalidate_read_ahead(dev);
+
+    return platform_lock_requests(dev, prio, req, nreq);
+}
+
+const void *forensic1394_map_device(forensic1394_dev *dev,
+                                    uint64_t base,
+                                    size_t len)
+{
+    assert(dev);
+    assert(dev->is_open);
+    assert(len > 0);
+
+    return platform_map_device(dev, base, len);
+}
+
+forensic1394_result forensic1394_refresh_device_map(forensic1394_dev *dev,
+                                                    const void *addr,
+                                                    size_t len)
 {
     assert(dev);
     assert(dev->is_open);
+    assert(addr);
+
+    return platform_refresh_map(dev, addr, len);
+}
+
+forensic1394_result forensic1394_invalidate_device_map(forensic1394_dev *dev,
+                                                       const void *addr,
+                                                       size_t len)
+{
+    assert(dev);
+    assert(addr);
+
+    return platform_invalidate_map(dev, addr, len);
+}
 
-    return platform_send_requests(dev, REQUEST_TYPE_WRITE, req, nreq);
+void forensic1394_unmap_device(forensic1394_dev *dev, const void *addr)
+{
+    assert(dev);
+    assert(addr);
+
+    platform_unmap_device(dev, addr);
+}
+
+size_t forensic1394_fill_requests(forensic1394_req *req,
+                                  size_t nreq,
+                                  const uint64_t *addr,
+                                  const size_t *len,
+                                  void *buf)
+{
+    char *cbuf = buf;
+    size_t i, off = 0;
+
+    assert(nreq == 0 || (req && addr && len));
+
+    for (i = 0; i < nreq; i++)
+    {
+        req[i].addr = addr[i];
+        req[i].len = len[i];
+        req[i].buf = cbuf ? cbuf + off : NULL;
+
+        off += len[i];
+    }
+
+    return off;
 }
 
 void forensic1394_get_device_csr(forensic1394_dev *dev, uint32_t *rom)
@@ -312,6 +636,101 @@ void forensic1394_get_device_csr(forensic1394_dev *dev, uint32_t *rom)
     memcpy(rom, dev->rom, sizeof(dev->rom));
 }
 
+int forensic1394_get_device_csr_dir(forensic1394_dev *dev, int dir,
+                                    const forensic1394_csr_entry **entries)
+{
+    csr_index *idx;
+
+    assert(dev);
+    assert(entries);
+
+    idx = common_csr_index(dev);
+
+    if (!idx || dir < 0 || dir >= idx->ndir)
+    {
+        return -1;
+    }
+
+    *entries = &idx->entry[idx->dir_first[dir]];
+
+    return idx->dir_len[dir];
+}
+
+int forensic1394_get_device_csr_unit_dirs(forensic1394_dev *dev,
+                                          const int **dirs)
+{
+    csr_index *idx;
+
+    assert(dev);
+    assert(dirs);
+
+    if (!(idx = common_csr_index(dev)))
+    {
+        return 0;
+    }
+
+    *dirs = idx->unit;
+
+    return idx->nunit;
+}
+
+const forensic1394_csr_entry *
+forensic1394_find_device_csr_entry(forensic1394_dev *dev, int dir, int key)
+{
+    const forensic1394_csr_entry *entries;
+    int i, n;
+
+    assert(dev);
+
+    n = forensic1394_get_device_csr_dir(dev, dir, &entries);
+
+    for (i = 0; i < n; i++)
+    {
+        if (entries[i].key == key)
+        {
+            return &entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+const char *
+forensic1394_get_device_csr_text(forensic1394_dev *dev,
+                                 const forensic1394_csr_entry *entry)
+{
+    csr_index *idx;
+    const char *text;
+    int i, d;
+
+    assert(dev);
+    assert(entry);
+
+    idx = common_csr_index(dev);
+
+    assert(idx);
+    assert(entry >= idx->entry && entry < idx->entry + idx->nentry);
+
+    i = entry - idx->entry;
+
+    // The entry may itself be the descriptor
+    if ((text = common_csr_text(dev, i)))
+    {
+        return text;
+    }
+
+    // Otherwise look to the next entry, provided it is in the same directory
+    for (d = 0; d < idx->ndir; d++)
+    {
+        if (idx->dir_first[d] == i + 1)
+        {
+            return NULL;
+        }
+    }
+
+    return (i + 1 < idx->nentry) ? common_csr_text(dev, i + 1) : NULL;
+}
+
 uint16_t forensic1394_get_device_node_id(forensic1394_dev *dev)
 {
     assert(dev);
@@ -365,57 +784,752 @@ int forensic1394_get_device_request_size(forensic1394_dev *dev)
 {
     assert(dev);
 
+    // Payloads of 512 bytes at S100, doubling with each step up in speed
+    if (dev->speed != FORENSIC1394_SPEED_UNKNOWN)
+    {
+        return MIN(dev->max_req, MIN(512 << dev->speed,
+                                     FORENSIC1394_MAX_ASYNC_PAYLOAD));
+    }
+
     return dev->max_req;
 }
 
-void forensic1394_destroy_all_devices(forensic1394_bus *bus)
+forensic1394_speed forensic1394_get_device_speed(forensic1394_dev *dev)
 {
-    forensic1394_dev *cdev, *ndev;
+    assert(dev);
 
-    assert(bus);
+    return dev->speed;
+}
 
-    for (cdev = bus->dev_link; cdev; cdev = ndev)
-    {
-	// Save a reference to the next device
-	ndev = cdev->next;
+void forensic1394_set_device_timeout(forensic1394_dev *dev,
+                                     int min_ms, int max_ms)
+{
+    assert(dev);
+    assert(min_ms > 0);
+    assert(max_ms >= min_ms);
 
-        // First, close the device if it is open
-        if (forensic1394_is_device_open(cdev))
-        {
-            forensic1394_close_device(cdev);
-        }
+    dev->rto_min_us = (int64_t) min_ms * 1000;
+    dev->rto_max_us = (int64_t) max_ms * 1000;
 
-        // If a device-destroy callback is set; call it
-        if (bus->ondestroy)
-        {
-            bus->ondestroy(bus, cdev);
-        }
+    // Clamp the current timeout to the new bounds
+    dev->rto_us = MAX(dev->rto_us, dev->rto_min_us);
+    dev->rto_us = MIN(dev->rto_us, dev->rto_max_us);
+}
 
-        // Next call the platform specific destruction routine
-        platform_device_destroy(cdev);
+int forensic1394_get_device_timeout(forensic1394_dev *dev)
+{
+    assert(dev);
 
-        // Finally, free the general device structure (everything is static)
-        free(cdev);
-    }
+    // Round up to the nearest millisecond
+    return (int) ((dev->rto_us + 999) / 1000);
+}
 
-    // Free the device list itself (may be NULL, but still okay)
-    free(bus->dev);
+void forensic1394_set_device_pipeline_depth(forensic1394_dev *dev, int depth)
+{
+    assert(dev);
+    assert(depth > 0);
 
-    bus->dev = NULL;
-    bus->dev_link = NULL;
-    bus->ndev = 0;
+    dev->max_depth = MIN(depth, FORENSIC1394_PIPELINE_MAX);
+
+    // Start the window out at the new ceiling; it will shrink if need be
+    dev->cwnd = dev->max_depth;
 }
 
-const char *forensic1394_get_result_str(forensic1394_result r)
+int forensic1394_get_device_pipeline_depth(forensic1394_dev *dev)
 {
-    // Check the result is valid
-    if (r <= 0 && r > FORENSIC1394_RESULT_END)
-    {
-        return result_str[-r];
-    }
-    // Invalid
-    else
-    {
-        return NULL;
-    }
+    assert(dev);
+
+    return dev->max_depth;
+}
+
+void forensic1394_set_device_read_ahead(forensic1394_dev *dev, size_t window)
+{
+    assert(dev);
+
+    dev->ra.window = window;
+
+    invalidate_read_ahead(dev);
+}
+
+size_t forensic1394_get_device_read_ahead(forensic1394_dev *dev)
+{
+    assert(dev);
+
+    return dev->ra.window;
+}
+
+void forensic1394_set_device_io_thread(forensic1394_dev *dev, int enable)
+{
+    assert(dev);
+    assert(!dev->is_open);
+
+    dev->use_io_thread = enable;
+}
+
+void forensic1394_destroy_all_devices(forensic1394_bus *bus)
+{
+    forensic1394_dev *cdev, *ndev;
+
+    assert(bus);
+
+    for (cdev = bus->dev_link; cdev; cdev = ndev)
+    {
+	// Save a reference to the next device
+	ndev = cdev->next;
+
+        destroy_device(bus, cdev);
+    }
+
+    // Free the device list itself (may be NULL, but still okay)
+    free(bus->dev);
+
+    bus->dev = NULL;
+    bus->dev_link = NULL;
+    bus->ndev = 0;
+}
+
+void destroy_device(forensic1394_bus *bus, forensic1394_dev *dev)
+{
+    // First, close the device if it is open
+    if (forensic1394_is_device_open(dev))
+    {
+        forensic1394_close_device(dev);
+    }
+
+    // If a device-destroy callback is set; call it
+    if (bus->ondestroy)
+    {
+        bus->ondestroy(bus, dev);
+    }
+
+    // Next call the platform specific destruction routine
+    platform_device_destroy(dev);
+
+    // Release the parsed form of the ROM, if any
+    common_free_csr_index(dev);
+
+    // Along with the read-ahead window
+    free(dev->ra.buf);
+    free(dev->ra.req);
+
+    // Finally, free the general device structure (everything is static)
+    free(dev);
+}
+
+forensic1394_result rescan_devices(forensic1394_bus *bus)
+{
+    int complete;
+    forensic1394_result ret;
+    forensic1394_dev *found = NULL, *added = NULL, **tail;
+    forensic1394_dev *cdev, *ndev, *odev, **pdev;
+
+    // Scan the bus
+    ret = platform_update_device_list(bus, &found);
+
+    // Assume that every existing device has gone away until found otherwise
+    for (odev = bus->dev_link; odev; odev = odev->next)
+    {
+        odev->seen = 0;
+    }
+
+    for (cdev = found; cdev; cdev = ndev)
+    {
+        ndev = cdev->next;
+
+        // Look for an existing device with the same identity (GUID and ROM)
+        for (odev = bus->dev_link; odev; odev = odev->next)
+        {
+            if (!odev->seen
+             && odev->guid != 0
+             && odev->guid == cdev->guid
+             && memcmp(odev->rom, cdev->rom, sizeof(odev->rom)) == 0)
+            {
+                break;
+            }
+        }
+
+        // Known device; bring it up to date and discard the new one
+        if (odev && platform_merge_device(odev, cdev))
+        {
+            odev->seen = 1;
+
+            platform_device_destroy(cdev);
+            free(cdev);
+        }
+        // New device (or one which needs replacing); queue it up to be added
+        else
+        {
+            cdev->bus  = bus;
+            cdev->next = added;
+            added = cdev;
+        }
+    }
+
+    /*
+     * Remove devices which were not found.  If the scan failed part-way
+     * through then the absence of a device means nothing and so only those
+     * devices which are no longer wanted are removed.
+     */
+    complete = (ret == FORENSIC1394_RESULT_SUCCESS
+             || ret == FORENSIC1394_RESULT_NO_PERM);
+
+    for (pdev = &bus->dev_link; (odev = *pdev);)
+    {
+        if (odev->seen || (!complete && common_filter_rom(bus, odev->rom)))
+        {
+            pdev = &odev->next;
+            continue;
+        }
+
+        // Unlink the device
+        *pdev = odev->next;
+        bus->ndev--;
+
+        if (bus->hotplug && bus->onremove)
+        {
+            bus->onremove(bus, odev);
+        }
+
+        destroy_device(bus, odev);
+    }
+
+    // Append the new devices to the end of the list
+    for (tail = &bus->dev_link; *tail; tail = &(*tail)->next);
+
+    for (cdev = added; cdev; cdev = ndev)
+    {
+        ndev = cdev->next;
+
+        cdev->next = NULL;
+        *tail = cdev;
+        tail = &cdev->next;
+        bus->ndev++;
+
+        if (bus->hotplug && bus->onadd)
+        {
+            bus->onadd(bus, cdev);
+        }
+    }
+
+    bus->scanned = 1;
+
+    return ret;
+}
+
+void update_device_array(forensic1394_bus *bus)
+{
+    int i = 0;
+    forensic1394_dev *cdev;
+
+    // Free the old array (may be NULL, but still okay)
+    free(bus->dev);
+
+    // Allocate space for the device array and sentinel
+    bus->dev = malloc(sizeof(forensic1394_dev *) * (bus->ndev + 1));
+
+    // Copy the linked list of devices to the array
+    for (cdev = bus->dev_link; cdev; cdev = cdev->next)
+    {
+        bus->dev[i++] = cdev;
+    }
+
+    // NULL terminate the last item in the list
+    bus->dev[bus->ndev] = NULL;
+}
+
+forensic1394_result read_ahead(forensic1394_dev *dev, uint64_t addr,
+                               size_t len, void *buf)
+{
+    read_ahead_state *ra = &dev->ra;
+    forensic1394_req r;
+    forensic1394_result ret;
+    size_t maxreq, nreq, off;
+
+    uint32_t gen = __atomic_load_n(&ra->wgen, __ATOMIC_ACQUIRE);
+    int seq = (addr == ra->next);
+
+    ra->next = addr + len;
+
+    /*
+     * Only serve a read from the window when it continues the stream; so each
+     *  byte is served at most once and polling the same address repeatedly
+     *  always sees fresh data.
+     */
+    if (seq && ra->gen == gen
+     && addr >= ra->base && addr + len <= ra->base + ra->len)
+    {
+        memcpy(buf, ra->buf + (addr - ra->base), len);
+        return FORENSIC1394_RESULT_SUCCESS;
+    }
+
+    ra->len = 0;
+
+    // Fill out a request structure for reading directly
+    r.addr  = addr;
+    r.len   = len;
+    r.buf   = buf;
+
+    // Random access, or the stream has recently failed to be read ahead
+    if (!seq || addr < ra->skip_until)
+    {
+        ra->skip_until = seq ? ra->skip_until : 0;
+
+        return platform_send_requests(dev, REQUEST_TYPE_READ,
+                                      FORENSIC1394_PRIORITY_INTERACTIVE,
+                                      &r, 1);
+    }
+
+    maxreq = forensic1394_get_device_request_size(dev);
+    nreq = (ra->window + maxreq - 1) / maxreq;
+
+    // Grow the window and its requests as required
+    if (ra->bufsz < ra->window)
+    {
+        char *nbuf = realloc(ra->buf, ra->window);
+
+        if (!nbuf)
+        {
+            return platform_send_requests(dev, REQUEST_TYPE_READ,
+                                          FORENSIC1394_PRIORITY_INTERACTIVE,
+                                          &r, 1);
+        }
+
+        ra->buf = nbuf;
+        ra->bufsz = ra->window;
+    }
+
+    if (ra->nreqsz < nreq)
+    {
+        forensic1394_req *nr = realloc(ra->req, nreq * sizeof(*nr));
+
+        if (!nr)
+        {
+            return platform_send_requests(dev, REQUEST_TYPE_READ,
+                                          FORENSIC1394_PRIORITY_INTERACTIVE,
+                                          &r, 1);
+        }
+
+        ra->req = nr;
+        ra->nreqsz = nreq;
+    }
+
+    // Read the window starting at addr in a single pipelined batch
+    for (off = 0, nreq = 0; off < ra->window; off += maxreq, nreq++)
+    {
+        ra->req[nreq].addr  = addr + off;
+        ra->req[nreq].len   = MIN(maxreq, ra->window - off);
+        ra->req[nreq].buf   = ra->buf + off;
+    }
+
+    // Speculative; so not to crowd out interactive requests of other threads
+    ret = platform_send_requests(dev, REQUEST_TYPE_READ,
+                                 FORENSIC1394_PRIORITY_BULK,
+                                 ra->req, nreq);
+
+    /*
+     * The window may extend past the end of memory or into a region which
+     * can not be read; so fall back to reading just what was asked for.
+     */
+    if (ret != FORENSIC1394_RESULT_SUCCESS)
+    {
+        ra->skip_until = addr + ra->window;
+
+        return platform_send_requests(dev, REQUEST_TYPE_READ,
+                                      FORENSIC1394_PRIORITY_INTERACTIVE,
+                                      &r, 1);
+    }
+
+    ra->base = addr;
+    ra->len = ra->window;
+    ra->gen = gen;
+
+    memcpy(buf, ra->buf, len);
+
+    return FORENSIC1394_RESULT_SUCCESS;
+}
+
+void invalidate_read_ahead(forensic1394_dev *dev)
+{
+    __atomic_add_fetch(&dev->ra.wgen, 1, __ATOMIC_RELEASE);
+}
+
+const char *forensic1394_get_result_str(forensic1394_result r)
+{
+    // Check the result is valid
+    if (r <= 0 && r > FORENSIC1394_RESULT_END)
+    {
+        return result_str[-r];
+    }
+    // Invalid
+    else
+    {
+        return NULL;
+    }
+}
+
+int common_filter_guid(forensic1394_bus *bus, int64_t guid)
+{
+    return !bus->filtered || !bus->filter.guid || bus->filter.guid == guid;
+}
+
+int common_filter_rom(forensic1394_bus *bus, const uint32_t *rom)
+{
+    int64_t guid;
+    int vendor_id, product_id;
+
+    if (!bus->filtered)
+    {
+        return 1;
+    }
+
+    common_parse_csr_ids(rom, &guid, &vendor_id, &product_id);
+
+    if (bus->filter.guid && bus->filter.guid != guid)
+    {
+        return 0;
+    }
+
+    if (bus->filter.vendor_id && bus->filter.vendor_id != vendor_id)
+    {
+        return 0;
+    }
+
+    if (bus->filter.product_id && bus->filter.product_id != product_id)
+    {
+        return 0;
+    }
+
+    // Finally, defer to the user
+    if (bus->filter.match)
+    {
+        return bus->filter.match(bus, rom, bus->filter.match_data);
+    }
+
+    return 1;
+}
+
+void common_init_device(forensic1394_dev *dev)
+{
+    // No round-trip time samples have been taken yet
+    dev->srtt_us    = 0;
+    dev->rttvar_us  = 0;
+
+    // Start out with the conservative timeout until we have some samples
+    dev->rto_min_us = FORENSIC1394_TIMEOUT_MIN_MS * 1000;
+    dev->rto_max_us = FORENSIC1394_TIMEOUT_MAX_MS * 1000;
+    dev->rto_us     = FORENSIC1394_TIMEOUT_MS * 1000;
+
+    // Backends which support pipelining should raise the depth themselves
+    dev->max_depth  = 1;
+    dev->cwnd       = 1;
+
+    // Seed the generator used to jitter retries
+    dev->rand_state = (uint32_t) common_get_time_us() ^ (uint32_t) dev->guid;
+    dev->rand_state = dev->rand_state ? dev->rand_state : 1;
+
+    // Nothing is queued
+    memset(&dev->sched, 0, sizeof(dev->sched));
+
+    // Until the device is opened by the backend
+    dev->speed      = FORENSIC1394_SPEED_UNKNOWN;
+
+    // Nothing has been read ahead; no read is yet part of a stream
+    memset(&dev->ra, 0, sizeof(dev->ra));
+    dev->ra.window  = FORENSIC1394_READ_AHEAD_DEFAULT;
+    dev->ra.next    = UINT64_MAX;
+
+    dev->maps       = NULL;
+}
+
+int common_lock_has_arg(forensic1394_lock_op op)
+{
+    return op != FORENSIC1394_LOCK_FETCH_ADD
+        && op != FORENSIC1394_LOCK_LITTLE_ADD;
+}
+
+size_t common_lock_payload(const forensic1394_lock_req *r, void *buf)
+{
+    char *cbuf = buf;
+
+    if (common_lock_has_arg(r->op))
+    {
+        memcpy(cbuf, r->arg, r->len);
+        memcpy(cbuf + r->len, r->data, r->len);
+
+        return 2 * r->len;
+    }
+    else
+    {
+        memcpy(cbuf, r->data, r->len);
+
+        return r->len;
+    }
+}
+
+int64_t common_get_time_us(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+        return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+#endif
+    {
+        // Fall back to the wall clock (Mac OS X prior to 10.12)
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+
+        return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+}
+
+void common_rtt_sample(forensic1394_dev *dev, int64_t rtt_us)
+{
+    // A zero SRTT is used to denote the absence of any samples
+    rtt_us = MAX(rtt_us, 1);
+
+    // First sample; initialise the estimator (RFC 6298, section 2.2)
+    if (dev->srtt_us == 0)
+    {
+        dev->srtt_us    = rtt_us;
+        dev->rttvar_us  = rtt_us / 2;
+    }
+    // Otherwise update the mean deviation and then the mean itself
+    else
+    {
+        int64_t delta = dev->srtt_us - rtt_us;
+
+        dev->rttvar_us  = (3 * dev->rttvar_us + (delta < 0 ? -delta : delta)) / 4;
+        dev->srtt_us    = (7 * dev->srtt_us + rtt_us) / 8;
+    }
+
+    // Compute the new timeout and clamp it to the permitted range
+    dev->rto_us = dev->srtt_us + MAX(FORENSIC1394_TIMEOUT_GRANULARITY_US,
+                                     4 * dev->rttvar_us);
+    dev->rto_us = MAX(dev->rto_us, dev->rto_min_us);
+    dev->rto_us = MIN(dev->rto_us, dev->rto_max_us);
+}
+
+void common_rtt_timeout(forensic1394_dev *dev)
+{
+    // Exponential back-off; the next sample will bring the timeout back down
+    dev->rto_us = MIN(2 * dev->rto_us, dev->rto_max_us);
+}
+
+int common_cc_window(forensic1394_dev *dev)
+{
+    return MAX(1, MIN((int) dev->cwnd, dev->max_depth));
+}
+
+void common_cc_success(forensic1394_dev *dev)
+{
+    // Additive increase; one request per window of successful completions
+    dev->cwnd = MIN(dev->cwnd + 1.0 / dev->cwnd, dev->max_depth);
+}
+
+void common_cc_busy(forensic1394_dev *dev)
+{
+    // Multiplicative decrease
+    dev->cwnd = MAX(1.0, dev->cwnd / 2);
+}
+
+int64_t common_cc_backoff_us(forensic1394_dev *dev, int attempt)
+{
+    uint32_t x = dev->rand_state;
+
+    // Base the delay on the round-trip time, doubling it for each attempt
+    int64_t delay = MAX(dev->srtt_us, FORENSIC1394_TIMEOUT_GRANULARITY_US)
+                  << MIN(attempt, 10);
+
+    // But never wait for longer than the maximum timeout
+    delay = MIN(delay, dev->rto_max_us);
+
+    // Advance the xorshift generator
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    dev->rand_state = x;
+
+    // Jitter the delay uniformly over [delay/2, 3*delay/2)
+    return delay / 2 + x % delay;
+}
+
+void common_batch_init(request_batch *b, request_type t,
+                       forensic1394_priority prio,
+                       const forensic1394_req *req, size_t nreq)
+{
+    assert(prio >= 0 && prio < FORENSIC1394_PRIORITY_NUM);
+
+    b->type         = t;
+    b->prio         = prio;
+    b->req          = req;
+    b->nreq         = nreq;
+    b->lock         = NULL;
+    b->next         = 0;
+    b->in_pipeline  = 0;
+    b->done         = 0;
+    b->ret          = FORENSIC1394_RESULT_SUCCESS;
+    b->complete     = NULL;
+    b->complete_data = NULL;
+    b->link         = NULL;
+    b->submit_link  = NULL;
+}
+
+void common_sched_enqueue(forensic1394_dev *dev, request_batch *b)
+{
+    request_sched *s = &dev->sched;
+
+    b->link = NULL;
+
+    if (s->tail[b->prio])
+    {
+        s->tail[b->prio]->link = b;
+    }
+    else
+    {
+        s->head[b->prio] = b;
+    }
+
+    s->tail[b->prio] = b;
+}
+
+void common_sched_remove(forensic1394_dev *dev, request_batch *b)
+{
+    request_sched *s = &dev->sched;
+    request_batch *prev = NULL, *curr;
+
+    // Queues are short; so a linear search is fine
+    for (curr = s->head[b->prio]; curr && curr != b; curr = curr->link)
+    {
+        prev = curr;
+    }
+
+    // Not queued
+    if (!curr)
+    {
+        return;
+    }
+
+    if (prev)
+    {
+        prev->link = b->link;
+    }
+    else
+    {
+        s->head[b->prio] = b->link;
+    }
+
+    if (s->tail[b->prio] == b)
+    {
+        s->tail[b->prio] = prev;
+    }
+
+    b->link = NULL;
+}
+
+request_batch *common_sched_next(forensic1394_dev *dev, int in_pipeline)
+{
+    int p;
+    int window = common_cc_window(dev);
+
+    // Keep a quarter of the window (and at least one slot) for interactive use
+    int reserve = (window > 1) ? MAX(1, window / 4) : 0;
+
+    for (p = FORENSIC1394_PRIORITY_NUM - 1; p >= 0; p--)
+    {
+        request_batch *b;
+
+        // Bulk requests may not use the reserved portion of the window
+        int limit = (p == FORENSIC1394_PRIORITY_BULK) ? window - reserve
+                                                      : window;
+
+        if (in_pipeline >= limit)
+        {
+            continue;
+        }
+
+        // Serve batches in the order they were queued
+        for (b = dev->sched.head[p]; b; b = b->link)
+        {
+            if (!b->done && b->next < b->nreq)
+            {
+                return b;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * The submission queue is that of Vyukov.  Producers atomically swing the head
+ *  to their batch and then link the previous head to it; the consumer follows
+ *  the links from the tail.  A stub batch ensures the queue is never empty from
+ *  the point of view of the producers.
+ */
+void common_mpsc_init(request_mpsc *q)
+{
+    q->stub.submit_link = NULL;
+
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+void common_mpsc_push(request_mpsc *q, request_batch *b)
+{
+    request_batch *prev;
+
+    __atomic_store_n(&b->submit_link, NULL, __ATOMIC_RELAXED);
+
+    prev = __atomic_exchange_n(&q->head, b, __ATOMIC_ACQ_REL);
+
+    // Until this store the batch is not visible to the consumer
+    __atomic_store_n(&prev->submit_link, b, __ATOMIC_RELEASE);
+}
+
+request_batch *common_mpsc_pop(request_mpsc *q)
+{
+    request_batch *tail = q->tail;
+    request_batch *next = __atomic_load_n(&tail->submit_link, __ATOMIC_ACQUIRE);
+
+    // Skip over the stub
+    if (tail == &q->stub)
+    {
+        if (!next)
+        {
+            return NULL;
+        }
+
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->submit_link, __ATOMIC_ACQUIRE);
+    }
+
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+
+    // A producer has swung the head but not yet linked its batch in
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    // Tail is the last batch; re-insert the stub behind it so it can be popped
+    common_mpsc_push(q, &q->stub);
+
+    next = __atomic_load_n(&tail->submit_link, __ATOMIC_ACQUIRE);
+
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+
+    return NULL;
 }
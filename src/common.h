@@ -24,19 +24,153 @@
 
 #define FORENSIC1394_DEV_NAME_SZ 64
 
-/// Request timeout in milliseconds
+/// Initial request timeout in milliseconds; used until the RTT is measured
 #define FORENSIC1394_TIMEOUT_MS  150
 
+/// Default lower bound on the adaptive request timeout in milliseconds
+#define FORENSIC1394_TIMEOUT_MIN_MS  10
+
+/// Default upper bound on the adaptive request timeout in milliseconds
+#define FORENSIC1394_TIMEOUT_MAX_MS  1000
+
+/// Clock granularity assumed when computing the timeout in microseconds
+#define FORENSIC1394_TIMEOUT_GRANULARITY_US  1000
+
+/// Upper limit on the number of requests a device may have in flight
+#define FORENSIC1394_PIPELINE_MAX  32
+
+/// Default number of bytes read ahead of sequential reads; disabled
+#define FORENSIC1394_READ_AHEAD_DEFAULT  0
+
+/// Largest payload of an asynchronous request, regardless of speed
+#define FORENSIC1394_MAX_ASYNC_PAYLOAD  4096
+
+/// Number of times a request is retried when the device reports it is busy
+#define FORENSIC1394_BUSY_RETRIES  8
+
+/// Address of the quadlet read to determine if a device is ready
+#define FORENSIC1394_READY_PROBE_ADDR  0x0
+
+/// Initial delay between readiness probes in milliseconds
+#define FORENSIC1394_READY_BACKOFF_MIN_MS  5
+
+/// Maximum delay between readiness probes in milliseconds
+#define FORENSIC1394_READY_BACKOFF_MAX_MS  250
+
 typedef enum
 {
     REQUEST_TYPE_READ,
-    REQUEST_TYPE_WRITE
+    REQUEST_TYPE_WRITE,
+    REQUEST_TYPE_LOCK
 } request_type;
 
+/**
+ * A batch of requests made by a single call into the library.  Batches are
+ *  queued on their device and scheduled onto the request pipeline by
+ *  ::common_sched_next.
+ */
+typedef struct _request_batch request_batch;
+
+struct _request_batch
+{
+    request_type type;
+    forensic1394_priority prio;
+
+    const forensic1394_req *req;
+    size_t nreq;
+
+    /// The requests of a lock batch, in place of req
+    const forensic1394_lock_req *lock;
+
+    /// Index of the next request to be sent
+    size_t next;
+
+    /// Number of requests in the pipeline (including those awaiting a retry)
+    int in_pipeline;
+
+    /// Non-zero once the batch has completed, successfully or otherwise
+    int done;
+    forensic1394_result ret;
+
+    /// Optional function to call once the batch has completed
+    void (*complete)(request_batch *b);
+    void *complete_data;
+
+    /// Linkage for the scheduling queues
+    request_batch *link;
+
+    /// Linkage for the lock-free submission queue
+    request_batch *submit_link;
+};
+
+/**
+ * An intrusive, lock-free, multi-producer single-consumer queue of batches.
+ *  Any number of threads may push concurrently while a single thread pops.
+ */
+typedef struct
+{
+    request_batch *head;
+    request_batch *tail;
+    request_batch stub;
+} request_mpsc;
+
+/// Number of scheduling classes
+#define FORENSIC1394_PRIORITY_NUM 2
+
+/**
+ * Per-device queues of batches, one for each scheduling class.
+ */
+typedef struct
+{
+    request_batch *head[FORENSIC1394_PRIORITY_NUM];
+    request_batch *tail[FORENSIC1394_PRIORITY_NUM];
+} request_sched;
+
+/**
+ * Read-ahead state of a device.  A forensic1394_read_device call starting
+ *  where the previous one finished is taken to be part of a sequential stream
+ *  and the window following it is read in a single pipelined batch.  Further
+ *  calls continuing the stream are then served from the window.
+ */
+typedef struct
+{
+    /// Number of bytes to read ahead; 0 if disabled
+    size_t window;
+
+    /// Address following the most recent read
+    uint64_t next;
+
+    /// Data read ahead, covering [base, base + len)
+    char *buf;
+    size_t bufsz;
+    uint64_t base;
+    size_t len;
+
+    /// Requests used to fill the window
+    forensic1394_req *req;
+    size_t nreqsz;
+
+    /// Value of wgen when the window was filled
+    uint32_t gen;
+
+    /// Incremented by every write to the device, invalidating the window
+    uint32_t wgen;
+
+    /// Reading ahead failed; do not try again before this address
+    uint64_t skip_until;
+
+    /// Held by the thread using the state
+    char busy;
+} read_ahead_state;
+
 typedef struct _platform_bus platform_bus;
 
 typedef struct _platform_dev platform_dev;
 
+typedef struct _platform_map platform_map;
+
+typedef struct _csr_index csr_index;
+
 struct _forensic1394_bus
 {
     int sbp2_enabled;
@@ -50,6 +184,21 @@ struct _forensic1394_bus
 
     forensic1394_device_callback ondestroy;
 
+    /// Non-zero if devices being added/removed are being monitored for
+    int hotplug;
+    forensic1394_device_callback onadd;
+    forensic1394_device_callback onremove;
+
+    /// Non-zero if the bus has been scanned since monitoring began
+    int scanned;
+
+    /// Result of the most recent scan
+    forensic1394_result scan_ret;
+
+    /// Non-zero if only devices matching filter are wanted
+    int filtered;
+    forensic1394_filter filter;
+
     platform_bus *pbus;
 };
 
@@ -61,25 +210,211 @@ struct _forensic1394_dev
     char vendor_name[FORENSIC1394_DEV_NAME_SZ];
     int vendor_id;
 
+    /// Maximum request size given by the ROM of the device
     int max_req;
 
+    /// Speed of the path to the device
+    forensic1394_speed speed;
+
     int is_open;
 
+    int use_io_thread;
+
     uint16_t node_id;
     uint32_t generation;
 
     int64_t guid;
 
+    int64_t srtt_us;
+    int64_t rttvar_us;
+    int64_t rto_us;
+    int64_t rto_min_us;
+    int64_t rto_max_us;
+
+    int max_depth;
+    double cwnd;
+    uint32_t rand_state;
+
+    request_sched sched;
+
+    read_ahead_state ra;
+
+    /// Memory mappings of the device
+    platform_map *maps;
+
     uint32_t rom[FORENSIC1394_CSR_SZ];
 
+    /// The parsed ROM; NULL until first required
+    csr_index *csr;
+
     void *user_data;
 
+    /// Non-zero if the device was found by the most recent scan
+    int seen;
+
     platform_dev *pdev;
     forensic1394_bus *bus;
 
     forensic1394_dev *next;
 };
 
+/**
+ * Returns non-zero if a node with the GUID \a guid may be wanted by the
+ *  device filter of \a bus.  Backends which can find the GUID of a node
+ *  cheaply may use this to avoid opening unwanted nodes.
+ */
+int common_filter_guid(forensic1394_bus *bus, int64_t guid);
+
+/**
+ * Returns non-zero if the node with the configuration ROM \a rom is wanted by
+ *  the device filter of \a bus.  Backends should call this before creating a
+ *  device for a node.
+ */
+int common_filter_rom(forensic1394_bus *bus, const uint32_t *rom);
+
+/**
+ * Initialises the platform-independent state of a newly allocated device.
+ *  This method should be called by platform backends before any requests are
+ *  made of the device.
+ *
+ *   \param dev The device.
+ */
+void common_init_device(forensic1394_dev *dev);
+
+/**
+ * Returns the current value of a monotonic clock in microseconds.
+ *
+ *  \return The time in microseconds from an arbitrary epoch.
+ */
+int64_t common_get_time_us(void);
+
+/**
+ * Returns non-zero if the lock operation \a op takes an argument as well as a
+ *  data value.
+ */
+int common_lock_has_arg(forensic1394_lock_op op);
+
+/**
+ * Assembles the payload of the lock request \a r, the argument (if any)
+ *  followed by the data value, into \a buf; which must be at least 16 bytes.
+ *
+ *  \return The length of the payload in bytes.
+ */
+size_t common_lock_payload(const forensic1394_lock_req *r, void *buf);
+
+/**
+ * Updates the round-trip time estimate for \a dev with the sample \a rtt_us
+ *  and recomputes the request timeout.  The estimator follows that of TCP,
+ *  tracking both a smoothed mean and a mean deviation.
+ *
+ *   \param dev The device.
+ *   \param rtt_us The measured round-trip time in microseconds.
+ */
+void common_rtt_sample(forensic1394_dev *dev, int64_t rtt_us);
+
+/**
+ * Backs off the request timeout for \a dev following a timeout.
+ *
+ *   \param dev The device.
+ */
+void common_rtt_timeout(forensic1394_dev *dev);
+
+/**
+ * Returns the number of requests which may currently be in flight to \a dev.
+ *  This is the congestion window rounded down and is always at least one.
+ *
+ *   \param dev The device.
+ *  \return The size of the congestion window.
+ */
+int common_cc_window(forensic1394_dev *dev);
+
+/**
+ * Notifies the congestion controller for \a dev that a request completed
+ *  successfully.  This grows the window additively, by roughly one request per
+ *  window's worth of completions.
+ *
+ *   \param dev The device.
+ */
+void common_cc_success(forensic1394_dev *dev);
+
+/**
+ * Notifies the congestion controller for \a dev that a request was rejected
+ *  as the device is busy.  This halves the window.
+ *
+ *   \param dev The device.
+ */
+void common_cc_busy(forensic1394_dev *dev);
+
+/**
+ * Returns how long to wait before retrying a request to \a dev which has been
+ *  rejected \a attempt times on account of the device being busy.  The delay
+ *  grows exponentially with \a attempt and is jittered so that retries of
+ *  concurrent requests do not arrive at the device in lockstep.
+ *
+ *   \param dev The device.
+ *   \param attempt The number of times the request has been rejected.
+ *  \return The delay in microseconds.
+ */
+int64_t common_cc_backoff_us(forensic1394_dev *dev, int attempt);
+
+/**
+ * Initialises \a b as a batch of \a nreq requests, \a req, of type \a t and
+ *  priority \a prio.
+ */
+void common_batch_init(request_batch *b, request_type t,
+                       forensic1394_priority prio,
+                       const forensic1394_req *req, size_t nreq);
+
+/**
+ * Appends the batch \a b to the end of the queue for its scheduling class.
+ *
+ *   \param dev The device.
+ *   \param b The batch to enqueue.
+ */
+void common_sched_enqueue(forensic1394_dev *dev, request_batch *b);
+
+/**
+ * Removes the batch \a b from the scheduling queues of \a dev.
+ *
+ *   \param dev The device.
+ *   \param b The batch to remove.
+ */
+void common_sched_remove(forensic1394_dev *dev, request_batch *b);
+
+/**
+ * Decides which batch, if any, the next request to be placed into the pipeline
+ *  should come from.  Interactive batches are always preferred over bulk
+ *  batches.  Bulk batches are further prevented from occupying the final
+ *  quarter of the congestion window so that there is always space in the
+ *  pipeline for an interactive request.
+ *
+ *   \param dev The device.
+ *   \param in_pipeline The total number of requests in the pipeline.
+ *  \return The batch to take the next request from, or NULL if no request
+ *          should be sent at this time.
+ */
+request_batch *common_sched_next(forensic1394_dev *dev, int in_pipeline);
+
+/**
+ * Initialises the submission queue \a q to be empty.
+ */
+void common_mpsc_init(request_mpsc *q);
+
+/**
+ * Pushes the batch \a b onto the submission queue \a q.  This method is
+ *  wait-free and may be called by any number of threads concurrently.
+ */
+void common_mpsc_push(request_mpsc *q, request_batch *b);
+
+/**
+ * Pops the oldest batch from the submission queue \a q.  This method must
+ *  only ever be called by a single thread.
+ *
+ *  \return The oldest batch in the queue or NULL if the queue is empty (or a
+ *          push is part-way through).
+ */
+request_batch *common_mpsc_pop(request_mpsc *q);
+
 platform_bus *platform_bus_alloc(void);
 
 void platform_bus_destroy(forensic1394_bus *bus);
@@ -87,7 +422,35 @@ void platform_bus_destroy(forensic1394_bus *bus);
 forensic1394_result platform_enable_sbp2(forensic1394_bus *bus,
                                          const uint32_t *sbp2dir, size_t len);
 
-forensic1394_result platform_update_device_list(forensic1394_bus *bus);
+/**
+ * Scans the devices attached to \a bus, returning them in the linked list
+ *  \a found.  The devices are allocated afresh; matching them up with those
+ *  already on the bus is left to the caller.
+ */
+forensic1394_result platform_update_device_list(forensic1394_bus *bus,
+                                                forensic1394_dev **found);
+
+/**
+ * Brings the existing device \a dev up to date with \a cand, a freshly
+ *  scanned device with the same GUID and ROM.  If successful \a cand is left
+ *  to be destroyed by the caller.
+ *
+ *  \return Non-zero if \a dev was updated, zero if \a dev can not follow the
+ *          node and should be replaced by \a cand.
+ */
+int platform_merge_device(forensic1394_dev *dev, forensic1394_dev *cand);
+
+forensic1394_result platform_enable_hotplug(forensic1394_bus *bus);
+
+int platform_get_hotplug_fd(forensic1394_bus *bus);
+
+/**
+ * Consumes any pending hotplug notifications for \a bus.
+ *
+ *  \return Non-zero if devices may have been added or removed since the last
+ *          call.
+ */
+int platform_poll_hotplug(forensic1394_bus *bus);
 
 void platform_device_destroy(forensic1394_dev *dev);
 
@@ -95,9 +458,45 @@ forensic1394_result platform_open_device(forensic1394_dev *dev);
 
 void platform_close_device(forensic1394_dev *dev);
 
+/**
+ * Sleeps for up to \a timeout_us microseconds, returning early if a bus reset
+ *  occurs on the bus of \a dev.  Following a reset the node ID and generation
+ *  of \a dev are brought up to date.
+ *
+ *  \return Non-zero if a bus reset occurred.
+ */
+int platform_wait_bus_reset(forensic1394_dev *dev, int64_t timeout_us);
+
 forensic1394_result platform_send_requests(forensic1394_dev *dev,
                                            request_type type,
+                                           forensic1394_priority prio,
                                            const forensic1394_req *req,
                                            size_t nreq);
 
+forensic1394_result platform_lock_requests(forensic1394_dev *dev,
+                                           forensic1394_priority prio,
+                                           const forensic1394_lock_req *req,
+                                           size_t nreq);
+
+/**
+ * Maps \a len bytes of \a dev at \a base, adding the mapping to the list of
+ *  those of \a dev.
+ *
+ *  \return A pointer to the memory at \a base or NULL on error.
+ */
+const void *platform_map_device(forensic1394_dev *dev, uint64_t base,
+                                size_t len);
+
+forensic1394_result platform_refresh_map(forensic1394_dev *dev,
+                                         const void *addr, size_t len);
+
+forensic1394_result platform_invalidate_map(forensic1394_dev *dev,
+                                            const void *addr, size_t len);
+
+/**
+ * Removes the mapping of \a dev at \a addr; or, if \a addr is NULL, all of
+ *  its mappings.
+ */
+void platform_unmap_device(forensic1394_dev *dev, const void *addr);
+
 #endif // FORENSIC1394_COMMON_H
@@ -19,6 +19,7 @@
 
 #include "csr.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -32,6 +33,11 @@
 #define CSR_MODEL_KEY       0x17
 #define CSR_DESC_LEAF_KEY   0x81
 
+#define CSR_TYPE(key)       ((key) >> 6)
+
+/// The maximum number of distinct directories a 256-quadlet ROM can contain
+#define CSR_MAX_DIRS        256
+
 /**
  * Returns the length of the directory starting at \a rom[diroff].  This length
  *  is inclusive.  Before returning the length is checked to ensure that the
@@ -72,6 +78,21 @@ static void parse_text_leaf(const uint32_t *rom, size_t offset,
 static void parse_key(const uint32_t *rom, size_t diroff, int key,
                       int *value, char *bufval, size_t buflen);
 
+/**
+ * Walks every directory in \a rom, breadth first from the root directory,
+ *  producing an index of all entries.  Directories referenced more than once
+ *  (including those in loops) are only walked once.
+ *
+ *   \param rom The CSR in host-endian order.
+ *  \return The index or NULL if memory could not be allocated.
+ */
+static csr_index *parse_index(const uint32_t *rom);
+
+/**
+ * Frees \a idx along with any text which has been decoded.
+ */
+static void free_index(csr_index *idx);
+
 
 void common_parse_csr(forensic1394_dev *dev)
 {    
@@ -124,6 +145,266 @@ void common_parse_csr(forensic1394_dev *dev)
               dev->product_name, sizeof(dev->product_name));
 }
 
+void common_parse_csr_ids(const uint32_t *rom, int64_t *guid,
+                          int *vendor_id, int *product_id)
+{
+    size_t buslen = get_length(rom, 0);
+
+    *guid = 0;
+    *vendor_id = 0;
+    *product_id = 0;
+
+    // If less than five, give up
+    if (buslen < 5)
+    {
+        return;
+    }
+
+    *guid = (int64_t) rom[3] << 32 | (int64_t) rom[4];
+
+    parse_key(rom, buslen, CSR_VENDOR_KEY, vendor_id, NULL, 0);
+    parse_key(rom, buslen, CSR_MODEL_KEY, product_id, NULL, 0);
+}
+
+csr_index *common_csr_index(forensic1394_dev *dev)
+{
+    csr_index *idx = __atomic_load_n(&dev->csr, __ATOMIC_ACQUIRE);
+    csr_index *expected = NULL;
+
+    if (idx)
+    {
+        return idx;
+    }
+
+    if (!(idx = parse_index(dev->rom)))
+    {
+        return NULL;
+    }
+
+    // Publish the index; should another thread have beaten us use theirs
+    if (!__atomic_compare_exchange_n(&dev->csr, &expected, idx, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free_index(idx);
+        idx = expected;
+    }
+
+    return idx;
+}
+
+const char *common_csr_text(forensic1394_dev *dev, int entry)
+{
+    csr_index *idx = common_csr_index(dev);
+    const forensic1394_csr_entry *e;
+    char *text, *expected = NULL;
+    size_t textlen;
+
+    if (!idx)
+    {
+        return NULL;
+    }
+
+    e = &idx->entry[entry];
+
+    if (e->key != CSR_DESC_LEAF_KEY || e->offset < 0)
+    {
+        return NULL;
+    }
+
+    // See if the text has already been decoded
+    if ((text = __atomic_load_n(&idx->text[entry], __ATOMIC_ACQUIRE)))
+    {
+        return text;
+    }
+
+    // Two quadlets of the body specify the language; the rest are text
+    textlen = (e->length > 2) ? (e->length - 2) * 4 : 0;
+
+    if (!(text = malloc(textlen + 1)))
+    {
+        return NULL;
+    }
+
+    if (textlen)
+    {
+        parse_text_leaf(dev->rom, e->offset, text, textlen + 1);
+    }
+    else
+    {
+        text[0] = '\0';
+    }
+
+    if (!__atomic_compare_exchange_n(&idx->text[entry], &expected, text, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free(text);
+        text = expected;
+    }
+
+    return text;
+}
+
+void common_free_csr_index(forensic1394_dev *dev)
+{
+    if (dev->csr)
+    {
+        free_index(dev->csr);
+        dev->csr = NULL;
+    }
+}
+
+csr_index *parse_index(const uint32_t *rom)
+{
+    int diroff[CSR_MAX_DIRS], dirfirst[CSR_MAX_DIRS], dirlen[CSR_MAX_DIRS];
+    int unit[CSR_MAX_DIRS];
+    int ndir = 0, nunit = 0, nentry = 0, maxentry = 0;
+    int d, i;
+
+    forensic1394_csr_entry *entry = NULL;
+    csr_index *idx;
+
+    size_t buslen = get_length(rom, 0);
+
+    // The root directory is located directly after the bus information block
+    if (buslen >= 5 && get_length(rom, buslen))
+    {
+        diroff[ndir++] = buslen;
+    }
+
+    for (d = 0; d < ndir; d++)
+    {
+        size_t j, nq = get_length(rom, diroff[d]);
+
+        dirfirst[d] = nentry;
+        dirlen[d] = nq - 1;
+
+        // Grow the entry array as required
+        if (nentry + dirlen[d] > maxentry)
+        {
+            forensic1394_csr_entry *nentries;
+
+            maxentry = 2*maxentry + dirlen[d];
+            nentries = realloc(entry, sizeof(*entry) * maxentry);
+
+            if (!nentries)
+            {
+                free(entry);
+                return NULL;
+            }
+
+            entry = nentries;
+        }
+
+        for (j = 1; j < nq; j++)
+        {
+            uint32_t q = rom[diroff[d] + j];
+            forensic1394_csr_entry *e = &entry[nentry++];
+            size_t target, tlen;
+
+            e->key = CSR_KEY(q);
+            e->value = CSR_VALUE(q);
+            e->offset = -1;
+            e->length = 0;
+            e->dir = -1;
+
+            // Immediate values and CSR offsets point to nothing in the ROM
+            if (CSR_TYPE(e->key) < FORENSIC1394_CSR_LEAF)
+            {
+                continue;
+            }
+
+            // Leaves and directories are addressed relative to the entry
+            target = diroff[d] + j + e->value;
+            tlen = get_length(rom, target);
+
+            if (tlen == 0)
+            {
+                continue;
+            }
+
+            e->offset = target;
+            e->length = tlen - 1;
+
+            if (CSR_TYPE(e->key) != FORENSIC1394_CSR_DIRECTORY)
+            {
+                continue;
+            }
+
+            // See if the directory has already been seen
+            for (i = 0; i < ndir && diroff[i] != (int) target; i++);
+
+            // If not, queue it up to be walked
+            if (i == ndir)
+            {
+                if (ndir == CSR_MAX_DIRS)
+                {
+                    continue;
+                }
+
+                diroff[ndir++] = target;
+
+                if (e->key == (CSR_DIRECTORY | CSR_UNIT))
+                {
+                    unit[nunit++] = i;
+                }
+            }
+
+            e->dir = i;
+        }
+    }
+
+    idx = calloc(1, sizeof(*idx));
+
+    if (!idx)
+    {
+        free(entry);
+        return NULL;
+    }
+
+    idx->entry = entry;
+    idx->nentry = nentry;
+    idx->ndir = ndir;
+    idx->nunit = nunit;
+
+    // Allocate one extra element of each so that none of the sizes are zero
+    idx->dir_first = malloc(sizeof(int) * (ndir + 1));
+    idx->dir_len = malloc(sizeof(int) * (ndir + 1));
+    idx->unit = malloc(sizeof(int) * (nunit + 1));
+    idx->text = calloc(nentry + 1, sizeof(char *));
+
+    if (!idx->dir_first || !idx->dir_len || !idx->unit || !idx->text)
+    {
+        free_index(idx);
+        return NULL;
+    }
+
+    memcpy(idx->dir_first, dirfirst, sizeof(int) * ndir);
+    memcpy(idx->dir_len, dirlen, sizeof(int) * ndir);
+    memcpy(idx->unit, unit, sizeof(int) * nunit);
+
+    return idx;
+}
+
+void free_index(csr_index *idx)
+{
+    int i;
+
+    if (idx->text)
+    {
+        for (i = 0; i < idx->nentry; i++)
+        {
+            free(idx->text[i]);
+        }
+    }
+
+    free(idx->text);
+    free(idx->unit);
+    free(idx->dir_len);
+    free(idx->dir_first);
+    free(idx->entry);
+    free(idx);
+}
+
 size_t get_length(const uint32_t *rom, size_t diroff)
 {
     size_t nquad;
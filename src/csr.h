@@ -55,4 +55,61 @@
  */
 void common_parse_csr(forensic1394_dev *dev);
 
+/**
+ * Extracts just the GUID and the vendor and product IDs from \a rom, without
+ *  requiring a device.  Fields which are not present in the ROM are set to 0.
+ *
+ *   \param rom The CSR in host-endian order.
+ *   \param[out] guid The GUID of the device.
+ *   \param[out] vendor_id The vendor ID of the device.
+ *   \param[out] product_id The product ID of the device.
+ */
+void common_parse_csr_ids(const uint32_t *rom, int64_t *guid,
+                          int *vendor_id, int *product_id);
+
+/**
+ * A configuration ROM parsed in its entirety.
+ */
+struct _csr_index
+{
+    /// The entries of all directories, stored directory by directory
+    forensic1394_csr_entry *entry;
+    int nentry;
+
+    /// The index of the first entry and the number of entries of each directory
+    int *dir_first;
+    int *dir_len;
+    int ndir;
+
+    /// Directory numbers of the unit directories
+    int *unit;
+    int nunit;
+
+    /// Decoded textual descriptors, by entry; NULL if yet to be decoded
+    char **text;
+};
+
+/**
+ * Returns the parsed form of the ROM of \a dev, parsing it if necessary.  The
+ *  result is cached on \a dev; this method is safe to call from multiple
+ *  threads.
+ *
+ *   \param dev The device.
+ *  \return The index or NULL if memory could not be allocated.
+ */
+csr_index *common_csr_index(forensic1394_dev *dev);
+
+/**
+ * Returns the text of the textual descriptor leaf at \a entry of the index of
+ *  \a dev, decoding it if necessary.  The result is cached on \a dev.
+ *
+ *  \return The text or NULL if the entry is not a textual descriptor leaf.
+ */
+const char *common_csr_text(forensic1394_dev *dev, int entry);
+
+/**
+ * Frees the parsed form of the ROM of \a dev, if any.
+ */
+void common_free_csr_index(forensic1394_dev *dev);
+
 #endif // FORENSIC1394_CSR_H
@@ -55,9 +55,6 @@
  * // Enabls SBP-2; required for memory access to some systems
  * forensic1394_enable_sbp2(bus);
  *
- * // Give the bus time to reinitialise
- * sleep(2);
- *
  * // Get the devices attached to the systen
  * dev = forensic1394_get_devices(bus, NULL, NULL);
  * assert(dev);
@@ -65,6 +62,9 @@
  * // Open the first device
  * forensic1394_open_device(dev[0]);
  *
+ * // Give the device up to five seconds to react to SBP-2 being enabled
+ * forensic1394_wait_device_ready(dev[0], 5000);
+ *
  * // Read some memory from the device
  * forensic1394_read_device(dev[0], 50 * 1024 * 1024, 512, data);
  *
@@ -80,11 +80,9 @@
  *  GNU/Linux, it is necessary to present the target system with an SBP-2 unit
  *  directory.  This can be done by calling ::forensic1394_enable_sbp2.  It is
  *  usual for devices on the bus to take a couple of seconds to react to this
- *  change.  Therefore, client applications should ideally wait for ~2 seconds
- *  before attempting to read or write to a device.  Although there are
- *  provisions in the SBP-2 specification to determine when a target system has
- *  enabled the DMA filter, client-side API limitations currently prevent
- *  libforensic1394 from leveraging this.
+ *  change.  Rather than waiting for a fixed period client applications should
+ *  call ::forensic1394_wait_device_ready after opening a device, which returns
+ *  as soon as the device permits memory to be read.
  *
  * \section reset Handling Bus Resets
  * Bus resets occur when devices are added/removed from the system or when the
@@ -98,21 +96,34 @@
  *
  * After a bus reset calls to all of these methods will result in
  *  #FORENSIC1394_RESULT_BUS_RESET being returned.  Applications should
- *  handle this by saving the GUIDs of any devices being accessed and then call
- *  ::forensic1394_get_devices.  Calling this will void all device handles.
- *  The new list of devices can then be iterated through and their GUIDs
- *  compared against saved GUIDs.  The GUID of a device can be obtained by
- *  calling ::forensic1394_get_device_guid.
+ *  handle this by calling ::forensic1394_get_devices.  Devices which are still
+ *  attached to the bus keep their existing handles, which remain open, while
+ *  the handles of devices which have gone away are destroyed.  Devices are
+ *  matched up across rescans by their GUID, which can be obtained by calling
+ *  ::forensic1394_get_device_guid.  Under Linux/Juju an open device follows
+ *  bus resets by itself, so requests which fail on account of a reset may
+ *  simply be retried.
+ *
+ * Rescanning the bus can be made almost free by enabling hotplug monitoring
+ *  through ::forensic1394_enable_hotplug.  The bus is then only rescanned when
+ *  devices are added or removed.
  *
  * \section thread Thread Safety
  * libforensic1394 is thread safe at the device level with the restriction
  *  that devices can only be accessed by the thread that opened them.  This is
  *  because some backends, namely Mac OS X/IOKit, install thread-specific
- *  callback dispatchers upon opening a device.  When using multiple threads of
- *  execution care must be taken when calling ::forensic1394_get_devices (which
- *  closes and destroys any open device handles).  It is the responsibility of
- *  the caller to ensure that this is safe.  The process can be simplified
- *  through the use of an \a ondestroy callback handler.
+ *  callback dispatchers upon opening a device.  Under Linux/Juju this
+ *  restriction does not apply to the read and write methods; several threads
+ *  may make requests of the same open device concurrently, with the requests
+ *  being multiplexed onto the device according to their
+ *  ::forensic1394_priority.  When a device is to be shared between many
+ *  threads it should be given an I/O thread of its own through
+ *  ::forensic1394_set_device_io_thread.  When using multiple threads of
+ *  execution care must be taken when calling ::forensic1394_get_devices or
+ *  ::forensic1394_process_hotplug (which destroy the handles of any devices
+ *  which have been removed).  It is the responsibility of the caller to ensure
+ *  that this is safe.  The process can be simplified through the use of an
+ *  \a ondestroy callback handler.
  *
  * \author Freddie Witherden
  */
@@ -144,6 +155,9 @@ typedef struct _forensic1394_bus forensic1394_bus;
 /// An opaque device handle
 typedef struct _forensic1394_dev forensic1394_dev;
 
+/// An opaque handle for a set of watched memory ranges
+typedef struct _forensic1394_watch forensic1394_watch;
+
 /**
  * \brief A request structure used for making batch read/write requests.
  *
@@ -166,6 +180,59 @@ typedef struct _forensic1394_req
     void        *buf;
 } forensic1394_req;
 
+/**
+ * \brief Atomic operations which can be performed by a lock request.
+ *
+ * These are the extended transaction codes of IEEE 1394.  Where an operation
+ *  takes an argument, \c arg, it is sent along with the data value, \c data;
+ *  in every case the target replaces the \c old value at the address with the
+ *  \c new value given below in a single, atomic, step.  Values are compared
+ *  and added as big-endian integers except for little_add.
+ *
+ * \sa forensic1394_lock_device
+ */
+typedef enum
+{
+    /// new = data | (old & ~arg)
+    FORENSIC1394_LOCK_MASK_SWAP     = 1,
+    /// new = (old == arg) ? data : old
+    FORENSIC1394_LOCK_COMPARE_SWAP  = 2,
+    /// new = old + data; takes no argument
+    FORENSIC1394_LOCK_FETCH_ADD     = 3,
+    /// new = old + data, little-endian; takes no argument
+    FORENSIC1394_LOCK_LITTLE_ADD    = 4,
+    /// new = (old != arg) ? old + data : old
+    FORENSIC1394_LOCK_BOUNDED_ADD   = 5,
+    /// new = (old != arg) ? old + data : data
+    FORENSIC1394_LOCK_WRAP_ADD      = 6
+} forensic1394_lock_op;
+
+/**
+ * \brief A request structure used for making batch lock requests.
+ *
+ * \sa forensic1394_lock_device_v
+ */
+typedef struct _forensic1394_lock_req
+{
+    /// The address to operate on; must be aligned to \a len
+    uint64_t                addr;
+
+    /// The operation to perform
+    forensic1394_lock_op    op;
+
+    /// Size of the operands in bytes; either 4 or 8
+    size_t                  len;
+
+    /// The argument; ignored by fetch_add and little_add
+    const void              *arg;
+
+    /// The data value
+    const void              *data;
+
+    /// Buffer to receive the old value; may be NULL
+    void                    *old;
+} forensic1394_lock_req;
+
 /**
  * \brief Number of uint32 elements required to store a device ROM.
  *
@@ -174,13 +241,55 @@ typedef struct _forensic1394_req
  */
 #define FORENSIC1394_CSR_SZ 256
 
+/**
+ * \brief Types of configuration ROM directory entries.
+ *
+ * The type of an entry is given by the upper two bits of its key.
+ */
+typedef enum
+{
+    /// The value of the entry is the datum itself
+    FORENSIC1394_CSR_IMMEDIATE  = 0,
+    /// The value of the entry is an offset into the CSR address space
+    FORENSIC1394_CSR_OFFSET     = 1,
+    /// The entry points to a leaf
+    FORENSIC1394_CSR_LEAF       = 2,
+    /// The entry points to a directory
+    FORENSIC1394_CSR_DIRECTORY  = 3
+} forensic1394_csr_type;
+
+/**
+ * \brief A parsed entry from a configuration ROM directory.
+ *
+ * \sa forensic1394_get_device_csr_dir
+ */
+typedef struct _forensic1394_csr_entry
+{
+    /// The 8-bit key; the upper two bits are the ::forensic1394_csr_type
+    int         key;
+
+    /// The 24-bit value of the entry
+    uint32_t    value;
+
+    /// For leaves and directories their offset in the ROM in quadlets; else -1
+    int         offset;
+
+    /// For leaves and directories the number of quadlets in their body; else 0
+    int         length;
+
+    /// For directories the index of the directory; else -1
+    int         dir;
+} forensic1394_csr_entry;
+
 /**
  * A function to be called when a ::forensic1394_dev is about to be destroyed.
  *  This should be passed to ::forensic1394_get_devices and will be associated
  *  with all devices returned by the method.  The callback will fire either when
- *  the bus is destroyed via ::forensic1394_destroy or the next time that
- *  ::forensic1394_get_devices is called (which has the implicit effect of
- *  destroying all existing devices first).
+ *  the bus is destroyed via ::forensic1394_destroy or when a rescan of the bus
+ *  finds that the device is no longer attached.
+ *
+ * Callbacks of this type are also used to notify applications of devices being
+ *  added to and removed from the bus.
  *
  * If user data is required it can be attached on either a per-bus or per-device
  *  level.
@@ -194,6 +303,69 @@ typedef struct _forensic1394_req
 typedef void (*forensic1394_device_callback) (forensic1394_bus *bus,
                                               forensic1394_dev *dev);
 
+/**
+ * A function used to decide whether a node should be included when scanning
+ *  the bus.  The function is given the configuration ROM of the node before a
+ *  device is created for it.
+ *
+ *   \param bus The bus being scanned.
+ *   \param rom The ROM of the node, of #FORENSIC1394_CSR_SZ elements in
+ *              host-endian order.
+ *   \param data The \a match_data of the filter.
+ *  \return Non-zero if the node should be included, zero otherwise.
+ *
+ * \sa forensic1394_filter
+ */
+typedef int (*forensic1394_node_filter) (forensic1394_bus *bus,
+                                         const uint32_t *rom,
+                                         void *data);
+
+/**
+ * A function to be called when the contents of a watched memory range change.
+ *  Both \a prev and \a cur are only valid for the duration of the call.
+ *
+ * If user data is required it can be attached to the watch.
+ *
+ *   \param watch The watch the range belongs to.
+ *   \param i The index of the range, as returned by ::forensic1394_watch_add.
+ *   \param prev The previous contents of the range.
+ *   \param cur The current contents of the range.
+ *
+ * \sa forensic1394_set_watch_user_data
+ */
+typedef void (*forensic1394_watch_callback) (forensic1394_watch *watch,
+                                             int i,
+                                             const void *prev,
+                                             const void *cur);
+
+/**
+ * \brief Criteria a node must meet in order to be included in a scan.
+ *
+ * A node is included if it meets all of the criteria given; those which are
+ *  zero, or NULL, are ignored.  As only matching nodes are turned into devices
+ *  a filter reduces the cost of scanning a crowded bus.  When only a GUID is
+ *  given some backends can skip over other nodes without opening them at all.
+ *
+ * \sa forensic1394_get_devices_filtered
+ */
+typedef struct _forensic1394_filter
+{
+    /// GUID of the device; 0 to match any device
+    int64_t     guid;
+
+    /// Vendor ID of the device; 0 to match any vendor
+    int         vendor_id;
+
+    /// Product ID of the device; 0 to match any product
+    int         product_id;
+
+    /// Additional predicate; NULL for none
+    forensic1394_node_filter match;
+
+    /// User data for the predicate
+    void        *match_data;
+} forensic1394_filter;
+
 /**
  * \brief Possible return status codes.
  *
@@ -226,6 +398,53 @@ typedef enum
     FORENSIC1394_RESULT_END         = -8
 } forensic1394_result;
 
+/**
+ * \brief Scheduling classes for requests.
+ *
+ * When several threads make requests of the same device concurrently requests
+ *  of the interactive class are placed into the pipeline ahead of any bulk
+ *  requests.  Furthermore, a portion of the pipeline is reserved for
+ *  interactive requests so that they are never stuck behind a long queue of
+ *  bulk requests.
+ *
+ * \sa forensic1394_read_device_v_priority
+ * \sa forensic1394_write_device_v_priority
+ */
+typedef enum
+{
+    /// Throughput-orientated requests, such as those made when dumping memory
+    FORENSIC1394_PRIORITY_BULK          = 0,
+    /// Latency-sensitive requests, such as those made when browsing memory
+    FORENSIC1394_PRIORITY_INTERACTIVE   = 1
+} forensic1394_priority;
+
+/**
+ * \brief Speeds at which a device may be communicated with.
+ *
+ * The speed of a device is that of the slowest hop on the path between it and
+ *  the local node.  It bounds the size of the requests which can be made of
+ *  the device, from 512 bytes at S100 doubling with each step up in speed.
+ *
+ * \sa forensic1394_get_device_speed
+ */
+typedef enum
+{
+    /// The speed is not known, as the device has not been opened
+    FORENSIC1394_SPEED_UNKNOWN  = -1,
+    /// 98.304 Mbit/s
+    FORENSIC1394_SPEED_S100     = 0,
+    /// 196.608 Mbit/s
+    FORENSIC1394_SPEED_S200     = 1,
+    /// 393.216 Mbit/s
+    FORENSIC1394_SPEED_S400     = 2,
+    /// 786.432 Mbit/s
+    FORENSIC1394_SPEED_S800     = 3,
+    /// 1.6 Gbit/s
+    FORENSIC1394_SPEED_S1600    = 4,
+    /// 3.2 Gbit/s
+    FORENSIC1394_SPEED_S3200    = 5
+} forensic1394_speed;
+
 /**
  * \brief Allocates a new forensic1394 handle.
  *
@@ -269,14 +488,22 @@ forensic1394_enable_sbp2(forensic1394_bus *bus);
  *   - < 0 then the call was not successful and it contains the appropriate
  *      ::forensic1394_result error code.
  *
- * Getting the attached devices is a destructive process; voiding any existing
- *  device handles.  To compensate for this the \a ondestroy callback is
- *  provided.  This argument, if not NULL, will be called when the new device
- *  list is destroyed, usually as a result of a subsequent call to
- *  ::forensic1394_get_devices or a call to ::forensic1394_destroy.  The
- *  function is called for each device in the list.
+ * Devices which were returned by a previous call and are still attached to
+ *  the bus, as identified by their GUID, are returned with the same handle.
+ *  Such handles remain valid and, if open, remain open.  Handles of devices
+ *  which are no longer attached are destroyed.  To help keep track of this the
+ *  \a ondestroy callback is provided.  This argument, if not NULL, will be
+ *  called when a device is destroyed, usually as a result of a subsequent call
+ *  to ::forensic1394_get_devices or a call to ::forensic1394_destroy.
+ *
+ * If hotplug monitoring has been enabled and no devices have been added or
+ *  removed since the last call the bus is not rescanned at all.  Under
+ *  Linux/Juju nodes are probed concurrently and those which fail to respond
+ *  within a second are skipped, in which case #FORENSIC1394_RESULT_IO_TIMEOUT
+ *  is reported if no devices are found.
  *
- * \warning Calling this method will invalidate all active device handles.
+ * \warning Calling this method will invalidate the handles of any devices which
+ *          have been removed, along with the previously returned list.
  *
  *   \param bus The bus to get the devices for.
  *   \param[out] ndev The number of devices found; NULL is acceptable.
@@ -292,6 +519,93 @@ forensic1394_get_devices(forensic1394_bus *bus,
                          int *ndev,
                          forensic1394_device_callback ondestroy);
 
+/**
+ * \brief Gets the devices attached to the FireWire bus which match a filter.
+ *
+ * This method behaves as ::forensic1394_get_devices except that only the
+ *  devices matching \a filter are returned.  Other nodes are skipped over as
+ *  early as possible, before any device is created for them.  The filter
+ *  remains in effect for subsequent rescans, including those prompted by
+ *  hotplug events, until the next call to either method.  Existing devices
+ *  which do not match the filter are destroyed.
+ *
+ *   \param bus The bus to get the devices for.
+ *   \param[in] filter The criteria devices must meet; NULL for no filter.
+ *   \param[out] ndev The number of devices found; NULL is acceptable.
+ *   \param[in] ondestroy Function to be called when a device in the returned
+ *                         list is destroyed; NULL for no callback.
+ *  \return A NULL-terminated list of devices.
+ *
+ * \sa forensic1394_get_devices
+ * \sa forensic1394_filter
+ */
+FORENSIC1394_DECL forensic1394_dev **
+forensic1394_get_devices_filtered(forensic1394_bus *bus,
+                                  const forensic1394_filter *filter,
+                                  int *ndev,
+                                  forensic1394_device_callback ondestroy);
+
+/**
+ * \brief Enables the monitoring of \a bus for devices being added or removed.
+ *
+ * Once enabled ::forensic1394_get_devices only rescans the bus when a device
+ *  has been added or removed.  Additionally, applications may wait for the
+ *  file descriptor returned by ::forensic1394_get_hotplug_fd to become readable
+ *  and then call ::forensic1394_process_hotplug to bring the device list up to
+ *  date.  Whenever a rescan finds a new device \a onadd is called and whenever
+ *  it finds that a device has gone away \a onremove is called, before the
+ *  device is destroyed.
+ *
+ * Calling this method again replaces the callbacks.  Under Mac OS X/IOKit
+ *  device changes can not be monitored and so the bus is always rescanned.
+ *
+ *   \param bus The bus to monitor.
+ *   \param[in] onadd Function to be called when a device is added; NULL for no
+ *                    callback.
+ *   \param[in] onremove Function to be called when a device is removed; NULL
+ *                       for no callback.
+ *  \return A result status code.
+ *
+ * \sa forensic1394_device_callback
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_enable_hotplug(forensic1394_bus *bus,
+                            forensic1394_device_callback onadd,
+                            forensic1394_device_callback onremove);
+
+/**
+ * \brief Returns a file descriptor which becomes readable on device changes.
+ *
+ * The descriptor is suitable for use with \c poll and friends and must not be
+ *  read from or closed by the caller.
+ *
+ *   \param bus The bus, which must have hotplug monitoring enabled.
+ *  \return A file descriptor or -1 if the platform does not provide one.
+ *
+ * \sa forensic1394_enable_hotplug
+ */
+FORENSIC1394_DECL int
+forensic1394_get_hotplug_fd(forensic1394_bus *bus);
+
+/**
+ * \brief Processes pending device changes on \a bus.
+ *
+ * If any devices have been added or removed since the bus was last scanned
+ *  then it is rescanned, calling the hotplug callbacks as appropriate.  This
+ *  method does not block.
+ *
+ * \warning As with ::forensic1394_get_devices a rescan invalidates the
+ *          previously returned device list and the handles of any devices
+ *          which have been removed.
+ *
+ *   \param bus The bus, which must have hotplug monitoring enabled.
+ *  \return A result status code.
+ *
+ * \sa forensic1394_enable_hotplug
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_process_hotplug(forensic1394_bus *bus);
+
 /**
  * \brief Destroys a bus handle.
  *
@@ -342,6 +656,26 @@ forensic1394_set_bus_user_data(forensic1394_bus *bus, void *u);
 FORENSIC1394_DECL forensic1394_result
 forensic1394_open_device(forensic1394_dev *dev);
 
+/**
+ * \brief Waits for a device to permit memory to be read.
+ *
+ * Devices usually take a short while to bring down their physical request
+ *  filter after SBP-2 has been enabled.  This method probes \a dev with quadlet
+ *  reads of its memory, backing off exponentially between attempts, until one
+ *  succeeds or roughly \a timeout_ms milliseconds have elapsed.  Where the
+ *  platform allows, bus resets are watched for and cause the device to be
+ *  probed again straight away.
+ *
+ *   \param dev The device, which must be open.
+ *   \param timeout_ms The maximum time to wait in milliseconds.
+ *  \return #FORENSIC1394_RESULT_SUCCESS once the device is ready, otherwise
+ *          the result of the final probe.
+ *
+ * \sa forensic1394_enable_sbp2
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_wait_device_ready(forensic1394_dev *dev, int timeout_ms);
+
 /**
  * \brief Closes the device \a dev.
  *
@@ -372,7 +706,17 @@ forensic1394_is_device_open(forensic1394_dev *dev);
  *  size.  This limit can be obtained by calling
  *  ::forensic1394_get_device_request_size and is usually 2048 bytes in size.
  *
- * This method is a convenience wrapper around ::forensic1394_read_device_v.
+ * With read-ahead enabled, through ::forensic1394_set_device_read_ahead, a
+ *  read which starts where the previous one finished is taken to be part of a
+ *  sequential stream and the following window of memory is read ahead in a
+ *  single pipelined batch.  Subsequent reads continuing on from one another
+ *  are then served from the window without waiting on the device.  Data is
+ *  only ever served from the window once, and any write to the device
+ *  discards it.
+ *
+ * This method is otherwise a convenience wrapper around
+ *  ::forensic1394_read_device_v_priority with a priority of
+ *  #FORENSIC1394_PRIORITY_INTERACTIVE.
  *
  *   \param dev The device to read from.
  *   \param addr The memory address to start reading from.
@@ -405,16 +749,42 @@ forensic1394_read_device(forensic1394_dev *dev,
  * The method will return early should one of the requests fail.  It is not
  *  currently possible to determine which request caused the error.
  *
+ * The requests are made with a priority of #FORENSIC1394_PRIORITY_BULK.
+ *
  *   \param dev The device to read from.
  *   \param req The read requests to service.
  *   \param nreq The number of requests in \a req.
  *  \return A result status code.
+ *
+ * \sa forensic1394_read_device_v_priority
  */
 FORENSIC1394_DECL forensic1394_result
 forensic1394_read_device_v(forensic1394_dev *dev,
                            forensic1394_req *req,
                            size_t nreq);
 
+/**
+ * \brief Reads each request specified in \a req from \a dev with the
+ *         scheduling class \a prio.
+ *
+ * Identical to ::forensic1394_read_device_v except that the class of the
+ *  requests can be specified.  This is only of consequence when several
+ *  threads are making requests of \a dev concurrently.
+ *
+ *   \param dev The device to read from.
+ *   \param req The read requests to service.
+ *   \param nreq The number of requests in \a req.
+ *   \param prio The scheduling class of the requests.
+ *  \return A result status code.
+ *
+ * \sa forensic1394_priority
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_read_device_v_priority(forensic1394_dev *dev,
+                                    forensic1394_req *req,
+                                    size_t nreq,
+                                    forensic1394_priority prio);
+
 /**
  * \brief Writes \a len bytes from \a buf to \a dev starting at \a addr.
  *
@@ -423,7 +793,9 @@ forensic1394_read_device_v(forensic1394_dev *dev,
  *  the documentation for ::forensic1394_read_device for a discussion on the
  *  maximum transfer size.
  *
- * This method is a convenience wrapper around ::forensic1394_write_device_v.
+ * This method is a convenience wrapper around
+ *  ::forensic1394_write_device_v_priority with a priority of
+ *  #FORENSIC1394_PRIORITY_INTERACTIVE.
  *
  *   \param dev The device to write to.
  *   \param addr The memory address to start writing to.
@@ -446,16 +818,351 @@ forensic1394_write_device(forensic1394_dev *dev,
  *  method may issue the requests in \a req asynchronously in order to improve
  *  performance.  See ::forensic1394_read_device_v for further discussion.
  *
+ * The requests are made with a priority of #FORENSIC1394_PRIORITY_BULK.
+ *
  *   \param dev The device to write to.
  *   \param[in] req The write requests to service.
  *   \param nreq The number of requests in \a req.
  *  \return A result status code.
+ *
+ * \sa forensic1394_write_device_v_priority
  */
 FORENSIC1394_DECL forensic1394_result
 forensic1394_write_device_v(forensic1394_dev *dev,
 			    const forensic1394_req *req,
 			    size_t nreq);
 
+/**
+ * \brief Writes each request specified in \a req to \a dev with the
+ *         scheduling class \a prio.
+ *
+ * Identical to ::forensic1394_write_device_v except that the class of the
+ *  requests can be specified.
+ *
+ *   \param dev The device to write to.
+ *   \param[in] req The write requests to service.
+ *   \param nreq The number of requests in \a req.
+ *   \param prio The scheduling class of the requests.
+ *  \return A result status code.
+ *
+ * \sa forensic1394_priority
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_write_device_v_priority(forensic1394_dev *dev,
+                                     const forensic1394_req *req,
+                                     size_t nreq,
+                                     forensic1394_priority prio);
+
+/**
+ * \brief Atomically performs \a op on the \a len bytes at \a addr of \a dev.
+ *
+ * Performs a blocking (synchronous) lock request.  Unlike a read followed by
+ *  a write the operation is carried out by the target in a single round trip
+ *  and so can not race with the target itself.  The \a arg, \a data and
+ *  \a old values are in the byte order of the memory of the target, exactly as
+ *  they would be read by ::forensic1394_read_device.  Whether an operation
+ *  took effect, such as a compare-swap succeeding, is determined by
+ *  inspecting \a old.
+ *
+ * Not all nodes accept lock requests to all addresses; those which do not
+ *  respond with an error.  Some backends only support a subset of the
+ *  operations and fail with #FORENSIC1394_RESULT_OTHER_ERROR on the rest.
+ *
+ * This method is a convenience wrapper around
+ *  ::forensic1394_lock_device_v_priority with a priority of
+ *  #FORENSIC1394_PRIORITY_INTERACTIVE.
+ *
+ *   \param dev The device to operate on.
+ *   \param addr The address of the operand; must be aligned to \a len.
+ *   \param op The operation to perform.
+ *   \param len The size of the operands; either 4 or 8 bytes.
+ *   \param[in] arg The argument; NULL for fetch_add and little_add.
+ *   \param[in] data The data value.
+ *   \param[out] old The value at \a addr prior to the operation; may be NULL.
+ *  \return A result status code.
+ *
+ * \sa forensic1394_lock_op
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_lock_device(forensic1394_dev *dev,
+                         uint64_t addr,
+                         forensic1394_lock_op op,
+                         size_t len,
+                         const void *arg,
+                         const void *data,
+                         void *old);
+
+/**
+ * \brief Performs each lock request specified in \a req on \a dev.
+ *
+ * The vectorised form of ::forensic1394_lock_device.  As with
+ *  ::forensic1394_read_device_v the requests may be pipelined, and so the
+ *  order in which they are performed is unspecified.  Each request on its own
+ *  is atomic; the batch as a whole is not.
+ *
+ * The requests are made with a priority of #FORENSIC1394_PRIORITY_BULK.
+ *
+ *   \param dev The device to operate on.
+ *   \param[in,out] req The lock requests to service.
+ *   \param nreq The number of requests in \a req.
+ *  \return A result status code.
+ *
+ * \sa forensic1394_lock_device_v_priority
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_lock_device_v(forensic1394_dev *dev,
+                           const forensic1394_lock_req *req,
+                           size_t nreq);
+
+/**
+ * \brief Performs each lock request specified in \a req on \a dev with the
+ *         scheduling class \a prio.
+ *
+ * Identical to ::forensic1394_lock_device_v except that the class of the
+ *  requests can be specified.
+ *
+ *   \param dev The device to operate on.
+ *   \param[in,out] req The lock requests to service.
+ *   \param nreq The number of requests in \a req.
+ *   \param prio The scheduling class of the requests.
+ *  \return A result status code.
+ *
+ * \sa forensic1394_priority
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_lock_device_v_priority(forensic1394_dev *dev,
+                                    const forensic1394_lock_req *req,
+                                    size_t nreq,
+                                    forensic1394_priority prio);
+
+/**
+ * \brief Maps \a len bytes of the memory of \a dev starting at \a base into
+ *         the address space of the process.
+ *
+ * The mapping is populated lazily: the first access to each page blocks while
+ *  the page, along with a cluster of its neighbours, is read from the device.
+ *  Faults in the same area are batched together and sequential faults cause
+ *  larger clusters to be read, so existing code which expects a pointer to
+ *  memory can be run directly against the device while reading only those
+ *  parts of it which are touched.  Pages which can not be read appear to be
+ *  filled with zeros.
+ *
+ * Once read a page is not read again until it is refreshed or invalidated.
+ *  The mapping is read-only and is removed when the device is closed.  It
+ *  must not be passed as a buffer to the other methods of \a dev.
+ *
+ * This is currently only supported by the Linux/Juju backend, using
+ *  userfaultfd.
+ *
+ *   \param dev The device to map; must be open.
+ *   \param base The address of the memory to map.
+ *   \param len The number of bytes to map.
+ *  \return A pointer to the memory at \a base, or NULL on error.
+ *
+ * \sa forensic1394_unmap_device
+ */
+FORENSIC1394_DECL const void *
+forensic1394_map_device(forensic1394_dev *dev,
+                        uint64_t base,
+                        size_t len);
+
+/**
+ * \brief Re-reads those pages of a mapping between \a addr and \a addr +
+ *         \a len which have been read.
+ *
+ * Pages which have yet to be accessed are left to be read on demand.
+ *
+ *   \param dev The device.
+ *   \param addr An address within a mapping of \a dev.
+ *   \param len The number of bytes to refresh; the range must lie within the
+ *               mapping.
+ *  \return A result status code.  On error some pages may have been
+ *          invalidated rather than refreshed.
+ *
+ * \sa forensic1394_invalidate_device_map
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_refresh_device_map(forensic1394_dev *dev,
+                                const void *addr,
+                                size_t len);
+
+/**
+ * \brief Discards those pages of a mapping between \a addr and \a addr +
+ *         \a len which have been read.
+ *
+ * The pages are read afresh from the device the next time they are accessed.
+ *
+ *   \param dev The device.
+ *   \param addr An address within a mapping of \a dev.
+ *   \param len The number of bytes to invalidate; the range must lie within
+ *               the mapping.
+ *  \return A result status code.
+ *
+ * \sa forensic1394_refresh_device_map
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_invalidate_device_map(forensic1394_dev *dev,
+                                   const void *addr,
+                                   size_t len);
+
+/**
+ * \brief Removes the mapping at \a addr of \a dev.
+ *
+ *   \param dev The device.
+ *   \param addr The pointer returned by ::forensic1394_map_device.
+ */
+FORENSIC1394_DECL void
+forensic1394_unmap_device(forensic1394_dev *dev, const void *addr);
+
+/**
+ * \brief Fills in an array of requests from arrays of addresses and lengths.
+ *
+ * Request \a i is set to read or write \a len[i] bytes at \a addr[i], with
+ *  the data of each request immediately following that of the previous one
+ *  in \a buf.  This allows bindings to build large scatter requests without
+ *  iterating over them.  By passing NULL for \a buf the total size of the
+ *  requests can be determined; the data pointers are then set to NULL.
+ *
+ *   \param[out] req The requests to fill in; at least \a nreq in size.
+ *   \param nreq The number of requests.
+ *   \param addr The address of each request.
+ *   \param len The length in bytes of each request.
+ *   \param buf The buffer holding the data of the requests, or NULL.
+ *  \return The total number of bytes spanned by the requests in \a buf.
+ *
+ * \sa forensic1394_read_device_v
+ */
+FORENSIC1394_DECL size_t
+forensic1394_fill_requests(forensic1394_req *req,
+                           size_t nreq,
+                           const uint64_t *addr,
+                           const size_t *len,
+                           void *buf);
+
+/**
+ * \brief Allocates a watch for polling ranges of the memory of \a dev.
+ *
+ * A watch repeatedly samples a set of memory ranges, calling \a onchange for
+ *  each range whose contents differ from the previous sample.  Ranges which
+ *  are close to one another are coalesced and each sample is taken as a
+ *  single vectored read, so the sample rate is bounded by the bandwidth of
+ *  the bus rather than by the number of ranges.
+ *
+ * The watch must be destroyed before \a dev is.
+ *
+ *   \param dev The device to watch, which need not yet be open.
+ *   \param onchange The function to call when a range changes.
+ *  \return A handle to the watch, or NULL on error.
+ *
+ * \sa forensic1394_watch_destroy
+ */
+FORENSIC1394_DECL forensic1394_watch *
+forensic1394_watch_alloc(forensic1394_dev *dev,
+                         forensic1394_watch_callback onchange);
+
+/**
+ * \brief Adds the range of \a len bytes at \a addr to \a watch.
+ *
+ * Ranges may overlap one another.  Changes to a range are first reported
+ *  by the second sample taken after it was added, the first establishing
+ *  its initial contents.
+ *
+ *   \param watch The watch.
+ *   \param addr The address of the range.
+ *   \param len The length of the range in bytes.
+ *  \return The index of the range on success, otherwise a negative result
+ *          status code.
+ */
+FORENSIC1394_DECL int
+forensic1394_watch_add(forensic1394_watch *watch,
+                       uint64_t addr,
+                       size_t len);
+
+/**
+ * \brief Takes a single sample of the ranges of \a watch.
+ *
+ * All of the ranges are read and the change callback called, in order of
+ *  index, for each which has changed since the previous sample.
+ *
+ *   \param watch The watch; its device must be open.
+ *  \return A result status code.
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_watch_poll(forensic1394_watch *watch);
+
+/**
+ * \brief Samples the ranges of \a watch at a rate of \a rate per second.
+ *
+ * Calls ::forensic1394_watch_poll every 1/\a rate seconds until either
+ *  \a nsample samples have been taken, a sample fails or
+ *  ::forensic1394_watch_stop is called.  Samples which can not be taken on
+ *  time are skipped rather than being taken in a burst.
+ *
+ *   \param watch The watch; its device must be open.
+ *   \param rate The number of samples per second; 0 to sample as quickly as
+ *               possible.
+ *   \param nsample The number of samples to take; 0 for no limit.
+ *  \return A result status code.
+ */
+FORENSIC1394_DECL forensic1394_result
+forensic1394_watch_run(forensic1394_watch *watch,
+                       int rate,
+                       int nsample);
+
+/**
+ * \brief Asks ::forensic1394_watch_run to return after the current sample.
+ *
+ * This may be called from the change callback, another thread or a signal
+ *  handler.
+ *
+ *   \param watch The watch.
+ */
+FORENSIC1394_DECL void
+forensic1394_watch_stop(forensic1394_watch *watch);
+
+/**
+ * \brief Gets the contents of range \a i of \a watch as of the last sample.
+ *
+ *   \param watch The watch.
+ *   \param i The index of the range.
+ *  \return The contents of the range, or NULL if it is yet to be sampled.
+ *          This remains valid until the next sample is taken or a range
+ *          is added.
+ */
+FORENSIC1394_DECL const void *
+forensic1394_watch_get_data(forensic1394_watch *watch, int i);
+
+/**
+ * \brief Fetches the user data for \a watch.
+ *
+ *   \param watch The watch.
+ *  \return The user data associated with the watch; NULL if none has been
+ *          set.
+ *
+ * \sa forensic1394_set_watch_user_data
+ */
+FORENSIC1394_DECL void *
+forensic1394_get_watch_user_data(forensic1394_watch *watch);
+
+/**
+ * \brief Sets the user data for \a watch to \a u.
+ *
+ *   \param watch The watch.
+ *   \param[in] u The user data to set.
+ *
+ * \sa forensic1394_get_watch_user_data
+ */
+FORENSIC1394_DECL void
+forensic1394_set_watch_user_data(forensic1394_watch *watch, void *u);
+
+/**
+ * \brief Destroys \a watch.
+ *
+ *   \param watch The watch.
+ */
+FORENSIC1394_DECL void
+forensic1394_watch_destroy(forensic1394_watch *watch);
+
 /**
  * \brief Copies the configuration ROM for the device \a dev into \a rom.
  *
@@ -470,6 +1177,72 @@ FORENSIC1394_DECL void
 forensic1394_get_device_csr(forensic1394_dev *dev,
                             uint32_t *rom);
 
+/**
+ * \brief Gets the entries of a directory in the configuration ROM of \a dev.
+ *
+ * The first time any of the CSR directory methods is called the ROM of the
+ *  device is parsed in its entirety and the result cached on the device.
+ *  Directories are numbered in the order in which they are found, starting
+ *  with the root directory as 0.  Entries for subdirectories record the
+ *  number of the directory they point to.
+ *
+ *   \param dev The device.
+ *   \param dir The number of the directory.
+ *   \param[out] entries The entries of the directory.  These remain valid for
+ *                       as long as the device does.
+ *  \return The number of entries in the directory, or -1 if there is no such
+ *          directory.
+ *
+ * \sa forensic1394_csr_entry
+ */
+FORENSIC1394_DECL int
+forensic1394_get_device_csr_dir(forensic1394_dev *dev, int dir,
+                                const forensic1394_csr_entry **entries);
+
+/**
+ * \brief Gets the unit directories in the configuration ROM of \a dev.
+ *
+ *   \param dev The device.
+ *   \param[out] dirs The directory numbers of the unit directories.  These
+ *                    remain valid for as long as the device does.
+ *  \return The number of unit directories.
+ *
+ * \sa forensic1394_get_device_csr_dir
+ */
+FORENSIC1394_DECL int
+forensic1394_get_device_csr_unit_dirs(forensic1394_dev *dev, const int **dirs);
+
+/**
+ * \brief Finds the first entry with the key \a key in a CSR directory.
+ *
+ *   \param dev The device.
+ *   \param dir The number of the directory to search.
+ *   \param key The 8-bit key to search for.
+ *  \return The entry or NULL if no such entry exists.
+ *
+ * \sa forensic1394_get_device_csr_dir
+ */
+FORENSIC1394_DECL const forensic1394_csr_entry *
+forensic1394_find_device_csr_entry(forensic1394_dev *dev, int dir, int key);
+
+/**
+ * \brief Gets the text describing a CSR directory entry.
+ *
+ * If \a entry is a textual descriptor leaf then its text is returned.
+ *  Otherwise the text of the textual descriptor leaf immediately following
+ *  \a entry in its directory, if any, is returned.  Text is decoded when it is
+ *  first asked for and then cached on the device.  Only minimal ASCII leaves
+ *  are decoded; the text of other leaves is empty.
+ *
+ *   \param dev The device.
+ *   \param entry An entry belonging to \a dev.
+ *  \return The text or NULL if the entry is not described by a textual
+ *          descriptor.  This remains valid for as long as the device does.
+ */
+FORENSIC1394_DECL const char *
+forensic1394_get_device_csr_text(forensic1394_dev *dev,
+                                 const forensic1394_csr_entry *entry);
+
 /**
  * \brief Returns the node ID of the device.
  *
@@ -550,6 +1323,10 @@ forensic1394_get_device_vendor_id(forensic1394_dev *dev);
  *  an upper-bound for the length of read/write calls.  If a size can not be
  *  found in the CSR then 512 bytes will be returned.
  *
+ * Once the device has been opened the size is further limited to the largest
+ *  payload permitted at the speed of the path to the device.  As this speed
+ *  may change following a bus reset so may the size.
+ *
  * The returned size is guaranteed to be a positive power of two.
  *
  *  \param dev The device.
@@ -558,6 +1335,142 @@ forensic1394_get_device_vendor_id(forensic1394_dev *dev);
 FORENSIC1394_DECL int
 forensic1394_get_device_request_size(forensic1394_dev *dev);
 
+/**
+ * \brief Returns the speed of the path between the local node and \a dev.
+ *
+ * The speed is determined when the device is opened and updated following
+ *  each bus reset, as the topology of the bus may have changed.
+ *
+ *   \param dev The device.
+ *  \return The speed of the device; #FORENSIC1394_SPEED_UNKNOWN if it has
+ *          yet to be opened or can not be determined by the backend.
+ *
+ * \sa forensic1394_get_device_request_size
+ */
+FORENSIC1394_DECL forensic1394_speed
+forensic1394_get_device_speed(forensic1394_dev *dev);
+
+/**
+ * \brief Sets the bounds on the request timeout for the device \a dev.
+ *
+ * Rather than using a fixed timeout libforensic1394 measures the round-trip
+ *  time of requests made to a device and derives a timeout from a smoothed
+ *  mean and variance of these samples.  This allows for unresponsive regions
+ *  of memory to be detected quickly on healthy devices while still allowing
+ *  slower devices sufficient time to respond.  This method constrains the
+ *  adaptive timeout to lie between \a min_ms and \a max_ms.
+ *
+ * By default the timeout is bounded between 10 ms and 1000 ms.
+ *
+ *   \param dev The device.
+ *   \param min_ms The minimum timeout in milliseconds; must be positive.
+ *   \param max_ms The maximum timeout in milliseconds; must be >= \a min_ms.
+ *
+ * \sa forensic1394_get_device_timeout
+ */
+FORENSIC1394_DECL void
+forensic1394_set_device_timeout(forensic1394_dev *dev,
+                                int min_ms,
+                                int max_ms);
+
+/**
+ * \brief Returns the current request timeout for the device \a dev.
+ *
+ * The value returned is that which will be used for the next request and is
+ *  subject to change as further round-trip time samples are taken.
+ *
+ *   \param dev The device.
+ *  \return The request timeout in milliseconds.
+ *
+ * \sa forensic1394_set_device_timeout
+ */
+FORENSIC1394_DECL int
+forensic1394_get_device_timeout(forensic1394_dev *dev);
+
+/**
+ * \brief Sets the maximum number of requests which may be in flight to \a dev.
+ *
+ * Vectorised requests are pipelined, with up to \a depth requests being
+ *  outstanding at any one time.  Should the device indicate that it is busy
+ *  the number of requests in flight is halved and the rejected request retried
+ *  after a short, randomised, delay.  Subsequent successful requests allow the
+ *  number in flight to grow back towards \a depth.
+ *
+ * The default depth depends on the backend; under Linux/Juju it is 1 on
+ *  account of bugs in older kernels (see the BUGS file).  Depths beyond what
+ *  the backend supports are clamped.
+ *
+ *   \param dev The device.
+ *   \param depth The maximum number of requests in flight; must be positive.
+ *
+ * \sa forensic1394_get_device_pipeline_depth
+ */
+FORENSIC1394_DECL void
+forensic1394_set_device_pipeline_depth(forensic1394_dev *dev, int depth);
+
+/**
+ * \brief Returns the maximum number of requests which may be in flight to
+ *         \a dev.
+ *
+ *   \param dev The device.
+ *  \return The maximum pipeline depth.
+ *
+ * \sa forensic1394_set_device_pipeline_depth
+ */
+FORENSIC1394_DECL int
+forensic1394_get_device_pipeline_depth(forensic1394_dev *dev);
+
+/**
+ * \brief Sets the number of bytes read ahead of sequential reads of \a dev.
+ *
+ * Sequential calls to ::forensic1394_read_device are served from a window of
+ *  \a window bytes, read ahead of them in a single pipelined batch.  Reads of
+ *  \a window bytes or more, along with those made through the vectorised
+ *  methods, are never read ahead.
+ *
+ * Read-ahead is disabled by default.  Once enabled reads extend beyond what
+ *  was asked for, possibly into memory-mapped I/O or other regions which are
+ *  hazardous to access, so it should only be enabled when the memory being
+ *  read is known to be safe.
+ *
+ *   \param dev The device.
+ *   \param window The number of bytes to read ahead; 0 to disable.
+ *
+ * \sa forensic1394_get_device_read_ahead
+ */
+FORENSIC1394_DECL void
+forensic1394_set_device_read_ahead(forensic1394_dev *dev, size_t window);
+
+/**
+ * \brief Returns the number of bytes read ahead of sequential reads of \a dev.
+ *
+ *   \param dev The device.
+ *  \return The size of the read-ahead window; 0 if disabled.
+ *
+ * \sa forensic1394_set_device_read_ahead
+ */
+FORENSIC1394_DECL size_t
+forensic1394_get_device_read_ahead(forensic1394_dev *dev);
+
+/**
+ * \brief Enables or disables a dedicated I/O thread for \a dev.
+ *
+ * With the I/O thread enabled the device is serviced by a thread of its own,
+ *  which is started when the device is opened and stopped when it is closed.
+ *  Requests made of the device, from any number of threads, are handed to the
+ *  I/O thread through a lock-free queue; the calling threads then sleep until
+ *  their requests have completed.  This is the preferred mode when an open
+ *  device is shared between many threads.
+ *
+ * This setting can only be changed while the device is closed.  It is
+ *  currently only supported by the Linux/Juju backend.
+ *
+ *   \param dev The device.
+ *   \param enable Non-zero to enable the I/O thread; 0 to disable it.
+ */
+FORENSIC1394_DECL void
+forensic1394_set_device_io_thread(forensic1394_dev *dev, int enable);
+
 /**
  * \brief Fetches the user data for the device \a dev.
  *
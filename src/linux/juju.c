@@ -35,8 +35,16 @@
 
 #include <glob.h>
 
+#include <sys/inotify.h>
+
 #include <poll.h>
 
+#include <time.h>
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
@@ -45,51 +53,346 @@
 #define U64_TO_PTR(p) ((void *)(intptr_t)(p))
 
 /**
- * The size of the request pipeline.  This determines how many asynchronous
- *  requests can be in the pipeline at any one time.  Due to serious bugs in
- *  current kernels (at least up to 2.6.35) this is currently limited to 1.
+ * The default size of the request pipeline.  This determines how many
+ *  asynchronous requests can be in the pipeline at any one time.  Due to
+ *  serious bugs in older kernels (at least up to 2.6.35) this defaults to 1.
+ *  It may be raised through ::forensic1394_set_device_pipeline_depth.
  */
 #define REQUEST_PIPELINE_SZ 1
 
+/**
+ * How long to wait for a node to be opened and queried during enumeration in
+ *  milliseconds.  Nodes are probed concurrently, so this also bounds the time
+ *  taken to scan the bus.
+ */
+#define PROBE_TIMEOUT_MS 1000
+
+/// Stack size of the threads used to probe nodes
+#define PROBE_THREAD_STACK_SZ (64 * 1024)
+
+/*
+ * Responses are matched to requests through the 64-bit closure.  The lower
+ *  half holds the pipeline slot of the request and the upper half the tag the
+ *  request was sent with.  As tags are never reused (at least not for a very
+ *  long time) responses to abandoned requests, such as those which have timed
+ *  out, can be identified and discarded.
+ */
+#define CLOSURE(tag, slot) ((__u64) (tag) << 32 | (slot))
+#define CLOSURE_TAG(c) ((uint32_t) ((c) >> 32))
+#define CLOSURE_SLOT(c) ((size_t) ((c) & 0xffffffff))
+
+typedef enum
+{
+    /// Slot is available for a new request
+    SLOT_FREE,
+    /// Request has been sent and is awaiting a response
+    SLOT_IN_FLIGHT,
+    /// Request was rejected as the device was busy and is awaiting a retry
+    SLOT_BACKOFF
+} slot_state;
+
+/**
+ * A slot in the request pipeline.
+ */
+typedef struct
+{
+    slot_state state;
+
+    /// The batch the request belongs to
+    request_batch *batch;
+
+    /// Index of the request in the batch
+    size_t idx;
+
+    /// Tag the request was sent with
+    uint32_t tag;
+
+    /// When the request was sent in microseconds
+    int64_t sent_us;
+
+    /// When a busy request should be retried in microseconds
+    int64_t retry_us;
+
+    /// Number of times the request has been rejected as busy
+    int attempt;
+} pipeline_slot;
+
 struct _platform_bus
 {
-    int sbp2_fd;
+    /// The local node, found by scanning or enabling SBP-2; -1 if unknown
+    int local_fd;
+    char local_path[64];
+
+    /// Watches /dev for device nodes coming and going; -1 if not monitoring
+    int inotify_fd;
 };
 
 struct _platform_dev
 {
     char path[64];
+
+    /*
+     * File descriptor for the node.  This is kept from enumeration through to
+     * the device being destroyed so that the node need only be opened once.
+     */
     int fd;
+
+    /// Tag given to the most recently sent request
+    uint32_t tag;
+
+    /// The request pipeline; shared by all threads using the device
+    pipeline_slot slot[FORENSIC1394_PIPELINE_MAX];
+    int in_pipeline;
+
+    /// Protects the pipeline and the scheduling queues
+    pthread_mutex_t lock;
+
+    /// Signalled when batches complete or the pipeline is handed over
+    pthread_cond_t cond;
+
+    /// Non-zero if a thread is currently driving the pipeline
+    int driving;
+
+    /// Non-zero if a batch has completed since the last broadcast
+    int completed;
+
+    /// Used to wake the driving thread when new batches are queued
+    int wake_fd;
+
+    /// Batches submitted to the I/O thread, if running
+    request_mpsc submit;
+
+    /// The I/O thread and a flag telling it to keep running
+    pthread_t io_thread;
+    int io_running;
 };
 
 static forensic1394_dev *alloc_dev(const char *devpath,
                                    const struct fw_cdev_get_info *info,
                                    const struct fw_cdev_event_bus_reset *reset);
 
+typedef enum
+{
+    /// Node does not need to be probed
+    PROBE_SKIPPED,
+    /// Node is being probed
+    PROBE_PENDING,
+    /// Node could not be opened
+    PROBE_NO_OPEN,
+    /// Node could be opened but not queried
+    PROBE_NO_INFO,
+    /// No thread could be started to probe the node
+    PROBE_NO_THREAD,
+    /// Node has been probed successfully
+    PROBE_DONE
+} probe_state;
+
+typedef struct _probe_set probe_set;
+
+/**
+ * The probing of a single node during enumeration.
+ */
+typedef struct
+{
+    char path[64];
+
+    probe_state state;
+
+    /// Non-zero if the node is being probed through an existing descriptor
+    int cached;
+
+    /// Descriptor for the node and the errno if it could not be opened
+    int fd;
+    int err;
+
+    uint32_t rom[FORENSIC1394_CSR_SZ];
+    struct fw_cdev_get_info get_info;
+    struct fw_cdev_event_bus_reset reset;
+
+    probe_set *set;
+} node_probe;
+
+/**
+ * The nodes being probed by a single enumeration.  The set is reference
+ *  counted as probes which miss the deadline are left to finish by themselves.
+ */
+struct _probe_set
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /// Number of probes yet to finish
+    int pending;
+
+    /// Non-zero once the enumeration has stopped waiting for probes
+    int abandoned;
+
+    int refs;
+
+    node_probe probe[];
+};
+
+/**
+ * Probes all of the pending nodes in \a set concurrently, waiting until they
+ *  have either finished or #PROBE_TIMEOUT_MS has elapsed.  Nodes still
+ *  pending upon return have timed out.
+ */
+static void probe_nodes(probe_set *set);
+
+/**
+ * Opens, if need be, and queries the node being probed by \a p.
+ */
+static void probe_node(node_probe *p);
+
+/**
+ * Entry point for probe threads.
+ */
+static void *probe_thread(void *arg);
+
 /**
- * Returns the most suitable TCODE for a given request.  Requests with a length
- *  of 4-bytes should be QUADLET requests while everything else should use
- *  BLOCK requests.
+ * Drops a reference to \a set, freeing it once unreferenced.  Must be called
+ *  without the lock of \a set held.
  */
-static inline int request_tcode(const forensic1394_req* r, request_type t);
+static void release_probe_set(probe_set *set);
+
+/**
+ * Reads the GUID of the node at \a devpath from sysfs, which does not require
+ *  the node to be opened.
+ *
+ *  \return Non-zero if the GUID could be read.
+ */
+static int read_sysfs_guid(const char *devpath, int64_t *guid);
+
+/**
+ * Returns the file descriptor an existing device on \a bus holds for the node
+ *  at \a devpath, or -1 if there is no such device.
+ */
+static int find_cached_fd(forensic1394_bus *bus, const char *devpath);
+
+/**
+ * Brings the node ID, generation and speed of \a dev up to date with the bus
+ *  reset event \a r, unless the event is older than what \a dev already has.
+ */
+static void follow_bus_reset(forensic1394_dev *dev,
+                             const struct fw_cdev_event_bus_reset *r);
+
+/**
+ * Queries the speed of the path to \a dev.  This is worked out by the kernel
+ *  from the self-ID packets sent following each bus reset and so accounts for
+ *  the slowest hop along the path rather than just the speed of the node.
+ */
+static void update_speed(forensic1394_dev *dev);
+
+/**
+ * Reads any events pending on \a fd, discarding all but bus resets.
+ *
+ *  \return Non-zero if a bus reset was read, in which case the most recent is
+ *          copied to \a reset.
+ */
+static int read_bus_resets(int fd, struct fw_cdev_event_bus_reset *reset);
+
+/**
+ * Discards any events pending on the file descriptor of \a dev, such as
+ *  responses to requests abandoned when the device was last closed.  The node
+ *  ID and generation are updated from any bus reset events found.
+ */
+static void drain_events(forensic1394_dev *dev);
+
+/**
+ * Returns the most suitable TCODE for request \a i of batch \a b.  Requests
+ *  with a length of 4-bytes should be QUADLET requests while everything else
+ *  should use BLOCK requests.  Lock requests use the extended TCODE of their
+ *  operation.
+ */
+static inline int request_tcode(const request_batch *b, size_t i);
+
+/**
+ * Sends request \a i of batch \a b to \a dev.  The response will be
+ *  delivered as an event on the device's file descriptor identified by
+ *  \a closure.
+ *
+ *  \return A result status code.
+ */
+static forensic1394_result send_request(forensic1394_dev *dev,
+                                        const request_batch *b, size_t i,
+                                        __u64 closure);
+
+/**
+ * Retries any busy requests which are due and then tops up the pipeline with
+ *  requests chosen by the scheduler.  Must be called with the device lock held.
+ */
+static void fill_pipeline(forensic1394_dev *dev);
+
+/**
+ * Marks the batch \a b as being complete with a status of \a ret.  Any of its
+ *  requests which remain in the pipeline are abandoned.  Must be called with
+ *  the device lock held.
+ */
+static void finish_batch(forensic1394_dev *dev, request_batch *b,
+                         forensic1394_result ret);
+
+/**
+ * Completes every outstanding batch on \a dev with a status of \a ret.
+ */
+static void finish_all_batches(forensic1394_dev *dev, forensic1394_result ret);
+
+/**
+ * Processes a response event, routing it to the pipeline slot and batch
+ *  identified by its closure.  Must be called with the device lock held.
+ */
+static void handle_response(forensic1394_dev *dev,
+                            const struct fw_cdev_event_response *resp);
+
+/**
+ * Performs a single iteration of the request engine: filling the pipeline,
+ *  waiting for an event and then dispatching it.  The device lock is released
+ *  while waiting.  Must be called with the device lock held by the thread
+ *  driving the pipeline.
+ */
+static void drive_pipeline(forensic1394_dev *dev);
+
+/**
+ * Entry point for the I/O thread of a device.  The thread takes batches off
+ *  the submission queue and drives the pipeline until told to stop.
+ */
+static void *io_thread_main(void *arg);
+
+/**
+ * Completion callback for batches submitted to the I/O thread; posts the
+ *  semaphore the submitting thread is waiting on.
+ */
+static void io_thread_complete(request_batch *b);
+
+/**
+ * Makes the requests of the batch \a b, either by handing it over to the I/O
+ *  thread or by driving the pipeline of \a dev until it completes.
+ *
+ *  \return A result status code.
+ */
+static forensic1394_result submit_batch(forensic1394_dev *dev,
+                                        request_batch *b);
 
 platform_bus *platform_bus_alloc(void)
 {
     platform_bus *pbus = malloc(sizeof(platform_bus));
 
-    pbus->sbp2_fd = -1;
+    pbus->local_fd = -1;
+    pbus->inotify_fd = -1;
 
     return pbus;
 }
 
 void platform_bus_destroy(forensic1394_bus *bus)
 {
-    // If the SBP-2 unit directory is enabled close its fd
-    if (bus->sbp2_enabled)
+    // Closing the local node also removes the SBP-2 unit directory, if any
+    if (bus->pbus->local_fd != -1)
     {
-        assert(bus->pbus->sbp2_fd != -1);
+        close(bus->pbus->local_fd);
+    }
 
-        close(bus->pbus->sbp2_fd);
+    if (bus->pbus->inotify_fd != -1)
+    {
+        close(bus->pbus->inotify_fd);
     }
 
     free(bus->pbus);
@@ -105,10 +408,16 @@ forensic1394_result platform_enable_sbp2(forensic1394_bus *bus,
 
     glob_t globdev;
 
-    assert(bus->pbus->sbp2_fd == -1);
-
-    // In order to enable SBP-2 we first need a local node
-    glob("/dev/fw*", 0, NULL, &globdev);
+    // In order to enable SBP-2 we first need a local node (unless scanned)
+    if (bus->pbus->local_fd == -1)
+    {
+        glob("/dev/fw*", 0, NULL, &globdev);
+    }
+    else
+    {
+        globdev.gl_pathc = 0;
+        globdev.gl_pathv = NULL;
+    }
 
     for (i = 0; i < globdev.gl_pathc; i++)
     {
@@ -146,7 +455,9 @@ forensic1394_result platform_enable_sbp2(forensic1394_bus *bus,
         if (reset.node_id == reset.local_node_id)
         {
             // We've found what we need; save and break (but do not close)
-            bus->pbus->sbp2_fd = fd;
+            bus->pbus->local_fd = fd;
+            snprintf(bus->pbus->local_path, sizeof(bus->pbus->local_path),
+                     "%s", globdev.gl_pathv[i]);
             break;
         }
 
@@ -154,10 +465,13 @@ forensic1394_result platform_enable_sbp2(forensic1394_bus *bus,
         close(fd);
     }
 
-    globfree(&globdev);
+    if (globdev.gl_pathv)
+    {
+        globfree(&globdev);
+    }
 
     // If we got a valid local file descriptor use it to update the CSR
-    if (bus->pbus->sbp2_fd != -1)
+    if (bus->pbus->local_fd != -1)
     {
         struct fw_cdev_add_descriptor add_desc = {
             .data   = PTR_TO_U64(sbp2dir),
@@ -166,11 +480,8 @@ forensic1394_result platform_enable_sbp2(forensic1394_bus *bus,
         };
 
         // Attempt to add the SBP-2 unit directory
-        if (ioctl(bus->pbus->sbp2_fd, FW_CDEV_IOC_ADD_DESCRIPTOR, &add_desc) == -1)
+        if (ioctl(bus->pbus->local_fd, FW_CDEV_IOC_ADD_DESCRIPTOR, &add_desc) == -1)
         {
-            close(bus->pbus->sbp2_fd);
-            bus->pbus->sbp2_fd = -1;
-
             ret = FORENSIC1394_RESULT_IO_ERROR;
         }
     }
@@ -188,83 +499,153 @@ forensic1394_result platform_enable_sbp2(forensic1394_bus *bus,
     return ret;
 }
 
-forensic1394_result platform_update_device_list(forensic1394_bus *bus)
+forensic1394_result platform_update_device_list(forensic1394_bus *bus,
+                                                forensic1394_dev **found)
 {
     int i;
+    int nfound = 0;
     int perm_skipped = 0;
     forensic1394_result ret = FORENSIC1394_RESULT_SUCCESS;
 
     glob_t globdev;
+    probe_set *set;
+
+    int64_t guid;
 
     // Glob the available firewire devices attached to the system
     glob("/dev/fw*", 0, NULL, &globdev);
 
-    for (i = 0; i < globdev.gl_pathc; i++)
+    set = calloc(1, sizeof(probe_set)
+                  + globdev.gl_pathc * sizeof(node_probe));
+
+    if (!set)
     {
-        const char *devpath = globdev.gl_pathv[i];
-        uint32_t rom[FORENSIC1394_CSR_SZ];
+        globfree(&globdev);
+        return FORENSIC1394_RESULT_OTHER_ERROR;
+    }
 
-        struct fw_cdev_event_bus_reset reset;
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->cond, NULL);
+    set->refs = 1;
 
-        // Fill out a get info request
-        struct fw_cdev_get_info get_info = {
-            .version    = FW_CDEV_VERSION,
-            .rom        = PTR_TO_U64(rom),
-            .rom_length = sizeof(rom),
-            .bus_reset  = PTR_TO_U64(&reset)
-        };
+    for (i = 0; i < globdev.gl_pathc; i++)
+    {
+        node_probe *p = &set->probe[i];
+        int cached = find_cached_fd(bus, globdev.gl_pathv[i]);
 
-        // Open up the device
-        int fd = open(devpath, O_RDWR);
+        snprintf(p->path, sizeof(p->path), "%s", globdev.gl_pathv[i]);
+        p->set = set;
+        p->fd = -1;
 
-        // Ensure the device was opened
-        if (fd == -1)
+        // Skip over the local node if it is already known
+        if (bus->pbus->local_fd != -1
+         && strcmp(p->path, bus->pbus->local_path) == 0)
         {
-            // See if the failure was due to a permissions problem
-            if (errno == EACCES)
-            {
-                perm_skipped++;
-            }
+            p->state = PROBE_SKIPPED;
+            continue;
+        }
 
-            // Not fatal; continue
+        // When after a specific device leave the others well alone
+        if (bus->filtered && bus->filter.guid
+         && read_sysfs_guid(p->path, &guid)
+         && !common_filter_guid(bus, guid))
+        {
+            p->state = PROBE_SKIPPED;
             continue;
         }
 
-        // Send the get info request
-        if (ioctl(fd, FW_CDEV_IOC_GET_INFO, &get_info) == -1)
+        /*
+         * Probe the node through the descriptor which an existing device
+         * holds for it, if any.  This is duplicated so that the device being
+         * destroyed can not pull it out from under a straggling probe.
+         */
+        if (cached != -1)
         {
-            // Highly unlikely; probably fatal
-            ret = FORENSIC1394_RESULT_OTHER_ERROR;
-            perm_skipped = -1;
-            break;
+            p->cached = 1;
+            p->fd = dup(cached);
         }
 
-        // See if the node is foreign (we only want attached devices)
-        if (reset.node_id != reset.local_node_id)
+        p->state = PROBE_PENDING;
+        set->pending++;
+    }
+
+    probe_nodes(set);
+
+    for (i = 0; i < globdev.gl_pathc; i++)
+    {
+        node_probe *p = &set->probe[i];
+
+        switch (p->state)
         {
-            // Allocate a new device
-            forensic1394_dev *currdev = alloc_dev(devpath,
-                                                  &get_info,
-                                                  &reset);
+            case PROBE_SKIPPED:
+                break;
+            case PROBE_PENDING:
+                // Timed out; the probe will clean up after itself
+                ret = FORENSIC1394_RESULT_IO_TIMEOUT;
+                break;
+            case PROBE_NO_OPEN:
+                // See if the failure was due to a permissions problem
+                if (p->err == EACCES)
+                {
+                    perm_skipped++;
+                }
+                break;
+            case PROBE_NO_INFO:
+            case PROBE_NO_THREAD:
+                // Highly unlikely; probably fatal
+                ret = FORENSIC1394_RESULT_OTHER_ERROR;
+                break;
+            case PROBE_DONE:
+                // Remember the local node for when SBP-2 is enabled
+                if (p->reset.node_id == p->reset.local_node_id)
+                {
+                    if (bus->pbus->local_fd == -1 && !p->cached)
+                    {
+                        bus->pbus->local_fd = p->fd;
+                        snprintf(bus->pbus->local_path,
+                                 sizeof(bus->pbus->local_path), "%s", p->path);
+                        p->fd = -1;
+                    }
+                }
+                // Only create devices for the foreign nodes which are wanted
+                else if (common_filter_rom(bus, p->rom))
+                {
+                    // Allocate a new device
+                    forensic1394_dev *currdev = alloc_dev(p->path,
+                                                          &p->get_info,
+                                                          &p->reset);
 
-            // Save a reference to the bus
-            currdev->bus = bus;
+                    // Keep the descriptor for when the device is opened
+                    if (!p->cached)
+                    {
+                        currdev->pdev->fd = p->fd;
+                        p->fd = -1;
+                    }
 
-            // Add this new device to the device list
-            currdev->next = bus->dev_link;
-            bus->dev_link = currdev;
-            bus->ndev++;
-        }
+                    // Save a reference to the bus
+                    currdev->bus = bus;
 
-        // Close the device (it may be opened up later)
-        close(fd);
+                    // Add this new device to the list of those found
+                    currdev->next = *found;
+                    *found = currdev;
+                    nfound++;
+                }
+
+                if (p->fd != -1)
+                {
+                    close(p->fd);
+                }
+                break;
+        }
     }
 
+    release_probe_set(set);
+
     globfree(&globdev);
 
     // If we found no devices but were forced to skip some due to permission-
     // related errors then return FORENSIC1394_RESULT_NO_PERM.
-    if (bus->ndev == 0 && perm_skipped > 0)
+    if (nfound == 0 && perm_skipped > 0 && ret == FORENSIC1394_RESULT_SUCCESS)
     {
         ret = FORENSIC1394_RESULT_NO_PERM;
     }
@@ -272,190 +653,1139 @@ forensic1394_result platform_update_device_list(forensic1394_bus *bus)
     return ret;
 }
 
-void platform_device_destroy(forensic1394_dev *dev)
+int platform_merge_device(forensic1394_dev *dev, forensic1394_dev *cand)
 {
-    // Just free the platform specific memory
-    free(dev->pdev);
+    int merged = 1;
+
+    pthread_mutex_lock(&dev->pdev->lock);
+
+    // If the node has moved to a new device file an open handle can not follow
+    if (dev->is_open)
+    {
+        merged = (strcmp(dev->pdev->path, cand->pdev->path) == 0);
+    }
+    /*
+     * Otherwise adopt the descriptor of the new node.  Even at the same path
+     *  ours may be stale, as the node is reopened should it fail to respond.
+     */
+    else if (cand->pdev->fd != -1)
+    {
+        memcpy(dev->pdev->path, cand->pdev->path, sizeof(dev->pdev->path));
+
+        if (dev->pdev->fd != -1)
+        {
+            close(dev->pdev->fd);
+        }
+
+        dev->pdev->fd = cand->pdev->fd;
+        cand->pdev->fd = -1;
+    }
+
+    // The node ID and generation change with every bus reset
+    if (merged)
+    {
+        dev->node_id    = cand->node_id;
+        dev->generation = cand->generation;
+    }
+
+    pthread_mutex_unlock(&dev->pdev->lock);
+
+    return merged;
 }
 
-forensic1394_result platform_open_device(forensic1394_dev *dev)
+forensic1394_result platform_enable_hotplug(forensic1394_bus *bus)
 {
-    dev->pdev->fd = open(dev->pdev->path, O_RDWR);
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
-    if (dev->pdev->fd == -1)
+    if (fd == -1)
     {
-        /*
-         * Return a general I/O error here as it is unlikely to be permission
-         * related on account of the device previously being opened in a similar
-         * way during the scanning process.
-         */
-        return FORENSIC1394_RESULT_IO_ERROR;
+        return FORENSIC1394_RESULT_OTHER_ERROR;
     }
-    else
+
+    /*
+     * Device nodes are created and removed by udev, which may only make them
+     * accessible to us after their creation; hence attribute changes are also
+     * of interest.
+     */
+    if (inotify_add_watch(fd, "/dev", IN_CREATE | IN_DELETE | IN_ATTRIB
+                                    | IN_MOVED_FROM | IN_MOVED_TO) == -1)
     {
-        return FORENSIC1394_RESULT_SUCCESS;
+        close(fd);
+        return (errno == EACCES) ? FORENSIC1394_RESULT_NO_PERM
+                                 : FORENSIC1394_RESULT_OTHER_ERROR;
     }
+
+    bus->pbus->inotify_fd = fd;
+
+    return FORENSIC1394_RESULT_SUCCESS;
 }
 
-void platform_close_device(forensic1394_dev *dev)
+int platform_get_hotplug_fd(forensic1394_bus *bus)
 {
-    close(dev->pdev->fd);
+    return bus->pbus->inotify_fd;
 }
 
-forensic1394_dev *alloc_dev(const char *devpath,
-                            const struct fw_cdev_get_info *info,
-                            const struct fw_cdev_event_bus_reset *reset)
+int platform_poll_hotplug(forensic1394_bus *bus)
 {
-    // Allocate memory for a device (calloc initialises to 0)
-    forensic1394_dev *dev = calloc(1, sizeof(forensic1394_dev));
+    int changed = 0;
 
-    // And for the platform-specific stuff
-    dev->pdev = malloc(sizeof(platform_dev));
+    char buffer[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
 
-    // Copy the device path into the platform specific structure
-    snprintf(dev->pdev->path, sizeof(dev->pdev->path), "%s", devpath);
+    while ((len = read(bus->pbus->inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        char *p;
 
-    // Mark the file descriptor as invalid
-    dev->pdev->fd = -1;
+        for (p = buffer; p < buffer + len;)
+        {
+            const struct inotify_event *ev = (const void *) p;
 
-    // Copy the ROM over (this comes from an ioctl as opposed to sysfs)
-    memcpy(dev->rom, U64_TO_PTR(info->rom), info->rom_length);
+            // We are only interested in FireWire device nodes
+            if (ev->len && strncmp(ev->name, "fw", 2) == 0)
+            {
+                changed = 1;
+            }
 
-    // Same with the node ID and generation
-    dev->node_id    = reset->node_id;
-    dev->generation = reset->generation;
+            // If events were dropped then anything could have happened
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                changed = 1;
+            }
 
-    // Parse the CSR
-    common_parse_csr(dev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
 
-    return dev;
+    return changed;
 }
 
-static int request_tcode(const forensic1394_req *r, request_type t)
+void platform_device_destroy(forensic1394_dev *dev)
 {
-    if (t == REQUEST_TYPE_READ)
+    if (dev->pdev->fd != -1)
     {
-        return (r->len == 4) ? TCODE_READ_QUADLET_REQUEST
-                             : TCODE_READ_BLOCK_REQUEST;
+        close(dev->pdev->fd);
     }
-    else
+
+    if (dev->pdev->wake_fd != -1)
     {
-        return (r->len == 4) ? TCODE_WRITE_QUADLET_REQUEST
-                             : TCODE_WRITE_BLOCK_REQUEST;
+        close(dev->pdev->wake_fd);
     }
-}
 
-forensic1394_result platform_send_requests(forensic1394_dev *dev,
-                                           request_type t,
-                                           const forensic1394_req *req,
-                                           size_t nreq)
-{
-    int i = 0;
-    int in_pipeline = 0;
+    pthread_cond_destroy(&dev->pdev->cond);
+    pthread_mutex_destroy(&dev->pdev->lock);
 
-    struct pollfd fdp = {
-        .fd     = dev->pdev->fd,
-        .events = POLLIN
-    };
+    // Free the platform specific memory
+    free(dev->pdev);
+}
 
-    // Keep going until all requests have been sent and all responses received
-    while (i < nreq || in_pipeline > 0)
+forensic1394_result platform_open_device(forensic1394_dev *dev)
+{
+    // Requests from any previous opening of the device are void
+    memset(dev->pdev->slot, 0, sizeof(dev->pdev->slot));
+    dev->pdev->in_pipeline = 0;
+
+    /*
+     * Promote the descriptor kept from scanning the bus; any bus resets since
+     * then will be waiting for us as events.  Subsequent resets are tracked by
+     * the request engine.
+     */
+    if (dev->pdev->fd != -1)
     {
-        // Ensure the request pipeline is full
-        while (in_pipeline < REQUEST_PIPELINE_SZ && i < nreq)
-        {
-            struct fw_cdev_send_request request;
+        drain_events(dev);
+    }
+    else
+    {
+        struct fw_cdev_event_bus_reset reset;
 
-            // Fill out the common request structure
-            request.tcode       = request_tcode(&req[i], t);
-            request.length      = req[i].len;
-            request.offset      = req[i].addr;
-            request.data        = (t == REQUEST_TYPE_WRITE) ? PTR_TO_U64(req[i].buf)
-                                                            : 0;
-            request.closure     = i;
-            request.generation  = dev->generation;
+        struct fw_cdev_get_info get_info = {
+            .version   = FW_CDEV_VERSION,
+            .bus_reset = PTR_TO_U64(&reset)
+        };
 
-            // Make the request
-            if (ioctl(dev->pdev->fd, FW_CDEV_IOC_SEND_REQUEST, &request) == -1)
-            {
-                // EIO errors are usually because of bad request sizes
-                return (errno == EIO) ? FORENSIC1394_RESULT_IO_SIZE
-                                      : FORENSIC1394_RESULT_IO_ERROR;
-            }
+        dev->pdev->fd = open(dev->pdev->path, O_RDWR);
 
-            i++; in_pipeline++;
+        if (dev->pdev->fd == -1)
+        {
+            /*
+             * Return a general I/O error here as it is unlikely to be
+             * permission related on account of the device previously being
+             * opened in a similar way during the scanning process.
+             */
+            return FORENSIC1394_RESULT_IO_ERROR;
         }
 
-        // Wait for a response
-        poll(&fdp, 1, FORENSIC1394_TIMEOUT_MS);
-
-        // If we got a response (and not a timeout)
-        if (fdp.revents == POLLIN)
+        // The bus may have been reset since the device was scanned
+        if (ioctl(dev->pdev->fd, FW_CDEV_IOC_GET_INFO, &get_info) == -1)
         {
-            char buffer[16 * 1024];
-            ssize_t response_len;
-            union fw_cdev_event *event = (void *) buffer;
+            close(dev->pdev->fd);
+            dev->pdev->fd = -1;
+            return FORENSIC1394_RESULT_IO_ERROR;
+        }
 
-            // Read an event from the device; blocking if need be
-            response_len = read(dev->pdev->fd, buffer, 16*1024);
+        dev->node_id    = reset.node_id;
+        dev->generation = reset.generation;
+    }
 
-            if (response_len != -1) switch (event->common.type)
-            {
-                // We have a response to our request (input or output)
-                case FW_CDEV_EVENT_RESPONSE:
-                {
-                    // Check the response code
-                    switch (event->response.rcode)
-                    {
-                        // Request was okay; continue processing
-                        case RCODE_COMPLETE:
-                            break;
-                        case RCODE_BUSY:
-                            return FORENSIC1394_RESULT_BUSY;
-                            break;
-                        // Different generations are a consequence of bus resets
-                        case RCODE_GENERATION:
-                            return FORENSIC1394_RESULT_BUS_RESET;
-                            break;
-                        default:
-                            return FORENSIC1394_RESULT_IO_ERROR;
-                            break;
-                    }
+    update_speed(dev);
 
-                    // If we are expecting some data
-                    if (t == REQUEST_TYPE_READ)
-                    {
-                        // Check the lengths match (they should!)
-                        if (event->response.length == req[event->common.closure].len)
-                        {
-                            memcpy(req[event->common.closure].buf,
-                                   event->response.data, event->response.length);
-                        }
-                        else
-                        {
-                            return FORENSIC1394_RESULT_IO_ERROR;
-                        }
-                    }
+    // Start up the I/O thread if requested
+    if (dev->use_io_thread)
+    {
+        // The I/O thread can not be woken up without an eventfd
+        if (dev->pdev->wake_fd == -1)
+        {
+            return FORENSIC1394_RESULT_OTHER_ERROR;
+        }
 
-                    in_pipeline--;
-                    break;
-                }
-                // Ignore everything else
-                default:
-                    break;
-            }
-            // Problem reading the response back from the device
-            else
+        common_mpsc_init(&dev->pdev->submit);
+        dev->pdev->io_running = 1;
+
+        if (pthread_create(&dev->pdev->io_thread, NULL, io_thread_main, dev))
+        {
+            dev->pdev->io_running = 0;
+            return FORENSIC1394_RESULT_OTHER_ERROR;
+        }
+    }
+
+    return FORENSIC1394_RESULT_SUCCESS;
+}
+
+void platform_close_device(forensic1394_dev *dev)
+{
+    // Stop the I/O thread; outstanding batches will be failed
+    if (dev->pdev->io_running)
+    {
+        uint64_t one = 1;
+
+        __atomic_store_n(&dev->pdev->io_running, 0, __ATOMIC_RELEASE);
+
+        if (write(dev->pdev->wake_fd, &one, sizeof(one)) == -1)
+        {
+            // Counter is saturated; the I/O thread will wake anyway
+        }
+
+        pthread_join(dev->pdev->io_thread, NULL);
+    }
+
+    // The descriptor is kept until the device is destroyed
+}
+
+forensic1394_dev *alloc_dev(const char *devpath,
+                            const struct fw_cdev_get_info *info,
+                            const struct fw_cdev_event_bus_reset *reset)
+{
+    // Allocate memory for a device (calloc initialises to 0)
+    forensic1394_dev *dev = calloc(1, sizeof(forensic1394_dev));
+
+    // And for the platform-specific stuff (leaving the pipeline empty)
+    dev->pdev = calloc(1, sizeof(platform_dev));
+
+    // Copy the device path into the platform specific structure
+    snprintf(dev->pdev->path, sizeof(dev->pdev->path), "%s", devpath);
+
+    // Mark the file descriptor as invalid
+    dev->pdev->fd = -1;
+
+    // No requests have been made yet
+    dev->pdev->tag = 0;
+
+    // Set up the synchronisation primitives for sharing the pipeline
+    pthread_mutex_init(&dev->pdev->lock, NULL);
+    pthread_cond_init(&dev->pdev->cond, NULL);
+
+    // Not being able to wake the driver only costs latency; so not fatal
+    dev->pdev->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    // Copy the ROM over (this comes from an ioctl as opposed to sysfs)
+    memcpy(dev->rom, U64_TO_PTR(info->rom), info->rom_length);
+
+    // Same with the node ID and generation
+    dev->node_id    = reset->node_id;
+    dev->generation = reset->generation;
+
+    // Parse the CSR
+    common_parse_csr(dev);
+
+    // Initialise the platform-independent state
+    common_init_device(dev);
+
+    // Pipeline no deeper than is known to be safe
+    dev->max_depth = REQUEST_PIPELINE_SZ;
+    dev->cwnd      = REQUEST_PIPELINE_SZ;
+
+    return dev;
+}
+
+void probe_nodes(probe_set *set)
+{
+    int i, n = set->pending;
+    struct timespec deadline;
+
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, PROBE_THREAD_STACK_SZ);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += PROBE_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (PROBE_TIMEOUT_MS % 1000) * 1000000L;
+
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    for (i = 0; n > 0; i++)
+    {
+        pthread_t thread;
+        node_probe *p = &set->probe[i];
+
+        if (p->state != PROBE_PENDING)
+        {
+            continue;
+        }
+
+        n--;
+
+        /*
+         * Even a lone node is probed on a thread of its own, as only then can
+         * we stop waiting for it should it hang.
+         */
+        pthread_mutex_lock(&set->lock);
+        set->refs++;
+        pthread_mutex_unlock(&set->lock);
+
+        if (pthread_create(&thread, &attr, probe_thread, p))
+        {
+            pthread_mutex_lock(&set->lock);
+            set->refs--;
+            set->pending--;
+            p->state = PROBE_NO_THREAD;
+
+            if (p->fd != -1)
             {
-                return FORENSIC1394_RESULT_IO_ERROR;
+                close(p->fd);
+                p->fd = -1;
             }
+
+            pthread_mutex_unlock(&set->lock);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+
+    // Wait for the probes to finish
+    pthread_mutex_lock(&set->lock);
+
+    while (set->pending > 0)
+    {
+        if (pthread_cond_timedwait(&set->cond, &set->lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    // Stragglers now have to clean up after themselves
+    set->abandoned = 1;
+
+    pthread_mutex_unlock(&set->lock);
+}
+
+void probe_node(node_probe *p)
+{
+    node_probe r = *p;
+
+    // Fill out a get info request
+    r.get_info.version    = FW_CDEV_VERSION;
+    r.get_info.rom        = PTR_TO_U64(r.rom);
+    r.get_info.rom_length = sizeof(r.rom);
+    r.get_info.bus_reset  = PTR_TO_U64(&r.reset);
+
+    // If probing through an existing descriptor fails the node has gone away
+    if (r.fd != -1 && ioctl(r.fd, FW_CDEV_IOC_GET_INFO, &r.get_info) == -1)
+    {
+        close(r.fd);
+        r.fd = -1;
+        r.cached = 0;
+    }
+
+    if (r.fd == -1)
+    {
+        // Open up the device
+        r.fd = open(r.path, O_RDWR);
+
+        if (r.fd == -1)
+        {
+            r.err = errno;
+            r.state = PROBE_NO_OPEN;
+        }
+        // Send the get info request
+        else if (ioctl(r.fd, FW_CDEV_IOC_GET_INFO, &r.get_info) == -1)
+        {
+            close(r.fd);
+            r.fd = -1;
+            r.state = PROBE_NO_INFO;
         }
-        // Poll timed out
         else
         {
-            return FORENSIC1394_RESULT_IO_TIMEOUT;
+            r.state = PROBE_DONE;
+        }
+    }
+    else
+    {
+        r.state = PROBE_DONE;
+    }
+
+    // Publish the results, fixing up the pointers to the ROM and bus reset
+    pthread_mutex_lock(&p->set->lock);
+
+    if (!p->set->abandoned)
+    {
+        *p = r;
+        p->get_info.rom       = PTR_TO_U64(p->rom);
+        p->get_info.bus_reset = PTR_TO_U64(&p->reset);
+    }
+    // Too late; nobody is interested in the node any more
+    else if (r.fd != -1)
+    {
+        close(r.fd);
+    }
+
+    pthread_mutex_unlock(&p->set->lock);
+}
+
+void *probe_thread(void *arg)
+{
+    node_probe *p = arg;
+    probe_set *set = p->set;
+
+    probe_node(p);
+
+    pthread_mutex_lock(&set->lock);
+    set->pending--;
+    pthread_cond_signal(&set->cond);
+    pthread_mutex_unlock(&set->lock);
+
+    release_probe_set(set);
+
+    return NULL;
+}
+
+void release_probe_set(probe_set *set)
+{
+    int refs;
+
+    pthread_mutex_lock(&set->lock);
+    refs = --set->refs;
+    pthread_mutex_unlock(&set->lock);
+
+    if (refs == 0)
+    {
+        pthread_cond_destroy(&set->cond);
+        pthread_mutex_destroy(&set->lock);
+        free(set);
+    }
+}
+
+int read_sysfs_guid(const char *devpath, int64_t *guid)
+{
+    char path[128];
+    unsigned long long value;
+    int ok;
+
+    FILE *f;
+
+    // The device /dev/fwN is described by /sys/bus/firewire/devices/fwN
+    const char *name = strrchr(devpath, '/');
+
+    snprintf(path, sizeof(path), "/sys/bus/firewire/devices/%s/guid",
+             name ? name + 1 : devpath);
+
+    f = fopen(path, "r");
+
+    if (!f)
+    {
+        return 0;
+    }
+
+    ok = (fscanf(f, "%llx", &value) == 1);
+    fclose(f);
+
+    if (ok)
+    {
+        *guid = (int64_t) value;
+    }
+
+    return ok;
+}
+
+int find_cached_fd(forensic1394_bus *bus, const char *devpath)
+{
+    forensic1394_dev *cdev;
+
+    for (cdev = bus->dev_link; cdev; cdev = cdev->next)
+    {
+        if (cdev->pdev->fd != -1 && strcmp(cdev->pdev->path, devpath) == 0)
+        {
+            return cdev->pdev->fd;
+        }
+    }
+
+    return -1;
+}
+
+void follow_bus_reset(forensic1394_dev *dev,
+                      const struct fw_cdev_event_bus_reset *r)
+{
+    // Generations wrap around; so compare them in a wrap-safe manner
+    if ((int32_t) (r->generation - dev->generation) >= 0)
+    {
+        // The topology, and so the path to the device, may have changed
+        if (r->generation != dev->generation)
+        {
+            update_speed(dev);
+        }
+
+        dev->node_id    = r->node_id;
+        dev->generation = r->generation;
+    }
+}
+
+void update_speed(forensic1394_dev *dev)
+{
+    int speed = ioctl(dev->pdev->fd, FW_CDEV_IOC_GET_SPEED);
+
+    dev->speed = (speed >= 0) ? speed : FORENSIC1394_SPEED_UNKNOWN;
+}
+
+int read_bus_resets(int fd, struct fw_cdev_event_bus_reset *reset)
+{
+    int found = 0;
+
+    char buffer[16 * 1024];
+    union fw_cdev_event *event = (void *) buffer;
+
+    struct pollfd fdp = { .fd = fd, .events = POLLIN };
+
+    while (poll(&fdp, 1, 0) > 0 && (fdp.revents & POLLIN))
+    {
+        if (read(fd, buffer, sizeof(buffer)) <= 0)
+        {
+            break;
         }
+
+        if (event->common.type == FW_CDEV_EVENT_BUS_RESET)
+        {
+            *reset = event->bus_reset;
+            found = 1;
+        }
+    }
+
+    return found;
+}
+
+void drain_events(forensic1394_dev *dev)
+{
+    struct fw_cdev_event_bus_reset reset;
+
+    if (read_bus_resets(dev->pdev->fd, &reset))
+    {
+        follow_bus_reset(dev, &reset);
+    }
+}
+
+int platform_wait_bus_reset(forensic1394_dev *dev, int64_t timeout_us)
+{
+    int fd = dev->bus->pbus->local_fd;
+    struct fw_cdev_event_bus_reset reset;
+
+    // Without the local node this is a plain sleep (poll ignores fd == -1)
+    struct pollfd fdp = { .fd = fd, .events = POLLIN };
+
+    if (poll(&fdp, 1, (timeout_us + 999) / 1000) <= 0
+     || !(fdp.revents & POLLIN)
+     || !read_bus_resets(fd, &reset))
+    {
+        return 0;
+    }
+
+    /*
+     * Requests carry the generation they are for; so rather than wait for the
+     * device to see the reset, query the current generation directly.
+     */
+    {
+        struct fw_cdev_get_info get_info = {
+            .version   = FW_CDEV_VERSION,
+            .bus_reset = PTR_TO_U64(&reset)
+        };
+
+        if (ioctl(dev->pdev->fd, FW_CDEV_IOC_GET_INFO, &get_info) == 0)
+        {
+            pthread_mutex_lock(&dev->pdev->lock);
+            follow_bus_reset(dev, &reset);
+            pthread_mutex_unlock(&dev->pdev->lock);
+        }
+    }
+
+    return 1;
+}
+
+static int request_tcode(const request_batch *b, size_t i)
+{
+    if (b->type == REQUEST_TYPE_READ)
+    {
+        return (b->req[i].len == 4) ? TCODE_READ_QUADLET_REQUEST
+                                    : TCODE_READ_BLOCK_REQUEST;
+    }
+    else if (b->type == REQUEST_TYPE_WRITE)
+    {
+        return (b->req[i].len == 4) ? TCODE_WRITE_QUADLET_REQUEST
+                                    : TCODE_WRITE_BLOCK_REQUEST;
+    }
+
+    switch (b->lock[i].op)
+    {
+        case FORENSIC1394_LOCK_MASK_SWAP:
+            return TCODE_LOCK_MASK_SWAP;
+        case FORENSIC1394_LOCK_COMPARE_SWAP:
+            return TCODE_LOCK_COMPARE_SWAP;
+        case FORENSIC1394_LOCK_FETCH_ADD:
+            return TCODE_LOCK_FETCH_ADD;
+        case FORENSIC1394_LOCK_LITTLE_ADD:
+            return TCODE_LOCK_LITTLE_ADD;
+        case FORENSIC1394_LOCK_BOUNDED_ADD:
+            return TCODE_LOCK_BOUNDED_ADD;
+        default:
+            return TCODE_LOCK_WRAP_ADD;
+    }
+}
+
+forensic1394_result send_request(forensic1394_dev *dev,
+                                 const request_batch *b, size_t i,
+                                 __u64 closure)
+{
+    struct fw_cdev_send_request request;
+
+    // Argument and data values of a lock request; copied by the ioctl
+    char payload[16];
+
+    // Fill out the common request structure
+    request.tcode       = request_tcode(b, i);
+    request.offset      = (b->type == REQUEST_TYPE_LOCK) ? b->lock[i].addr
+                                                         : b->req[i].addr;
+    request.closure     = closure;
+    request.generation  = dev->generation;
+
+    if (b->type == REQUEST_TYPE_LOCK)
+    {
+        request.length  = common_lock_payload(&b->lock[i], payload);
+        request.data    = PTR_TO_U64(payload);
+    }
+    else
+    {
+        request.length  = b->req[i].len;
+        request.data    = (b->type == REQUEST_TYPE_WRITE)
+                        ? PTR_TO_U64(b->req[i].buf) : 0;
+    }
+
+    // Make the request
+    if (ioctl(dev->pdev->fd, FW_CDEV_IOC_SEND_REQUEST, &request) == -1)
+    {
+        // EIO errors are usually because of bad request sizes
+        return (errno == EIO) ? FORENSIC1394_RESULT_IO_SIZE
+                              : FORENSIC1394_RESULT_IO_ERROR;
     }
 
     return FORENSIC1394_RESULT_SUCCESS;
 }
+
+void fill_pipeline(forensic1394_dev *dev)
+{
+    size_t j;
+    request_batch *b;
+
+    platform_dev *pdev = dev->pdev;
+    int64_t now = common_get_time_us();
+
+    // Retry any busy requests whose back-off period has elapsed
+    for (j = 0; j < FORENSIC1394_PIPELINE_MAX; j++)
+    {
+        pipeline_slot *s = &pdev->slot[j];
+
+        if (s->state == SLOT_BACKOFF && s->retry_us <= now)
+        {
+            forensic1394_result ret;
+
+            s->tag = ++pdev->tag;
+
+            ret = send_request(dev, s->batch, s->idx, CLOSURE(s->tag, j));
+
+            if (ret != FORENSIC1394_RESULT_SUCCESS)
+            {
+                finish_batch(dev, s->batch, ret);
+                continue;
+            }
+
+            s->state    = SLOT_IN_FLIGHT;
+            s->sent_us  = common_get_time_us();
+        }
+    }
+
+    // Fill the pipeline with whatever the scheduler deems most important
+    while ((b = common_sched_next(dev, pdev->in_pipeline)))
+    {
+        forensic1394_result ret;
+        pipeline_slot *s;
+
+        // The window never exceeds the number of slots; so one will be free
+        for (j = 0; pdev->slot[j].state != SLOT_FREE; j++);
+
+        s = &pdev->slot[j];
+        s->tag = ++pdev->tag;
+
+        ret = send_request(dev, b, b->next, CLOSURE(s->tag, j));
+
+        if (ret != FORENSIC1394_RESULT_SUCCESS)
+        {
+            finish_batch(dev, b, ret);
+            continue;
+        }
+
+        // Note when the request was sent for timing purposes
+        s->state    = SLOT_IN_FLIGHT;
+        s->batch    = b;
+        s->idx      = b->next;
+        s->sent_us  = common_get_time_us();
+        s->attempt  = 0;
+
+        b->next++; b->in_pipeline++;
+        pdev->in_pipeline++;
+    }
+}
+
+void finish_batch(forensic1394_dev *dev, request_batch *b,
+                  forensic1394_result ret)
+{
+    size_t j;
+
+    // Abandon any requests from the batch which remain in the pipeline
+    for (j = 0; j < FORENSIC1394_PIPELINE_MAX && b->in_pipeline > 0; j++)
+    {
+        if (dev->pdev->slot[j].state != SLOT_FREE
+         && dev->pdev->slot[j].batch == b)
+        {
+            dev->pdev->slot[j].state = SLOT_FREE;
+
+            b->in_pipeline--;
+            dev->pdev->in_pipeline--;
+        }
+    }
+
+    b->ret  = ret;
+    b->done = 1;
+
+    common_sched_remove(dev, b);
+
+    // Let the owner of the batch know
+    dev->pdev->completed = 1;
+
+    // This must come last as the batch may cease to exist once called
+    if (b->complete)
+    {
+        b->complete(b);
+    }
+}
+
+void finish_all_batches(forensic1394_dev *dev, forensic1394_result ret)
+{
+    int p;
+
+    for (p = 0; p < FORENSIC1394_PRIORITY_NUM; p++)
+    {
+        while (dev->sched.head[p])
+        {
+            finish_batch(dev, dev->sched.head[p], ret);
+        }
+    }
+}
+
+void handle_response(forensic1394_dev *dev,
+                     const struct fw_cdev_event_response *resp)
+{
+    size_t j = CLOSURE_SLOT(resp->closure);
+
+    pipeline_slot *s;
+    request_batch *b;
+
+    // Discard responses to requests which have been abandoned
+    if (j >= FORENSIC1394_PIPELINE_MAX
+     || dev->pdev->slot[j].state != SLOT_IN_FLIGHT
+     || dev->pdev->slot[j].tag != CLOSURE_TAG(resp->closure))
+    {
+        return;
+    }
+
+    s = &dev->pdev->slot[j];
+    b = s->batch;
+
+    // Any response, good or bad, is a valid RTT sample
+    common_rtt_sample(dev, common_get_time_us() - s->sent_us);
+
+    // Check the response code
+    switch (resp->rcode)
+    {
+        // Request was okay; continue processing
+        case RCODE_COMPLETE:
+            common_cc_success(dev);
+            break;
+        // Device is congested; back off and retry
+        case RCODE_BUSY:
+            if (++s->attempt > FORENSIC1394_BUSY_RETRIES)
+            {
+                finish_batch(dev, b, FORENSIC1394_RESULT_BUSY);
+                return;
+            }
+
+            common_cc_busy(dev);
+
+            s->state    = SLOT_BACKOFF;
+            s->retry_us = common_get_time_us()
+                        + common_cc_backoff_us(dev, s->attempt);
+            return;
+        // Different generations are a consequence of bus resets
+        case RCODE_GENERATION:
+            finish_batch(dev, b, FORENSIC1394_RESULT_BUS_RESET);
+            return;
+        default:
+            finish_batch(dev, b, FORENSIC1394_RESULT_IO_ERROR);
+            return;
+    }
+
+    // If we are expecting some data
+    if (b->type == REQUEST_TYPE_READ)
+    {
+        const forensic1394_req *r = &b->req[s->idx];
+
+        // Check the lengths match (they should!)
+        if (resp->length != r->len)
+        {
+            finish_batch(dev, b, FORENSIC1394_RESULT_IO_ERROR);
+            return;
+        }
+
+        memcpy(r->buf, resp->data, resp->length);
+    }
+    // Lock responses carry the old value
+    else if (b->type == REQUEST_TYPE_LOCK)
+    {
+        const forensic1394_lock_req *r = &b->lock[s->idx];
+
+        if (resp->length != r->len)
+        {
+            finish_batch(dev, b, FORENSIC1394_RESULT_IO_ERROR);
+            return;
+        }
+
+        if (r->old)
+        {
+            memcpy(r->old, resp->data, resp->length);
+        }
+    }
+
+    // Free up the slot
+    s->state = SLOT_FREE;
+
+    b->in_pipeline--;
+    dev->pdev->in_pipeline--;
+
+    // See if this was the last outstanding request of the batch
+    if (b->next == b->nreq && b->in_pipeline == 0)
+    {
+        finish_batch(dev, b, FORENSIC1394_RESULT_SUCCESS);
+    }
+}
+
+void drive_pipeline(forensic1394_dev *dev)
+{
+    size_t j;
+    int pret;
+    int64_t now, deadline = INT64_MAX, wakeup = INT64_MAX;
+
+    char buffer[16 * 1024];
+    ssize_t response_len = -1;
+    union fw_cdev_event *event = (void *) buffer;
+
+    platform_dev *pdev = dev->pdev;
+
+    struct pollfd fdp[2] = {
+        { .fd = pdev->fd,       .events = POLLIN },
+        { .fd = pdev->wake_fd,  .events = POLLIN }
+    };
+
+    fill_pipeline(dev);
+
+    /*
+     * If everything failed to send there is nothing to wait for; unless we
+     * are the I/O thread, in which case we wait to be woken up.
+     */
+    if (pdev->in_pipeline == 0 && !pdev->io_running)
+    {
+        return;
+    }
+
+    /*
+     * Wait until either the oldest outstanding request times out or the
+     * next busy request is due to be retried, whichever comes first.
+     */
+    for (j = 0; j < FORENSIC1394_PIPELINE_MAX; j++)
+    {
+        if (pdev->slot[j].state == SLOT_IN_FLIGHT)
+        {
+            deadline = MIN(deadline, pdev->slot[j].sent_us + dev->rto_us);
+        }
+        else if (pdev->slot[j].state == SLOT_BACKOFF)
+        {
+            wakeup = MIN(wakeup, pdev->slot[j].retry_us);
+        }
+    }
+
+    wakeup = MIN(wakeup, deadline);
+    now = common_get_time_us();
+
+    // Let other threads queue up requests while we wait
+    pthread_mutex_unlock(&pdev->lock);
+
+    // Wait for a response, rounding the timeout up to the nearest ms
+    if (wakeup == INT64_MAX)
+    {
+        pret = poll(fdp, 2, -1);
+    }
+    else
+    {
+        pret = (now < wakeup) ? poll(fdp, (pdev->wake_fd != -1) ? 2 : 1,
+                                     (wakeup - now + 999) / 1000)
+                              : 0;
+    }
+
+    // Read an event from the device
+    if (pret > 0 && (fdp[0].revents & POLLIN))
+    {
+        response_len = read(pdev->fd, buffer, sizeof(buffer));
+    }
+
+    // Drain the wake-up counter; new batches are picked up by fill_pipeline
+    if (pret > 0 && (fdp[1].revents & POLLIN))
+    {
+        uint64_t count;
+
+        if (read(pdev->wake_fd, &count, sizeof(count)) == -1)
+        {
+            // Nothing to do; the counter is non-blocking
+        }
+    }
+
+    pthread_mutex_lock(&pdev->lock);
+
+    // Interrupted by a signal; go around again
+    if (pret == -1 && errno == EINTR)
+    {
+        return;
+    }
+    // If we got an event
+    else if (pret > 0 && (fdp[0].revents & POLLIN))
+    {
+        // Problem reading the response back from the device
+        if (response_len == -1)
+        {
+            finish_all_batches(dev, FORENSIC1394_RESULT_IO_ERROR);
+        }
+        // We have a response to a request (input or output)
+        else if (event->common.type == FW_CDEV_EVENT_RESPONSE)
+        {
+            handle_response(dev, &event->response);
+        }
+        /*
+         * Follow the node across bus resets; requests in flight at the time
+         * of the reset fail with a generation error but new ones will succeed.
+         */
+        else if (event->common.type == FW_CDEV_EVENT_BUS_RESET)
+        {
+            follow_bus_reset(dev, &event->bus_reset);
+        }
+        // Ignore everything else
+    }
+    // Poll failed or the device has gone away
+    else if (pret == -1 || (pret > 0 && fdp[0].revents))
+    {
+        finish_all_batches(dev, FORENSIC1394_RESULT_IO_ERROR);
+    }
+    // See if any outstanding requests have timed out
+    else if ((now = common_get_time_us()) >= deadline)
+    {
+        for (j = 0; j < FORENSIC1394_PIPELINE_MAX; j++)
+        {
+            pipeline_slot *s = &pdev->slot[j];
+
+            if (s->state == SLOT_IN_FLIGHT && s->sent_us + dev->rto_us <= now)
+            {
+                finish_batch(dev, s->batch, FORENSIC1394_RESULT_IO_TIMEOUT);
+            }
+        }
+
+        // Back off the timeout for subsequent requests
+        common_rtt_timeout(dev);
+    }
+}
+
+void *io_thread_main(void *arg)
+{
+    forensic1394_dev *dev = arg;
+    platform_dev *pdev = dev->pdev;
+    request_batch *b;
+
+    /*
+     * The lock is only ever taken by this thread while it is running; it is
+     * held so that the pipeline code can be shared with non-threaded mode.
+     */
+    pthread_mutex_lock(&pdev->lock);
+
+    while (__atomic_load_n(&pdev->io_running, __ATOMIC_ACQUIRE))
+    {
+        // Move newly submitted batches onto the scheduling queues
+        while ((b = common_mpsc_pop(&pdev->submit)))
+        {
+            common_sched_enqueue(dev, b);
+        }
+
+        drive_pipeline(dev);
+    }
+
+    // Fail anything that was submitted but is yet to complete
+    while ((b = common_mpsc_pop(&pdev->submit)))
+    {
+        common_sched_enqueue(dev, b);
+    }
+
+    finish_all_batches(dev, FORENSIC1394_RESULT_IO_ERROR);
+
+    pthread_mutex_unlock(&pdev->lock);
+
+    return NULL;
+}
+
+void io_thread_complete(request_batch *b)
+{
+    sem_post(b->complete_data);
+}
+
+forensic1394_result platform_send_requests(forensic1394_dev *dev,
+                                           request_type t,
+                                           forensic1394_priority prio,
+                                           const forensic1394_req *req,
+                                           size_t nreq)
+{
+    request_batch b;
+
+    common_batch_init(&b, t, prio, req, nreq);
+
+    return submit_batch(dev, &b);
+}
+
+forensic1394_result platform_lock_requests(forensic1394_dev *dev,
+                                           forensic1394_priority prio,
+                                           const forensic1394_lock_req *req,
+                                           size_t nreq)
+{
+    request_batch b;
+
+    common_batch_init(&b, REQUEST_TYPE_LOCK, prio, NULL, nreq);
+    b.lock = req;
+
+    return submit_batch(dev, &b);
+}
+
+forensic1394_result submit_batch(forensic1394_dev *dev, request_batch *b)
+{
+    platform_dev *pdev = dev->pdev;
+
+    // Nothing to do
+    if (b->nreq == 0)
+    {
+        return FORENSIC1394_RESULT_SUCCESS;
+    }
+
+    // Hand the batch over to the I/O thread and wait for it to complete
+    if (pdev->io_running)
+    {
+        sem_t done;
+        uint64_t one = 1;
+
+        sem_init(&done, 0, 0);
+
+        b->complete      = io_thread_complete;
+        b->complete_data = &done;
+
+        common_mpsc_push(&pdev->submit, b);
+
+        if (write(pdev->wake_fd, &one, sizeof(one)) == -1)
+        {
+            // Counter is saturated; the I/O thread will wake anyway
+        }
+
+        while (sem_wait(&done) == -1 && errno == EINTR);
+
+        sem_destroy(&done);
+
+        return b->ret;
+    }
+
+    pthread_mutex_lock(&pdev->lock);
+
+    common_sched_enqueue(dev, b);
+
+    while (!b->done)
+    {
+        // Another thread is driving; nudge it and wait for our batch
+        if (pdev->driving)
+        {
+            if (pdev->wake_fd != -1)
+            {
+                uint64_t one = 1;
+
+                if (write(pdev->wake_fd, &one, sizeof(one)) == -1)
+                {
+                    // Counter is saturated; the driver will wake anyway
+                }
+            }
+
+            pthread_cond_wait(&pdev->cond, &pdev->lock);
+            continue;
+        }
+
+        // Take over the pipeline until our batch is done
+        pdev->driving = 1;
+
+        while (!b->done)
+        {
+            drive_pipeline(dev);
+
+            // Wake any threads whose batches were completed by us
+            if (pdev->completed)
+            {
+                pdev->completed = 0;
+                pthread_cond_broadcast(&pdev->cond);
+            }
+        }
+
+        // Hand the pipeline over to anyone who is still waiting
+        pdev->driving = 0;
+        pthread_cond_broadcast(&pdev->cond);
+    }
+
+    pthread_mutex_unlock(&pdev->lock);
+
+    return b->ret;
+}
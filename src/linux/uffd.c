@@ -0,0 +1,709 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Device memory mappings.  Each mapping is an anonymous, read-only, region
+ *  registered with userfaultfd.  A thread per mapping waits for page faults,
+ *  reads the missing pages in from the device and copies them into place with
+ *  UFFDIO_COPY, which also wakes the faulting threads.  All faults pending at
+ *  once are served by a single vectored read.
+ */
+
+#include "common.h"
+
+#ifdef FORENSIC1394_HAVE_USERFAULTFD
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <linux/userfaultfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define PTR_TO_U64(p) ((__u64)(intptr_t)(p))
+
+/// Number of pages read around a fault which is not part of a stream
+#define MAP_CLUSTER_MIN     4
+
+/// Largest number of pages read around a single fault
+#define MAP_CLUSTER_MAX     64
+
+/// Largest number of pages read at once for a batch of faults
+#define MAP_BATCH_MAX       256
+
+/// Number of fault messages read from the descriptor at once
+#define MAP_NMSG            16
+
+/// States of a page of a mapping
+enum
+{
+    PAGE_MISSING = 0,
+    PAGE_PRESENT,
+    PAGE_PENDING
+};
+
+/**
+ * A run of pages of a mapping to be read in one go.
+ */
+typedef struct
+{
+    size_t page;
+    size_t npage;
+} map_cluster;
+
+struct _platform_map
+{
+    forensic1394_dev *dev;
+
+    /// Address of the device memory backing the first page
+    uint64_t base;
+
+    /// The mapping itself, along with the offset of the pointer given out
+    char *addr;
+    size_t len;
+    size_t off;
+
+    size_t pagesz;
+    size_t npage;
+
+    /// State of each page
+    unsigned char *state;
+
+    int uffd;
+
+    /// Written to in order to stop the fault thread
+    int stop_fd;
+
+    pthread_t thread;
+    int thread_started;
+
+    /// Held while pages are being read in, refreshed or invalidated
+    pthread_mutex_t lock;
+
+    /// Size of the next cluster and the page which would continue the stream
+    size_t cluster;
+    size_t next;
+
+    /// Staging buffer and requests for reading in a batch
+    char *stage;
+    forensic1394_req *req;
+    size_t nreqsz;
+
+    platform_map *link;
+};
+
+/**
+ * Opens a userfaultfd descriptor.  Should the process not be permitted to
+ *  handle kernel faults a descriptor handling only user faults is opened.
+ *
+ *  \return The descriptor or -1 on error.
+ */
+static int open_uffd(void);
+
+/**
+ * Returns the mapping of \a dev containing the range [\a addr, \a addr +
+ *  \a len), or NULL if there is none.
+ */
+static platform_map *find_map(forensic1394_dev *dev, const void *addr,
+                              size_t len);
+
+/**
+ * Reads the clusters \a c of \a m into its staging buffer and copies them into
+ *  place.  Pages which can not be read are filled with zeros.  The lock must
+ *  be held.
+ */
+static void fill_clusters(platform_map *m, const map_cluster *c, int nc);
+
+/**
+ * Reads the \a npage pages starting at \a page of \a m into \a buf.
+ *
+ *  \return A result status code.
+ */
+static forensic1394_result read_pages(platform_map *m, size_t page,
+                                      size_t npage, char *buf);
+
+/**
+ * Ensures that \a m has room for at least \a nreq requests.
+ *
+ *  \return Non-zero on success or zero if memory could not be allocated.
+ */
+static int reserve_reqs(platform_map *m, size_t nreq);
+
+/**
+ * Zaps the pages of \a m in [\a first, \a last) so that the next access to
+ *  them faults.  The lock must be held.
+ */
+static void zap_pages(platform_map *m, size_t first, size_t last);
+
+static void *fault_thread(void *arg);
+
+static void destroy_map(platform_map *m);
+
+const void *platform_map_device(forensic1394_dev *dev, uint64_t base,
+                                size_t len)
+{
+    platform_map *m;
+    struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+    struct uffdio_register reg;
+
+    size_t pagesz = sysconf(_SC_PAGESIZE);
+
+    if (!(m = calloc(1, sizeof(*m))))
+    {
+        return NULL;
+    }
+
+    m->dev      = dev;
+    m->pagesz   = pagesz;
+    m->uffd     = -1;
+    m->stop_fd  = -1;
+    m->addr     = MAP_FAILED;
+
+    // Map whole pages, with the first containing base
+    m->base     = base - base % pagesz;
+    m->off      = base % pagesz;
+    m->npage    = (m->off + len + pagesz - 1) / pagesz;
+    m->len      = m->npage * pagesz;
+
+    m->cluster  = MAP_CLUSTER_MIN;
+    m->next     = SIZE_MAX;
+
+    pthread_mutex_init(&m->lock, NULL);
+
+    m->state    = calloc(m->npage, 1);
+    m->stage    = malloc(MAP_BATCH_MAX * pagesz);
+
+    if (!m->state || !m->stage)
+    {
+        goto err;
+    }
+
+    m->addr = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+
+    if (m->addr == MAP_FAILED
+     || (m->uffd = open_uffd()) == -1
+     || ioctl(m->uffd, UFFDIO_API, &api) == -1)
+    {
+        goto err;
+    }
+
+    reg.range.start = PTR_TO_U64(m->addr);
+    reg.range.len   = m->len;
+    reg.mode        = UFFDIO_REGISTER_MODE_MISSING;
+
+    if (ioctl(m->uffd, UFFDIO_REGISTER, &reg) == -1
+     || (m->stop_fd = eventfd(0, EFD_CLOEXEC)) == -1
+     || pthread_create(&m->thread, NULL, fault_thread, m))
+    {
+        goto err;
+    }
+
+    m->thread_started = 1;
+
+    m->link = dev->maps;
+    dev->maps = m;
+
+    return m->addr + m->off;
+
+err:
+    destroy_map(m);
+    return NULL;
+}
+
+forensic1394_result platform_refresh_map(forensic1394_dev *dev,
+                                         const void *addr, size_t len)
+{
+    forensic1394_result ret = FORENSIC1394_RESULT_SUCCESS;
+    platform_map *m = find_map(dev, addr, len);
+    size_t first, last, i, j;
+
+    if (!m)
+    {
+        return FORENSIC1394_RESULT_OTHER_ERROR;
+    }
+
+    first = ((const char *) addr - m->addr) / m->pagesz;
+    last = ((const char *) addr - m->addr + len + m->pagesz - 1) / m->pagesz;
+
+    pthread_mutex_lock(&m->lock);
+
+    // Only pages which have been read are refreshed; so work in runs of them
+    for (i = first; i < last; i = j)
+    {
+        map_cluster c[MAP_BATCH_MAX];
+        size_t nc = 0;
+        size_t npage = 0;
+
+        // Gather up runs of present pages until the batch is full
+        for (j = i; j < last && npage < MAP_BATCH_MAX; j++)
+        {
+            if (m->state[j] != PAGE_PRESENT)
+            {
+                continue;
+            }
+
+            if (nc && c[nc - 1].page + c[nc - 1].npage == j)
+            {
+                c[nc - 1].npage++;
+            }
+            else
+            {
+                c[nc].page = j;
+                c[nc].npage = 1;
+                nc++;
+            }
+
+            npage++;
+        }
+
+        // Discard the pages; faults on them will wait for the lock
+        zap_pages(m, i, j);
+
+        if (nc)
+        {
+            size_t k, off = 0;
+            forensic1394_result cret = FORENSIC1394_RESULT_SUCCESS;
+
+            // Read the runs into the staging buffer one after another
+            for (k = 0; k < nc && cret == FORENSIC1394_RESULT_SUCCESS; k++)
+            {
+                cret = read_pages(m, c[k].page, c[k].npage, m->stage + off);
+                off += c[k].npage * m->pagesz;
+            }
+
+            // Should the read fail the pages are left to be faulted in again
+            if (cret != FORENSIC1394_RESULT_SUCCESS)
+            {
+                ret = cret;
+                continue;
+            }
+
+            for (k = 0, off = 0; k < nc; k++)
+            {
+                struct uffdio_copy copy = {
+                    .dst  = PTR_TO_U64(m->addr + c[k].page * m->pagesz),
+                    .src  = PTR_TO_U64(m->stage + off),
+                    .len  = c[k].npage * m->pagesz,
+                    .mode = 0
+                };
+
+                if (ioctl(m->uffd, UFFDIO_COPY, &copy) == 0)
+                {
+                    memset(m->state + c[k].page, PAGE_PRESENT, c[k].npage);
+                }
+
+                off += copy.len;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&m->lock);
+
+    return ret;
+}
+
+forensic1394_result platform_invalidate_map(forensic1394_dev *dev,
+                                            const void *addr, size_t len)
+{
+    platform_map *m = find_map(dev, addr, len);
+    size_t first, last;
+
+    if (!m)
+    {
+        return FORENSIC1394_RESULT_OTHER_ERROR;
+    }
+
+    first = ((const char *) addr - m->addr) / m->pagesz;
+    last = ((const char *) addr - m->addr + len + m->pagesz - 1) / m->pagesz;
+
+    pthread_mutex_lock(&m->lock);
+    zap_pages(m, first, last);
+    pthread_mutex_unlock(&m->lock);
+
+    return FORENSIC1394_RESULT_SUCCESS;
+}
+
+void platform_unmap_device(forensic1394_dev *dev, const void *addr)
+{
+    platform_map **pm = &dev->maps;
+
+    while (*pm)
+    {
+        platform_map *m = *pm;
+
+        if (!addr || (const char *) addr == m->addr + m->off)
+        {
+            *pm = m->link;
+            destroy_map(m);
+        }
+        else
+        {
+            pm = &m->link;
+        }
+    }
+}
+
+int open_uffd(void)
+{
+    int fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+
+#ifdef UFFD_USER_MODE_ONLY
+    if (fd == -1 && errno == EPERM)
+    {
+        fd = syscall(__NR_userfaultfd,
+                     O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    }
+#endif
+
+    return fd;
+}
+
+platform_map *find_map(forensic1394_dev *dev, const void *addr, size_t len)
+{
+    const char *caddr = addr;
+    platform_map *m;
+
+    for (m = dev->maps; m; m = m->link)
+    {
+        if (caddr >= m->addr && caddr < m->addr + m->len)
+        {
+            return (len <= (size_t) (m->addr + m->len - caddr)) ? m : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+void fill_clusters(platform_map *m, const map_cluster *c, int nc)
+{
+    forensic1394_result ret;
+    size_t maxreq = forensic1394_get_device_request_size(m->dev);
+    size_t nreq = 0, off = 0, roff;
+    int i, attempt;
+
+    if (!reserve_reqs(m, MAP_BATCH_MAX * ((m->pagesz + maxreq - 1) / maxreq)))
+    {
+        ret = FORENSIC1394_RESULT_OTHER_ERROR;
+        goto fallback;
+    }
+
+    // Lay the clusters out one after another in the staging buffer
+    for (i = 0; i < nc; i++)
+    {
+        uint64_t addr = m->base + c[i].page * m->pagesz;
+        size_t len = c[i].npage * m->pagesz;
+
+        for (roff = 0; roff < len; roff += maxreq, nreq++)
+        {
+            m->req[nreq].addr   = addr + roff;
+            m->req[nreq].len    = MIN(maxreq, len - roff);
+            m->req[nreq].buf    = m->stage + off + roff;
+        }
+
+        off += len;
+    }
+
+    // Try again should a bus reset interrupt the batch
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        ret = forensic1394_read_device_v_priority(m->dev, m->req, nreq,
+                                                  FORENSIC1394_PRIORITY_INTERACTIVE);
+
+        if (ret != FORENSIC1394_RESULT_BUS_RESET)
+        {
+            break;
+        }
+    }
+
+fallback:
+    // Find out which of the pages could not be read, one page at a time
+    if (ret != FORENSIC1394_RESULT_SUCCESS)
+    {
+        for (i = 0, off = 0; i < nc; i++)
+        {
+            size_t j;
+
+            for (j = 0; j < c[i].npage; j++, off += m->pagesz)
+            {
+                if (read_pages(m, c[i].page + j, 1, m->stage + off)
+                    != FORENSIC1394_RESULT_SUCCESS)
+                {
+                    memset(m->stage + off, 0, m->pagesz);
+                }
+            }
+        }
+    }
+
+    for (i = 0, off = 0; i < nc; i++)
+    {
+        struct uffdio_copy copy = {
+            .dst  = PTR_TO_U64(m->addr + c[i].page * m->pagesz),
+            .src  = PTR_TO_U64(m->stage + off),
+            .len  = c[i].npage * m->pagesz,
+            .mode = 0
+        };
+
+        // This also wakes any threads waiting on the pages
+        if (ioctl(m->uffd, UFFDIO_COPY, &copy) == 0)
+        {
+            memset(m->state + c[i].page, PAGE_PRESENT, c[i].npage);
+        }
+        else
+        {
+            memset(m->state + c[i].page, PAGE_MISSING, c[i].npage);
+        }
+
+        off += copy.len;
+    }
+}
+
+forensic1394_result read_pages(platform_map *m, size_t page, size_t npage,
+                               char *buf)
+{
+    size_t maxreq = forensic1394_get_device_request_size(m->dev);
+    size_t len = npage * m->pagesz, off, nreq = 0;
+
+    if (!reserve_reqs(m, (len + maxreq - 1) / maxreq))
+    {
+        return FORENSIC1394_RESULT_OTHER_ERROR;
+    }
+
+    for (off = 0; off < len; off += maxreq, nreq++)
+    {
+        m->req[nreq].addr   = m->base + page * m->pagesz + off;
+        m->req[nreq].len    = MIN(maxreq, len - off);
+        m->req[nreq].buf    = buf + off;
+    }
+
+    return forensic1394_read_device_v_priority(m->dev, m->req, nreq,
+                                               FORENSIC1394_PRIORITY_INTERACTIVE);
+}
+
+int reserve_reqs(platform_map *m, size_t nreq)
+{
+    if (m->nreqsz < nreq)
+    {
+        forensic1394_req *nr = realloc(m->req, nreq * sizeof(*nr));
+
+        if (!nr)
+        {
+            return 0;
+        }
+
+        m->req = nr;
+        m->nreqsz = nreq;
+    }
+
+    return 1;
+}
+
+void zap_pages(platform_map *m, size_t first, size_t last)
+{
+    if (first < last)
+    {
+        madvise(m->addr + first * m->pagesz, (last - first) * m->pagesz,
+                MADV_DONTNEED);
+
+        memset(m->state + first, PAGE_MISSING, last - first);
+    }
+}
+
+void *fault_thread(void *arg)
+{
+    platform_map *m = arg;
+
+    struct pollfd fdp[2] = {
+        { .fd = m->uffd,    .events = POLLIN },
+        { .fd = m->stop_fd, .events = POLLIN }
+    };
+
+    for (;;)
+    {
+        struct uffd_msg msg[MAP_NMSG];
+        map_cluster c[MAP_NMSG];
+        ssize_t nread;
+        int i, nc = 0;
+        size_t npage = 0;
+
+        if (poll(fdp, 2, -1) == -1 && errno != EINTR)
+        {
+            break;
+        }
+
+        if (fdp[1].revents)
+        {
+            break;
+        }
+
+        if ((nread = read(m->uffd, msg, sizeof(msg))) <= 0)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&m->lock);
+
+        for (i = 0; i < nread / (ssize_t) sizeof(*msg); i++)
+        {
+            size_t page, n, want;
+
+            if (msg[i].event != UFFD_EVENT_PAGEFAULT)
+            {
+                continue;
+            }
+
+            page = (msg[i].arg.pagefault.address - PTR_TO_U64(m->addr))
+                 / m->pagesz;
+
+            // Already read, by an earlier batch or a refresh; just wake up
+            if (m->state[page] == PAGE_PRESENT)
+            {
+                struct uffdio_range range = {
+                    .start  = PTR_TO_U64(m->addr + page * m->pagesz),
+                    .len    = m->pagesz
+                };
+
+                ioctl(m->uffd, UFFDIO_WAKE, &range);
+                continue;
+            }
+
+            // Part of this batch already
+            if (m->state[page] == PAGE_PENDING)
+            {
+                continue;
+            }
+
+            // Read ahead further while faults follow on from one another
+            if (page == m->next)
+            {
+                m->cluster = MIN(2 * m->cluster, MAP_CLUSTER_MAX);
+            }
+            else
+            {
+                m->cluster = MAP_CLUSTER_MIN;
+            }
+
+            // Flush the batch should it be too full to take the fault
+            if (npage + m->cluster > MAP_BATCH_MAX)
+            {
+                fill_clusters(m, c, nc);
+                nc = 0;
+                npage = 0;
+            }
+
+            // Cluster the fault with the missing pages which follow it
+            want = MIN(m->cluster, m->npage - page);
+
+            for (n = 0; n < want && m->state[page + n] == PAGE_MISSING; n++)
+            {
+                m->state[page + n] = PAGE_PENDING;
+            }
+
+            c[nc].page = page;
+            c[nc].npage = n;
+            nc++;
+
+            npage += n;
+            m->next = page + n;
+        }
+
+        if (nc)
+        {
+            fill_clusters(m, c, nc);
+        }
+
+        pthread_mutex_unlock(&m->lock);
+    }
+
+    return NULL;
+}
+
+void destroy_map(platform_map *m)
+{
+    // Stop the fault thread, should it have been started
+    if (m->thread_started)
+    {
+        uint64_t one = 1;
+
+        if (write(m->stop_fd, &one, sizeof(one)) == sizeof(one))
+        {
+            pthread_join(m->thread, NULL);
+        }
+    }
+
+    if (m->stop_fd != -1)
+    {
+        close(m->stop_fd);
+    }
+
+    // Closing the descriptor wakes any threads still waiting on faults
+    if (m->uffd != -1)
+    {
+        close(m->uffd);
+    }
+
+    if (m->addr != MAP_FAILED)
+    {
+        munmap(m->addr, m->len);
+    }
+
+    pthread_mutex_destroy(&m->lock);
+
+    free(m->req);
+    free(m->stage);
+    free(m->state);
+    free(m);
+}
+
+#else // FORENSIC1394_HAVE_USERFAULTFD
+
+const void *platform_map_device(forensic1394_dev *dev, uint64_t base,
+                                size_t len)
+{
+    return NULL;
+}
+
+forensic1394_result platform_refresh_map(forensic1394_dev *dev,
+                                         const void *addr, size_t len)
+{
+    return FORENSIC1394_RESULT_OTHER_ERROR;
+}
+
+forensic1394_result platform_invalidate_map(forensic1394_dev *dev,
+                                            const void *addr, size_t len)
+{
+    return FORENSIC1394_RESULT_OTHER_ERROR;
+}
+
+void platform_unmap_device(forensic1394_dev *dev, const void *addr)
+{
+}
+
+#endif // FORENSIC1394_HAVE_USERFAULTFD
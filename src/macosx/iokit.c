@@ -20,10 +20,14 @@
 #include "common.h"
 #include "csr.h"
 
+#include <unistd.h>
+
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/IOKitLib.h>
 #include <IOKit/firewire/IOFireWireLib.h>
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 /**
  * The number of read commands to allocate per device; these are used
  *  to submit asynchronous read requests.
@@ -243,7 +247,8 @@ cleanupNull:
     return fret;
 }
 
-forensic1394_result platform_update_device_list(forensic1394_bus *bus)
+forensic1394_result platform_update_device_list(forensic1394_bus *bus,
+                                                forensic1394_dev **found)
 {
     CFMutableDictionaryRef matchingDict;
 
@@ -269,8 +274,21 @@ forensic1394_result platform_update_device_list(forensic1394_bus *bus)
         UInt32 generation;
         UInt16 nodeid;
 
-        // Allocate memory for a forensic1394 device
-        forensic1394_dev *fdev = malloc(sizeof(forensic1394_dev));
+        uint32_t rom[FORENSIC1394_CSR_SZ];
+
+        forensic1394_dev *fdev;
+
+        // Copy the ROM so that unwanted devices can be skipped straight away
+        copy_device_csr(currdev, rom);
+
+        if (!common_filter_rom(bus, rom))
+        {
+            IOObjectRelease(currdev);
+            continue;
+        }
+
+        // Allocate memory for a forensic1394 device (calloc initialises to 0)
+        fdev = calloc(1, sizeof(forensic1394_dev));
 
         // And for the platform specific structure
         fdev->pdev = malloc(sizeof(platform_dev));
@@ -304,11 +322,18 @@ forensic1394_result platform_update_device_list(forensic1394_bus *bus)
         fdev->is_open = 0;
 
         // Copy the ROM
-        copy_device_csr(currdev, fdev->rom);
+        memcpy(fdev->rom, rom, sizeof(rom));
 
         // Parse the ROM to extract useful fragments
         common_parse_csr(fdev);
 
+        // Initialise the platform-independent state
+        common_init_device(fdev);
+
+        // We can have as many reads in flight as we have commands
+        fdev->max_depth = FORENSIC1394_NUM_READ_CMD;
+        fdev->cwnd      = FORENSIC1394_NUM_READ_CMD;
+
         // Get the bus generation
         (*fdev->pdev->devIntrf)->GetBusGeneration(fdev->pdev->devIntrf,
                                                   &generation);
@@ -321,10 +346,9 @@ forensic1394_result platform_update_device_list(forensic1394_bus *bus)
         fdev->generation = generation;
         fdev->node_id = nodeid;
 
-        // Add this new device to the device list
-        fdev->next = bus->dev_link;
-        bus->dev_link = fdev;
-        bus->ndev++;
+        // Add this new device to the list of those found
+        fdev->next = *found;
+        *found = fdev;
 
         // Continue; everything from here on in is damage control
         continue;
@@ -352,6 +376,60 @@ cleanupMatchingServices:
     return fret;
 }
 
+int platform_merge_device(forensic1394_dev *dev, forensic1394_dev *cand)
+{
+    // Same IO object; so the existing interface remains usable
+    if (IOObjectIsEqualTo(dev->pdev->dev, cand->pdev->dev))
+    {
+        dev->node_id    = cand->node_id;
+        dev->generation = cand->generation;
+
+        return 1;
+    }
+    // New IO object, but as the device is closed we can simply swap over
+    else if (!dev->is_open)
+    {
+        platform_dev *pdev = dev->pdev;
+
+        dev->pdev = cand->pdev;
+        cand->pdev = pdev;
+
+        dev->node_id    = cand->node_id;
+        dev->generation = cand->generation;
+
+        return 1;
+    }
+    // Open device whose IO object has gone away; needs replacing
+    else
+    {
+        return 0;
+    }
+}
+
+forensic1394_result platform_enable_hotplug(forensic1394_bus *bus)
+{
+    // Changes are not monitored; platform_poll_hotplug always reports one
+    return FORENSIC1394_RESULT_SUCCESS;
+}
+
+int platform_get_hotplug_fd(forensic1394_bus *bus)
+{
+    return -1;
+}
+
+int platform_poll_hotplug(forensic1394_bus *bus)
+{
+    return 1;
+}
+
+int platform_wait_bus_reset(forensic1394_dev *dev, int64_t timeout_us)
+{
+    // Bus resets are not visible to us here; so just sleep
+    usleep(timeout_us);
+
+    return 0;
+}
+
 void platform_device_destroy(forensic1394_dev *dev)
 {
     // Release the device interface
@@ -375,6 +453,19 @@ forensic1394_result platform_open_device(forensic1394_dev *dev)
 
     if (iret == kIOReturnSuccess)
     {
+        IOFWSpeed speed;
+
+        // Determine the speed of the path to the device
+        if ((*intrf)->GetSpeedToNode(intrf, dev->generation, &speed)
+            == kIOReturnSuccess && speed <= FORENSIC1394_SPEED_S3200)
+        {
+            dev->speed = speed;
+        }
+        else
+        {
+            dev->speed = FORENSIC1394_SPEED_UNKNOWN;
+        }
+
         // Add a custom callback mode "libforensic1394"
         (*intrf)->AddCallbackDispatcherToRunLoopForMode(intrf,
                                                         CFRunLoopGetCurrent(),
@@ -405,9 +496,17 @@ void platform_close_device(forensic1394_dev *dev)
 
 forensic1394_result platform_send_requests(forensic1394_dev *dev,
                                            request_type type,
+                                           forensic1394_priority prio,
                                            const forensic1394_req *req,
                                            size_t nreq)
 {
+    /*
+     * Devices can only be used by the thread which opened them; hence there
+     * is never more than one batch of requests to schedule and prio has no
+     * bearing on the order in which requests are made.
+     */
+    (void) prio;
+
     // Determine the maximum number of commands we can use
     int nmaxcmd = (type == REQUEST_TYPE_READ) ? FORENSIC1394_NUM_READ_CMD
                                               : FORENSIC1394_NUM_WRITE_CMD;
@@ -417,6 +516,80 @@ forensic1394_result platform_send_requests(forensic1394_dev *dev,
     return send_requests(dev, type, req, nreq, ncmd);
 }
 
+forensic1394_result platform_lock_requests(forensic1394_dev *dev,
+                                           forensic1394_priority prio,
+                                           const forensic1394_lock_req *req,
+                                           size_t nreq)
+{
+    size_t i;
+
+    IOFireWireLibDeviceRef intrf = dev->pdev->devIntrf;
+
+    // As with platform_send_requests prio has no bearing on the order
+    (void) prio;
+
+    for (i = 0; i < nreq; i++)
+    {
+        IOReturn iret;
+        UInt32 expected[2], newval[2], oldval[2];
+
+        FWAddress fwaddr = {
+            .nodeID     = 0,
+            .addressHi  = req[i].addr >> 32,
+            .addressLo  = req[i].addr & 0xffffffffULL
+        };
+
+        // Compare-swap is the only lock operation exposed by IOKit
+        if (req[i].op != FORENSIC1394_LOCK_COMPARE_SWAP)
+        {
+            return FORENSIC1394_RESULT_OTHER_ERROR;
+        }
+
+        memcpy(expected, req[i].arg, req[i].len);
+        memcpy(newval, req[i].data, req[i].len);
+
+        // Synchronous; IOKit provides no asynchronous lock command
+        iret = (*intrf)->CompareSwap64(intrf, dev->pdev->dev, &fwaddr,
+                                       expected, newval, oldval, req[i].len,
+                                       true, dev->generation);
+
+        if (iret != kIOReturnSuccess)
+        {
+            return convert_ioreturn(iret);
+        }
+
+        if (req[i].old)
+        {
+            memcpy(req[i].old, oldval, req[i].len);
+        }
+    }
+
+    return FORENSIC1394_RESULT_SUCCESS;
+}
+
+const void *platform_map_device(forensic1394_dev *dev, uint64_t base,
+                                size_t len)
+{
+    // There is no means of handling page faults in user space
+    return NULL;
+}
+
+forensic1394_result platform_refresh_map(forensic1394_dev *dev,
+                                         const void *addr, size_t len)
+{
+    return FORENSIC1394_RESULT_OTHER_ERROR;
+}
+
+forensic1394_result platform_invalidate_map(forensic1394_dev *dev,
+                                            const void *addr, size_t len)
+{
+    return FORENSIC1394_RESULT_OTHER_ERROR;
+}
+
+void platform_unmap_device(forensic1394_dev *dev, const void *addr)
+{
+}
+
 forensic1394_result convert_ioreturn(IOReturn i)
 {
     switch (i)
@@ -517,6 +690,9 @@ forensic1394_result send_requests(forensic1394_dev *dev, request_type t,
     int i = 0, j;
     int inPipeline = 0;
 
+    // Time at which the most recent request was submitted
+    int64_t lastSubmit = 0;
+
     // We need some commands in order to send the requests
     IOFireWireLibCommandRef *cmd = (t == REQUEST_TYPE_READ) ? dev->pdev->readcmd
                                                             : dev->pdev->writecmd;
@@ -532,8 +708,9 @@ forensic1394_result send_requests(forensic1394_dev *dev, request_type t,
     {
         SInt32 lret;
 
-        // Send as many requests as possible
-        for (j = 0; inPipeline < ncmd && j < ncmd && i < nreq; j++)
+        // Send as many requests as the congestion window permits
+        for (j = 0; inPipeline < MIN(ncmd, common_cc_window(dev))
+                 && j < ncmd && i < nreq; j++)
         {
             IOFireWireLibCommandRef c = cmd[j];
 
@@ -551,28 +728,55 @@ forensic1394_result send_requests(forensic1394_dev *dev, request_type t,
                 (*c)->SetBuffer(c, req[i].len, req[i].buf);
                 (*c)->Submit(c);
 
+                lastSubmit = common_get_time_us();
+
                 i++; inPipeline++;
             }
         }
 
         // Wait for a response to a request
         lret = CFRunLoopRunInMode(CFSTR("libforensic1394"),
-                                  FORENSIC1394_TIMEOUT_MS * 1.0e-3, true);
+                                  dev->rto_us * 1.0e-6, true);
 
         // So long as the loop did not timeout we're good
         if (lret != kCFRunLoopRunTimedOut)
         {
+            /*
+             * Completions are not attributed to a specific command; so only
+             * take a round-trip time sample when the completion can only be
+             * for the most recently submitted request.
+             */
+            if (inPipeline == 1)
+            {
+                common_rtt_sample(dev, common_get_time_us() - lastSubmit);
+            }
+
             inPipeline--;
 
             // Check the return code
             if (dev->pdev->cmdret != kIOReturnSuccess)
             {
+                /*
+                 * IOKit retries busy commands itself; so by the time we see
+                 * kIOReturnBusy the device is congested and the window should
+                 * be reduced for subsequent calls.
+                 */
+                if (dev->pdev->cmdret == kIOReturnBusy)
+                {
+                    common_cc_busy(dev);
+                }
+
                 ret = convert_ioreturn(dev->pdev->cmdret);
                 break;
             }
+
+            common_cc_success(dev);
         }
         else
         {
+            // Back off the timeout for subsequent requests
+            common_rtt_timeout(dev);
+
             ret = FORENSIC1394_RESULT_IO_TIMEOUT;
             break;
         }
@@ -0,0 +1,420 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Memory watches.  Rather than reading each watched range on its own the
+ *  ranges are sorted and those lying close together coalesced into spans,
+ *  each span being read into a buffer with as few requests as the maximum
+ *  request size allows.  A sample is then a single vectored read of every
+ *  span, after which each range is compared with the previous sample.
+ */
+
+#include "forensic1394.h"
+#include "common.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/// Ranges separated by no more than this many bytes are read as one
+#define WATCH_COALESCE_GAP  64
+
+typedef struct
+{
+    uint64_t addr;
+    size_t len;
+
+    /// Offset of the range into the sample buffers
+    size_t off;
+
+    /// If the range has been sampled and so has a previous value
+    int sampled;
+} watch_range;
+
+typedef struct
+{
+    uint64_t start, end;
+} watch_span;
+
+struct _forensic1394_watch
+{
+    forensic1394_dev *dev;
+    forensic1394_watch_callback onchange;
+    void *user_data;
+
+    watch_range *range;
+    int nrange, rangesz;
+
+    /// Requests reading every span into cur
+    forensic1394_req *req;
+    size_t nreq;
+
+    /// The sample being taken and the previous one
+    char *cur, *prev;
+    size_t buflen;
+
+    /// Set when ranges have been added and the plan must be rebuilt
+    int dirty;
+
+    int stop;
+};
+
+/**
+ * Coalesces the ranges of \a watch into spans and lays them out in freshly
+ *  allocated sample buffers, carrying the previous contents of ranges which
+ *  have already been sampled over.
+ *
+ *   \param watch The watch.
+ *  \return A result status code.
+ */
+static forensic1394_result build_plan(forensic1394_watch *watch);
+
+static int cmp_range_addr(const void *a, const void *b);
+
+forensic1394_watch *forensic1394_watch_alloc(forensic1394_dev *dev,
+                                             forensic1394_watch_callback onchange)
+{
+    forensic1394_watch *watch;
+
+    assert(dev);
+    assert(onchange);
+
+    watch = calloc(1, sizeof(*watch));
+
+    if (watch)
+    {
+        watch->dev = dev;
+        watch->onchange = onchange;
+    }
+
+    return watch;
+}
+
+int forensic1394_watch_add(forensic1394_watch *watch, uint64_t addr,
+                           size_t len)
+{
+    watch_range *r;
+
+    assert(watch);
+    assert(len > 0);
+
+    // Grow the range array as required
+    if (watch->nrange == watch->rangesz)
+    {
+        int nsz = watch->rangesz ? 2 * watch->rangesz : 16;
+
+        r = realloc(watch->range, nsz * sizeof(*r));
+
+        if (!r)
+        {
+            return FORENSIC1394_RESULT_OTHER_ERROR;
+        }
+
+        watch->range = r;
+        watch->rangesz = nsz;
+    }
+
+    r = &watch->range[watch->nrange];
+    r->addr = addr;
+    r->len = len;
+    r->off = 0;
+    r->sampled = 0;
+
+    watch->dirty = 1;
+
+    return watch->nrange++;
+}
+
+forensic1394_result forensic1394_watch_poll(forensic1394_watch *watch)
+{
+    forensic1394_result ret;
+    int i, nrange;
+
+    assert(watch);
+    assert(watch->dev->is_open);
+
+    if (watch->dirty && (ret = build_plan(watch)) != FORENSIC1394_RESULT_SUCCESS)
+    {
+        return ret;
+    }
+
+    if (watch->nreq == 0)
+    {
+        return FORENSIC1394_RESULT_SUCCESS;
+    }
+
+    ret = forensic1394_read_device_v_priority(watch->dev, watch->req,
+                                              watch->nreq,
+                                              FORENSIC1394_PRIORITY_INTERACTIVE);
+
+    if (ret != FORENSIC1394_RESULT_SUCCESS)
+    {
+        return ret;
+    }
+
+    // Ranges added by the callback are not part of this sample
+    nrange = watch->nrange;
+
+    for (i = 0; i < nrange; i++)
+    {
+        const watch_range *r = &watch->range[i];
+
+        if (r->sampled
+         && memcmp(watch->prev + r->off, watch->cur + r->off, r->len) != 0)
+        {
+            watch->onchange(watch, i, watch->prev + r->off,
+                            watch->cur + r->off);
+        }
+    }
+
+    // The current sample becomes the baseline for the next one
+    memcpy(watch->prev, watch->cur, watch->buflen);
+
+    for (i = 0; i < nrange; i++)
+    {
+        watch->range[i].sampled = 1;
+    }
+
+    return FORENSIC1394_RESULT_SUCCESS;
+}
+
+forensic1394_result forensic1394_watch_run(forensic1394_watch *watch,
+                                           int rate, int nsample)
+{
+    forensic1394_result ret = FORENSIC1394_RESULT_SUCCESS;
+    int64_t period = (rate > 0) ? 1000000 / rate : 0;
+    int64_t next = common_get_time_us(), now;
+    int i;
+
+    assert(watch);
+    assert(rate >= 0);
+    assert(nsample >= 0);
+
+    __atomic_store_n(&watch->stop, 0, __ATOMIC_RELAXED);
+
+    for (i = 0; nsample == 0 || i < nsample; i++)
+    {
+        if (__atomic_load_n(&watch->stop, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+
+        ret = forensic1394_watch_poll(watch);
+
+        if (ret != FORENSIC1394_RESULT_SUCCESS)
+        {
+            break;
+        }
+
+        if (period == 0)
+        {
+            continue;
+        }
+
+        next += period;
+        now = common_get_time_us();
+
+        // Running behind; skip the missed samples rather than catch up
+        if (next <= now)
+        {
+            next = now;
+        }
+        else
+        {
+            struct timespec ts;
+
+            ts.tv_sec = (next - now) / 1000000;
+            ts.tv_nsec = (next - now) % 1000000 * 1000;
+
+            // Being woken early by a signal is fine; it may be a stop request
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    return ret;
+}
+
+void forensic1394_watch_stop(forensic1394_watch *watch)
+{
+    assert(watch);
+
+    __atomic_store_n(&watch->stop, 1, __ATOMIC_RELEASE);
+}
+
+const void *forensic1394_watch_get_data(forensic1394_watch *watch, int i)
+{
+    assert(watch);
+    assert(i >= 0 && i < watch->nrange);
+
+    return watch->range[i].sampled ? watch->prev + watch->range[i].off : NULL;
+}
+
+void *forensic1394_get_watch_user_data(forensic1394_watch *watch)
+{
+    assert(watch);
+
+    return watch->user_data;
+}
+
+void forensic1394_set_watch_user_data(forensic1394_watch *watch, void *u)
+{
+    assert(watch);
+
+    watch->user_data = u;
+}
+
+void forensic1394_watch_destroy(forensic1394_watch *watch)
+{
+    assert(watch);
+
+    free(watch->req);
+    free(watch->cur);
+    free(watch->prev);
+    free(watch->range);
+    free(watch);
+}
+
+forensic1394_result build_plan(forensic1394_watch *watch)
+{
+    size_t maxreq = forensic1394_get_device_request_size(watch->dev);
+    size_t buflen = 0, nreq = 0, off, j;
+    watch_range **sorted;
+    watch_span *span;
+    forensic1394_req *req;
+    char *cur, *prev;
+    int i, nspan = 0;
+
+    sorted = malloc(watch->nrange * sizeof(*sorted));
+    span = malloc(watch->nrange * sizeof(*span));
+
+    if (!sorted || !span)
+    {
+        free(sorted);
+        free(span);
+        return FORENSIC1394_RESULT_OTHER_ERROR;
+    }
+
+    for (i = 0; i < watch->nrange; i++)
+    {
+        sorted[i] = &watch->range[i];
+    }
+
+    qsort(sorted, watch->nrange, sizeof(*sorted), cmp_range_addr);
+
+    // Coalesce nearby ranges into quadlet aligned spans
+    for (i = 0; i < watch->nrange; i++)
+    {
+        uint64_t start = sorted[i]->addr & ~UINT64_C(3);
+        uint64_t end = (sorted[i]->addr + sorted[i]->len + 3) & ~UINT64_C(3);
+
+        if (nspan && start <= span[nspan - 1].end + WATCH_COALESCE_GAP)
+        {
+            if (end > span[nspan - 1].end)
+            {
+                span[nspan - 1].end = end;
+            }
+        }
+        else
+        {
+            span[nspan].start = start;
+            span[nspan].end = end;
+            nspan++;
+        }
+    }
+
+    for (i = 0; i < nspan; i++)
+    {
+        uint64_t len = span[i].end - span[i].start;
+
+        buflen += len;
+        nreq += (len + maxreq - 1) / maxreq;
+    }
+
+    cur = malloc(buflen ? buflen : 1);
+    prev = calloc(buflen ? buflen : 1, 1);
+    req = malloc((nreq ? nreq : 1) * sizeof(*req));
+
+    if (!cur || !prev || !req)
+    {
+        free(cur);
+        free(prev);
+        free(req);
+        free(sorted);
+        free(span);
+        return FORENSIC1394_RESULT_OTHER_ERROR;
+    }
+
+    // Lay the spans out one after another, splitting each into requests
+    for (i = 0, j = 0, off = 0, nreq = 0; i < nspan; i++)
+    {
+        uint64_t addr;
+
+        for (addr = span[i].start; addr < span[i].end; addr += maxreq)
+        {
+            req[nreq].addr = addr;
+            req[nreq].len = MIN(maxreq, span[i].end - addr);
+            req[nreq].buf = cur + off + (addr - span[i].start);
+            nreq++;
+        }
+
+        // Place the ranges within the span, keeping any previous contents
+        for (; j < (size_t) watch->nrange && sorted[j]->addr < span[i].end; j++)
+        {
+            size_t roff = off + (sorted[j]->addr - span[i].start);
+
+            if (sorted[j]->sampled)
+            {
+                memcpy(prev + roff, watch->prev + sorted[j]->off,
+                       sorted[j]->len);
+            }
+
+            sorted[j]->off = roff;
+        }
+
+        off += span[i].end - span[i].start;
+    }
+
+    free(watch->cur);
+    free(watch->prev);
+    free(watch->req);
+
+    watch->cur = cur;
+    watch->prev = prev;
+    watch->buflen = buflen;
+    watch->req = req;
+    watch->nreq = nreq;
+    watch->dirty = 0;
+
+    free(sorted);
+    free(span);
+
+    return FORENSIC1394_RESULT_SUCCESS;
+}
+
+int cmp_range_addr(const void *a, const void *b)
+{
+    const watch_range *ra = *(const watch_range * const *) a;
+    const watch_range *rb = *(const watch_range * const *) b;
+
+    return (ra->addr > rb->addr) - (ra->addr < rb->addr);
+}
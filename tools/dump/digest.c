@@ -0,0 +1,473 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Hashing stages of the acquisition pipeline.  The SHA-256 and MD5 digests of
+ *  the whole image must be computed in address order and so each runs as its
+ *  own stage.  Segment hashes are independent of one another and are spread
+ *  over a number of workers, with worker i hashing segments i, i + n, ...
+ *
+ * Once complete the hashes are written to a manifest:
+ *
+ *   # forensic1394-dump hash manifest 1
+ *   guid <guid>
+ *   start <addr>
+ *   size <bytes>
+ *   sha256 <digest>
+ *   md5 <digest>
+ *   segment-size <bytes>
+ *   merkle-root <digest>
+ *   segment <addr> <digest>
+ *   ...
+ *
+ *  Every segment of the acquired range has a line, including those which were
+ *  unreadable and so zero-filled; their leaf is the hash of the zeros.  The
+ *  Merkle root over the segment hashes allows any sub-range of the image to
+ *  be verified against a single digest.
+ */
+
+#include "dump.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Size of the buffer used when reading back parts of the image
+#define DIGEST_READ_SZ  (1 << 20)
+
+typedef struct
+{
+    dump_digest *d;
+
+    /// Next segment this worker is responsible for and the bytes hashed of it
+    uint64_t cur, pos;
+    sha256_ctx ctx;
+} seg_worker;
+
+struct _dump_digest
+{
+    uint64_t start, size, segsz;
+
+    /// The image, for reading back parts not passing through the pipeline
+    int fd;
+
+    sha256_ctx sha;
+    uint64_t sha_pos;
+    uint8_t sha_digest[SHA256_DIGEST_SZ];
+
+    md5_ctx md5;
+    uint64_t md5_pos;
+    uint8_t md5_digest[MD5_DIGEST_SZ];
+
+    uint64_t nseg;
+    uint8_t (*seg)[SHA256_DIGEST_SZ];
+
+    int nworker;
+    seg_worker *worker;
+};
+
+static void update_sha256(void *ctx, const void *data, size_t len);
+static void update_md5(void *ctx, const void *data, size_t len);
+
+/**
+ * Passes bytes [\a from, \a to) of the image, relative to the start, to
+ *  \a update by reading them back from the image file.  Bytes beyond the end
+ *  of the file are taken to be zero.
+ */
+static int hash_image(dump_digest *d,
+                      void (*update)(void *, const void *, size_t), void *ctx,
+                      uint64_t from, uint64_t to);
+
+static int process_sha256(void *ctx, const chunk *c);
+static int finish_sha256(void *ctx, int complete);
+static int process_md5(void *ctx, const chunk *c);
+static int finish_md5(void *ctx, int complete);
+static int process_segment(void *ctx, const chunk *c);
+static int finish_segments(void *ctx, int complete);
+
+/**
+ * Completes the current segment of \a w, reading back any of it which was
+ *  not passed through the pipeline, and moves on to the next one.
+ */
+static int next_segment(seg_worker *w);
+
+static uint64_t segment_len(const dump_digest *d, uint64_t seg);
+
+dump_digest *digest_alloc(uint64_t start, uint64_t size, uint64_t segsz,
+                          int nworker, const char *path)
+{
+    dump_digest *d = calloc(1, sizeof(*d));
+    int i;
+
+    if (!d)
+    {
+        return NULL;
+    }
+
+    d->start = start;
+    d->size = size;
+    d->segsz = segsz;
+    d->nseg = (size + segsz - 1) / segsz;
+    d->nworker = nworker;
+
+    sha256_init(&d->sha);
+    md5_init(&d->md5);
+
+    d->seg = calloc(d->nseg ? d->nseg : 1, sizeof(*d->seg));
+    d->worker = calloc(nworker, sizeof(*d->worker));
+
+    // Streams can not be read back, but then nothing will need to be
+    d->fd = path ? open(path, O_RDONLY) : -1;
+
+    if (!d->seg || !d->worker)
+    {
+        digest_free(d);
+        return NULL;
+    }
+
+    for (i = 0; i < nworker; i++)
+    {
+        d->worker[i].d = d;
+        d->worker[i].cur = i;
+        sha256_init(&d->worker[i].ctx);
+    }
+
+    return d;
+}
+
+int digest_nstages(const dump_digest *d)
+{
+    return 2 + d->nworker;
+}
+
+void digest_get_stage(dump_digest *d, int i, stage *s)
+{
+    if (i == 0)
+    {
+        s->process = process_sha256;
+        s->finish = finish_sha256;
+        s->ctx = d;
+    }
+    else if (i == 1)
+    {
+        s->process = process_md5;
+        s->finish = finish_md5;
+        s->ctx = d;
+    }
+    else
+    {
+        s->process = process_segment;
+        s->finish = finish_segments;
+        s->ctx = &d->worker[i - 2];
+    }
+}
+
+int digest_write_manifest(const dump_digest *d, const char *path,
+                          int64_t guid)
+{
+    FILE *f = fopen(path, "w");
+    char hex[2*SHA256_DIGEST_SZ + 1];
+    uint8_t root[SHA256_DIGEST_SZ];
+    uint64_t i;
+
+    if (!f)
+    {
+        return -1;
+    }
+
+    fprintf(f, "# forensic1394-dump hash manifest 1\n");
+    fprintf(f, "guid %016" PRIx64 "\n", (uint64_t) guid);
+    fprintf(f, "start %" PRIx64 "\n", d->start);
+    fprintf(f, "size %" PRIx64 "\n", d->size);
+
+    hash_hex(d->sha_digest, SHA256_DIGEST_SZ, hex);
+    fprintf(f, "sha256 %s\n", hex);
+
+    hash_hex(d->md5_digest, MD5_DIGEST_SZ, hex);
+    fprintf(f, "md5 %s\n", hex);
+
+    fprintf(f, "segment-size %" PRIx64 "\n", d->segsz);
+
+    merkle_root((const uint8_t (*)[SHA256_DIGEST_SZ]) d->seg, d->nseg, root);
+    hash_hex(root, SHA256_DIGEST_SZ, hex);
+    fprintf(f, "merkle-root %s\n", hex);
+
+    for (i = 0; i < d->nseg; i++)
+    {
+        hash_hex(d->seg[i], SHA256_DIGEST_SZ, hex);
+        fprintf(f, "segment %" PRIx64 " %s\n", d->start + i*d->segsz, hex);
+    }
+
+    // Make sure that the manifest is actually on disk
+    if (fflush(f) == EOF || fsync(fileno(f)) == -1)
+    {
+        int serrno = errno;
+        fclose(f);
+        errno = serrno;
+        return -1;
+    }
+
+    return (fclose(f) == EOF) ? -1 : 0;
+}
+
+void digest_print(const dump_digest *d, FILE *f)
+{
+    char hex[2*SHA256_DIGEST_SZ + 1];
+    uint8_t root[SHA256_DIGEST_SZ];
+
+    hash_hex(d->sha_digest, SHA256_DIGEST_SZ, hex);
+    fprintf(f, "SHA-256: %s\n", hex);
+
+    hash_hex(d->md5_digest, MD5_DIGEST_SZ, hex);
+    fprintf(f, "MD5:     %s\n", hex);
+
+    merkle_root((const uint8_t (*)[SHA256_DIGEST_SZ]) d->seg, d->nseg, root);
+    hash_hex(root, SHA256_DIGEST_SZ, hex);
+    fprintf(f, "Merkle:  %s\n", hex);
+}
+
+void digest_free(dump_digest *d)
+{
+    if (d->fd != -1)
+    {
+        close(d->fd);
+    }
+
+    free(d->worker);
+    free(d->seg);
+    free(d);
+}
+
+void update_sha256(void *ctx, const void *data, size_t len)
+{
+    sha256_update(ctx, data, len);
+}
+
+void update_md5(void *ctx, const void *data, size_t len)
+{
+    md5_update(ctx, data, len);
+}
+
+int hash_image(dump_digest *d, void (*update)(void *, const void *, size_t),
+               void *ctx, uint64_t from, uint64_t to)
+{
+    char *buf;
+
+    if (from >= to)
+    {
+        return 0;
+    }
+
+    if (!(buf = malloc(DIGEST_READ_SZ)))
+    {
+        return -1;
+    }
+
+    while (from < to)
+    {
+        size_t n = (to - from < DIGEST_READ_SZ) ? to - from : DIGEST_READ_SZ;
+        ssize_t got = (d->fd != -1) ? pread(d->fd, buf, n, from) : -1;
+
+        if (got == -1 && d->fd != -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            free(buf);
+            return -1;
+        }
+
+        // Whatever lies beyond the end of the file is a hole
+        if (got < (ssize_t) n)
+        {
+            memset(buf + (got > 0 ? got : 0), 0, n - (got > 0 ? got : 0));
+        }
+
+        update(ctx, buf, n);
+        from += n;
+    }
+
+    free(buf);
+    return 0;
+}
+
+int process_sha256(void *ctx, const chunk *c)
+{
+    dump_digest *d = ctx;
+    uint64_t off = c->addr - d->start;
+
+    if (hash_image(d, update_sha256, &d->sha, d->sha_pos, off) == -1)
+    {
+        return -1;
+    }
+
+    sha256_update(&d->sha, c->buf, c->len);
+    d->sha_pos = off + c->len;
+
+    return 0;
+}
+
+int finish_sha256(void *ctx, int complete)
+{
+    dump_digest *d = ctx;
+
+    // The digest of an incomplete image is of no use to anyone
+    if (!complete)
+    {
+        return 0;
+    }
+
+    if (hash_image(d, update_sha256, &d->sha, d->sha_pos, d->size) == -1)
+    {
+        return -1;
+    }
+
+    sha256_final(&d->sha, d->sha_digest);
+    return 0;
+}
+
+int process_md5(void *ctx, const chunk *c)
+{
+    dump_digest *d = ctx;
+    uint64_t off = c->addr - d->start;
+
+    if (hash_image(d, update_md5, &d->md5, d->md5_pos, off) == -1)
+    {
+        return -1;
+    }
+
+    md5_update(&d->md5, c->buf, c->len);
+    d->md5_pos = off + c->len;
+
+    return 0;
+}
+
+int finish_md5(void *ctx, int complete)
+{
+    dump_digest *d = ctx;
+
+    if (!complete)
+    {
+        return 0;
+    }
+
+    if (hash_image(d, update_md5, &d->md5, d->md5_pos, d->size) == -1)
+    {
+        return -1;
+    }
+
+    md5_final(&d->md5, d->md5_digest);
+    return 0;
+}
+
+int process_segment(void *ctx, const chunk *c)
+{
+    seg_worker *w = ctx;
+    dump_digest *d = w->d;
+    uint64_t off = c->addr - d->start, end = off + c->len;
+
+    // Go through each segment overlapping the chunk
+    while (off < end)
+    {
+        uint64_t seg = off / d->segsz;
+        uint64_t segoff = seg*d->segsz;
+        uint64_t pend = (segoff + d->segsz < end) ? segoff + d->segsz : end;
+
+        // See if the segment is ours
+        if (seg % d->nworker == w->cur % d->nworker)
+        {
+            // Complete any of our segments which lie before this one
+            while (w->cur < seg)
+            {
+                if (next_segment(w) == -1)
+                {
+                    return -1;
+                }
+            }
+
+            // Hash any gap between where we got to and the chunk
+            if (hash_image(d, update_sha256, &w->ctx, segoff + w->pos, off)
+                == -1)
+            {
+                return -1;
+            }
+
+            sha256_update(&w->ctx, c->buf + (off - (c->addr - d->start)),
+                          pend - off);
+            w->pos = pend - segoff;
+
+            if (w->pos == segment_len(d, seg) && next_segment(w) == -1)
+            {
+                return -1;
+            }
+        }
+
+        off = pend;
+    }
+
+    return 0;
+}
+
+int finish_segments(void *ctx, int complete)
+{
+    seg_worker *w = ctx;
+
+    while (complete && w->cur < w->d->nseg)
+    {
+        if (next_segment(w) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int next_segment(seg_worker *w)
+{
+    dump_digest *d = w->d;
+    uint64_t segoff = w->cur*d->segsz;
+
+    if (hash_image(d, update_sha256, &w->ctx, segoff + w->pos,
+                   segoff + segment_len(d, w->cur)) == -1)
+    {
+        return -1;
+    }
+
+    sha256_final(&w->ctx, d->seg[w->cur]);
+    sha256_init(&w->ctx);
+
+    w->cur += d->nworker;
+    w->pos = 0;
+
+    return 0;
+}
+
+uint64_t segment_len(const dump_digest *d, uint64_t seg)
+{
+    uint64_t off = seg*d->segsz;
+
+    return (d->size - off < d->segsz) ? d->size - off : d->segsz;
+}
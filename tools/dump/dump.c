@@ -0,0 +1,1722 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * forensic1394-dump: acquires the memory of a FireWire device to a file.
+ *
+ * This tool is built solely on the public API of libforensic1394 and serves
+ *  as the reference high-throughput acquisition path.  The device is read in
+ *  large chunks, each a single vectored request, by the main thread.  Each
+ *  completed chunk is then passed down a pipeline of stages running on their
+ *  own threads: one writing it to the output and the others hashing it.
+ */
+
+#include "forensic1394.h"
+#include "dump.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Default number of bytes read per vectored request
+#define DUMP_DEFAULT_CHUNK      (1 << 20)
+
+/// Default amount of memory to acquire; the limit of most physical DMA filters
+#define DUMP_DEFAULT_SIZE       (UINT64_C(4) << 30)
+
+/// Number of times a failed chunk is retried before reading it piecemeal
+#define DUMP_RETRIES            3
+
+/// How long to wait for a device to become ready after a bus reset
+#define DUMP_READY_TIMEOUT_MS   5000
+
+/// Interval between progress updates
+#define DUMP_PROGRESS_NS        500000000LL
+
+/// Maximum number of chunks written between journal commits
+#define DUMP_JOURNAL_BATCH      64
+
+/// Maximum interval between journal commits
+#define DUMP_JOURNAL_NS         2000000000LL
+
+/// Suffix appended to the output path to give the default journal path
+#define DUMP_JOURNAL_SUFFIX     ".journal"
+
+/// Suffix appended to the output path to give the hash manifest path
+#define DUMP_MANIFEST_SUFFIX    ".hashes"
+
+/// Default size of the segments hashed individually in the manifest
+#define DUMP_DEFAULT_SEGMENT    (1 << 20)
+
+/// Suffix appended to the output path to give the page times path
+#define DUMP_TIMES_SUFFIX       ".pages"
+
+/// Granularity at which changes are tracked when reducing smear
+#define DUMP_PAGE_SIZE          4096
+
+/// Maximum number of threads hashing segments
+#define DUMP_MAX_HASH_WORKERS   16
+
+typedef struct
+{
+    int list;
+    int device;
+    int device_set;
+    int64_t guid;
+    int sbp2;
+    int quiet;
+    int resume;
+    int depth;
+    int nohash;
+
+    /// Verify the image, or with live the device, against the manifest
+    int verify;
+    int live;
+
+    /// If the range to acquire or verify was given explicitly
+    int range_set;
+
+    /// Time budget for reducing smear; zero if smear is not to be reduced
+    int64_t smear_ns;
+
+    uint64_t start;
+    uint64_t size;
+    size_t chunk;
+    uint64_t segsz;
+
+    output_format format;
+    const char *path;
+
+    /// Path of the journal; NULL if the output can not be resumed
+    char *journal;
+
+    /// Path of the hash manifest; NULL if one is not to be written
+    char *manifest;
+
+    /// Path of the page times written when reducing smear
+    char *times;
+} dump_opts;
+
+/**
+ * State of the pipeline stage writing chunks to the output.
+ */
+typedef struct
+{
+    dump_output *out;
+    dump_journal *journal;
+    uint64_t start;
+
+    /// When the journal was last committed
+    struct timespec last;
+} dump_writer;
+
+typedef struct
+{
+    struct timespec begin, last;
+    uint64_t total, base;
+    int enabled;
+} progress;
+
+/// Set when the user asks for the acquisition to stop
+static volatile sig_atomic_t interrupted;
+
+/**
+ * Parses a size, optionally suffixed with k, m or g (binary multiples).
+ *
+ *  \return 0 on success, -1 if \a s is not a valid size.
+ */
+static int parse_size(const char *s, uint64_t *size);
+
+static void usage(const char *argv0);
+
+static int parse_opts(int argc, char **argv, dump_opts *opts);
+
+/**
+ * Prints the devices attached to \a bus.
+ */
+static void list_devices(forensic1394_dev **dev, int ndev);
+
+/**
+ * Finds the device requested in \a opts, enumerating the bus.
+ */
+static forensic1394_dev *select_device(forensic1394_bus *bus,
+                                       const dump_opts *opts);
+
+/**
+ * Returns the parts of [\a start, \a start + \a size) which are not covered
+ *  by the sorted extents \a have.
+ *
+ *   \param[out] nmissing The number of missing extents.
+ *  \return The missing extents, to be freed by the caller, or NULL if memory
+ *          could not be allocated.
+ */
+static extent *find_missing(uint64_t start, uint64_t size, const extent *have,
+                            size_t nhave, size_t *nmissing);
+
+/**
+ * Acquires each of the \a nmissing extents in \a missing from \a dev,
+ *  writing them to \a out and recording them in \a journal, if any.  Both
+ *  \a out and \a journal are closed.  Should \a digest be non-NULL the image
+ *  is hashed as it is acquired.
+ *
+ *  \return The exit status of the program.
+ */
+static int acquire(forensic1394_dev *dev, const dump_opts *opts,
+                   dump_output *out, dump_journal *journal,
+                   dump_digest *digest, const extent *missing,
+                   size_t nmissing);
+
+/**
+ * Returns the number of threads to hash segments of the image with, using
+ *  one in \a share of the available processors.
+ */
+static int hash_workers(int share);
+
+/**
+ * Checks the segments of the manifest \a m within the range of \a opts,
+ *  reading them from the image or, should \a dev be non-NULL, the device.
+ *  Segments of the device which no longer match show where its memory has
+ *  changed since the acquisition.
+ *
+ *  \return The exit status of the program.
+ */
+static int verify(const dump_opts *opts, const dump_manifest *m,
+                  forensic1394_dev *dev);
+
+/**
+ * Reads \a len bytes at offset \a off of the image \a fd into \a buf.
+ *  Bytes beyond the end of the image are taken to be zero.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+static int read_image(int fd, char *buf, size_t len, uint64_t off);
+
+static void on_signal(int sig);
+
+/**
+ * Reads \a c from \a dev, retrying on transient errors.  Should the chunk as
+ *  a whole continue to fail each request is read individually, with those
+ *  which fail being zero-filled.
+ *
+ *   \param[out] nbad Incremented by the number of bytes which were unreadable.
+ *  \return A result code; errors other than those from unreadable memory are
+ *          fatal.
+ */
+static forensic1394_result read_chunk(forensic1394_dev *dev,
+                                      forensic1394_req *req, chunk *c,
+                                      uint64_t *nbad);
+
+/**
+ * Reads \a c from \a dev as a single vectored request, retrying on transient
+ *  errors.
+ *
+ *   \param[out] nreq The number of requests \a c was split into.
+ *  \return A result code.
+ */
+static forensic1394_result read_chunk_v(forensic1394_dev *dev,
+                                        forensic1394_req *req, chunk *c,
+                                        size_t *nreq);
+
+/**
+ * Returns non-zero if \a ret indicates that memory could not be read but
+ *  that the device itself remains usable.
+ */
+static int is_unreadable(forensic1394_result ret);
+
+/**
+ * Re-reads the pages of the image tracked by \a sm, rewriting those which
+ *  have changed, and then repeatedly re-reads those pages until the number
+ *  changing stops falling or the time budget of \a opts runs out.
+ *
+ *  \return 0 on success or -1 on error.
+ */
+static int reduce_smear(forensic1394_dev *dev, const dump_opts *opts,
+                        dump_output *out, dump_smear *sm,
+                        const struct timespec *begin);
+
+/**
+ * Completes the hashes of \a digest by reading back the entire image.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+static int hash_file(dump_digest *digest);
+
+/**
+ * Writes a chunk to the output, periodically committing the journal.
+ */
+static int write_chunk(void *ctx, const chunk *c);
+
+/**
+ * Flushes the image and then commits the journal of the writer \a ctx, if
+ *  any.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+static int commit(void *ctx, int complete);
+
+static int64_t elapsed_ns(const struct timespec *a, const struct timespec *b);
+
+static void progress_update(progress *p, uint64_t done, int final);
+
+int main(int argc, char **argv)
+{
+    dump_opts opts;
+    forensic1394_bus *bus;
+    forensic1394_dev *dev;
+    forensic1394_result ret;
+    dump_output *out;
+    dump_journal *journal = NULL;
+    dump_digest *digest = NULL;
+    dump_manifest *manifest = NULL;
+    journal_info info;
+    extent *have = NULL, *missing;
+    size_t nhave = 0, nmissing;
+    uint64_t existing = 0;
+    int loaded = 0, status;
+
+    if (parse_opts(argc, argv, &opts) == -1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (opts.verify)
+    {
+        if (!opts.manifest || !(manifest = manifest_load(opts.manifest)))
+        {
+            fprintf(stderr, "Unable to load hash manifest %s: %s\n",
+                    opts.manifest ? opts.manifest : "-", opts.manifest
+                    ? strerror(errno) : "no manifest given");
+            return EXIT_FAILURE;
+        }
+
+        // Verifying an image requires nothing of the bus
+        if (!opts.live)
+        {
+            status = verify(&opts, manifest, NULL);
+            manifest_free(manifest);
+            return status;
+        }
+
+        // Unless told otherwise check the device the image was taken from
+        if (!opts.guid && !opts.device_set)
+        {
+            opts.guid = manifest->guid;
+        }
+    }
+
+    // See what an earlier run managed to acquire
+    if (opts.resume && opts.journal)
+    {
+        if (journal_load(opts.journal, &info, &have, &nhave) == 0)
+        {
+            loaded = 1;
+
+            // Unless told otherwise go after the device we were dumping
+            if (!opts.guid && !opts.device_set)
+            {
+                opts.guid = info.guid;
+            }
+
+            // Offsets into the image are relative to the journalled range
+            if (!opts.range_set)
+            {
+                opts.start = info.start;
+                opts.size = info.size;
+            }
+            else if (opts.start != info.start || opts.size != info.size)
+            {
+                fprintf(stderr, "Journal is for 0x%" PRIx64 " bytes at 0x%"
+                        PRIx64 " not 0x%" PRIx64 " bytes at 0x%" PRIx64 "\n",
+                        info.size, info.start, opts.size, opts.start);
+                free(have);
+
+                if (manifest)
+                {
+                    manifest_free(manifest);
+                }
+
+                return EXIT_FAILURE;
+            }
+        }
+        else if (errno != ENOENT)
+        {
+            fprintf(stderr, "Unable to load journal %s: %s\n", opts.journal,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!(bus = forensic1394_alloc()))
+    {
+        fprintf(stderr, "Unable to allocate a bus\n");
+        return EXIT_FAILURE;
+    }
+
+    if (opts.sbp2)
+    {
+        ret = forensic1394_enable_sbp2(bus);
+
+        if (ret != FORENSIC1394_RESULT_SUCCESS)
+        {
+            fprintf(stderr, "Unable to enable SBP-2: %s\n",
+                    forensic1394_get_result_str(ret));
+            goto err;
+        }
+    }
+
+    if (!(dev = select_device(bus, &opts)))
+    {
+        forensic1394_destroy(bus);
+        free(have);
+
+        if (manifest)
+        {
+            manifest_free(manifest);
+        }
+
+        return opts.list ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Refuse to mix the memory of two different targets in one image
+    if (loaded && forensic1394_get_device_guid(dev) != info.guid)
+    {
+        fprintf(stderr, "Journal is for device %016" PRIx64 " not %016"
+                PRIx64 "\n", info.guid, forensic1394_get_device_guid(dev));
+        goto err;
+    }
+
+    if ((ret = forensic1394_open_device(dev)) != FORENSIC1394_RESULT_SUCCESS)
+    {
+        fprintf(stderr, "Unable to open device: %s\n",
+                forensic1394_get_result_str(ret));
+        goto err;
+    }
+
+    if (opts.depth)
+    {
+        forensic1394_set_device_pipeline_depth(dev, opts.depth);
+    }
+
+    // After enabling SBP-2 targets take a moment to permit DMA
+    if (opts.sbp2)
+    {
+        ret = forensic1394_wait_device_ready(dev, DUMP_READY_TIMEOUT_MS);
+
+        if (ret != FORENSIC1394_RESULT_SUCCESS)
+        {
+            fprintf(stderr, "Device did not become ready: %s\n",
+                    forensic1394_get_result_str(ret));
+            goto err;
+        }
+    }
+
+    if (manifest)
+    {
+        status = verify(&opts, manifest, dev);
+
+        manifest_free(manifest);
+        forensic1394_destroy(bus);
+
+        return status;
+    }
+
+    // Open the output, determining how much of it already exists
+    if (!(out = output_open(opts.path, opts.format, opts.resume, &existing)))
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", opts.path, strerror(errno));
+        goto err;
+    }
+
+    /*
+     * Without a journal fall back to trusting all but the last chunk of the
+     * existing image; this is only safe if the image was written in order.
+     */
+    if (opts.resume && !loaded && existing)
+    {
+        existing -= existing % opts.chunk;
+
+        if ((have = malloc(sizeof(*have))))
+        {
+            have->addr = opts.start;
+            have->len = (existing < opts.size) ? existing : opts.size;
+            nhave = 1;
+        }
+    }
+
+    if (opts.journal)
+    {
+        info.guid = forensic1394_get_device_guid(dev);
+        info.start = opts.start;
+        info.size = opts.size;
+
+        if (!(journal = journal_open(opts.journal, &info, loaded)))
+        {
+            fprintf(stderr, "Unable to open journal %s: %s\n", opts.journal,
+                    strerror(errno));
+            output_close(out, 0);
+            goto err;
+        }
+    }
+
+    // Carry forward what the image was found to contain
+    if (journal && !loaded && nhave)
+    {
+        journal_add(journal, have->addr, have->len);
+    }
+
+    // Determine what remains to be acquired
+    missing = find_missing(opts.start, opts.size, have, nhave, &nmissing);
+
+    /*
+     * Parts of the image acquired by an earlier run are hashed by reading
+     * them back; only images with a journal can have such parts.
+     */
+    // Leave half of the processors for the reader and whole-image hashes
+    if (!opts.nohash)
+    {
+        digest = digest_alloc(opts.start, opts.size, opts.segsz,
+                              hash_workers(2), opts.journal ? opts.path : NULL);
+
+        if (!digest)
+        {
+            fprintf(stderr, "Unable to set up hashing: %s\n", strerror(errno));
+            output_close(out, 0);
+
+            if (journal)
+            {
+                journal_close(journal);
+            }
+
+            free(missing);
+            goto err;
+        }
+    }
+
+    status = acquire(dev, &opts, out, journal, digest, missing, nmissing);
+
+    if (digest)
+    {
+        digest_free(digest);
+    }
+
+    free(missing);
+    free(have);
+
+    forensic1394_destroy(bus);
+
+    return status;
+
+err:
+    free(have);
+
+    if (manifest)
+    {
+        manifest_free(manifest);
+    }
+
+    forensic1394_destroy(bus);
+    return EXIT_FAILURE;
+}
+
+extent *find_missing(uint64_t start, uint64_t size, const extent *have,
+                     size_t nhave, size_t *nmissing)
+{
+    extent *missing = malloc(sizeof(*missing) * (nhave + 1));
+    uint64_t addr = start, end = start + size;
+    size_t i, n = 0;
+
+    if (!missing)
+    {
+        *nmissing = 0;
+        return NULL;
+    }
+
+    // The extents we have are sorted so the gaps between them are missing
+    for (i = 0; i < nhave && addr < end; i++)
+    {
+        uint64_t hend = have[i].addr + have[i].len;
+
+        if (hend <= addr)
+        {
+            continue;
+        }
+
+        if (have[i].addr > addr)
+        {
+            missing[n].addr = addr;
+            missing[n].len = ((have[i].addr < end) ? have[i].addr : end) - addr;
+            n++;
+        }
+
+        addr = hend;
+    }
+
+    if (addr < end)
+    {
+        missing[n].addr = addr;
+        missing[n].len = end - addr;
+        n++;
+    }
+
+    *nmissing = n;
+    return missing;
+}
+
+int acquire(forensic1394_dev *dev, const dump_opts *opts, dump_output *out,
+            dump_journal *journal, dump_digest *digest, const extent *missing,
+            size_t nmissing)
+{
+    forensic1394_req *req;
+    forensic1394_result ret = FORENSIC1394_RESULT_SUCCESS;
+    pipeline *p;
+    dump_writer writer;
+    dump_smear *sm = NULL;
+    stage s;
+    progress prog;
+    struct sigaction sa;
+    struct timespec now;
+    time_t epoch;
+    uint64_t todo = 0, done = 0, nbad = 0;
+    size_t i, maxreq = forensic1394_get_device_request_size(dev);
+    int error = 0, complete, status = EXIT_SUCCESS;
+
+    for (i = 0; i < nmissing; i++)
+    {
+        todo += missing[i].len;
+    }
+
+    req = malloc(sizeof(*req) * (opts->chunk / maxreq + 1));
+    p = pipeline_alloc(opts->chunk);
+
+    if (opts->smear_ns)
+    {
+        sm = smear_alloc(opts->start, opts->size, DUMP_PAGE_SIZE);
+    }
+
+    if (!p || !req || (nmissing && !missing) || (opts->smear_ns && !sm))
+    {
+        fprintf(stderr, "Out of memory\n");
+        output_close(out, 0);
+
+        if (journal)
+        {
+            journal_close(journal);
+        }
+
+        if (p)
+        {
+            pipeline_free(p);
+        }
+
+        if (sm)
+        {
+            smear_free(sm);
+        }
+
+        free(req);
+        return EXIT_FAILURE;
+    }
+
+    // The writer is the first stage, followed by any hashing stages
+    memset(&writer, 0, sizeof(writer));
+    writer.out = out;
+    writer.journal = journal;
+    writer.start = opts->start;
+    clock_gettime(CLOCK_MONOTONIC, &writer.last);
+
+    s.process = write_chunk;
+    s.finish = commit;
+    s.ctx = &writer;
+    pipeline_add_stage(p, &s);
+
+    /*
+     * When reducing smear pages are liable to be rewritten after the main
+     * pass and so the image can only be hashed once it is final.
+     */
+    if (sm)
+    {
+        smear_get_stage(sm, &s);
+        pipeline_add_stage(p, &s);
+    }
+    else
+    {
+        for (i = 0; digest && i < (size_t) digest_nstages(digest); i++)
+        {
+            digest_get_stage(digest, i, &s);
+            pipeline_add_stage(p, &s);
+        }
+    }
+
+    // Stop cleanly on an interrupt so that the journal is committed
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (pipeline_start(p) == -1)
+    {
+        fprintf(stderr, "Unable to start threads: %s\n", strerror(errno));
+        nmissing = 0;
+        status = EXIT_FAILURE;
+    }
+
+    memset(&prog, 0, sizeof(prog));
+    prog.enabled = !opts->quiet && isatty(STDERR_FILENO);
+    prog.total = opts->size;
+    prog.base = opts->size - todo;
+    clock_gettime(CLOCK_MONOTONIC, &prog.begin);
+    prog.last = prog.begin;
+    epoch = time(NULL);
+
+    for (i = 0; i < nmissing && ret == FORENSIC1394_RESULT_SUCCESS; i++)
+    {
+        uint64_t off;
+
+        for (off = 0; off < missing[i].len; )
+        {
+            chunk *c;
+
+            if (interrupted)
+            {
+                ret = FORENSIC1394_RESULT_OTHER_ERROR;
+                fprintf(stderr, "\nInterrupted\n");
+                break;
+            }
+
+            // Wait for a free buffer; none will come should a stage fail
+            if (!(c = pipeline_get_free(p)))
+            {
+                ret = FORENSIC1394_RESULT_OTHER_ERROR;
+                break;
+            }
+
+            c->addr = missing[i].addr + off;
+            c->len = (missing[i].len - off < opts->chunk)
+                   ? missing[i].len - off : opts->chunk;
+
+            ret = read_chunk(dev, req, c, &nbad);
+
+            if (ret != FORENSIC1394_RESULT_SUCCESS)
+            {
+                fprintf(stderr, "\nRead failed at 0x%" PRIx64 ": %s\n",
+                        c->addr, forensic1394_get_result_str(ret));
+                break;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            c->when = elapsed_ns(&prog.begin, &now) / 1000000;
+
+            // Hand the chunk over to the stages
+            pipeline_publish(p);
+
+            off += c->len;
+            done += c->len;
+
+            progress_update(&prog, prog.base + done, 0);
+        }
+    }
+
+    // Let the stages drain the pipeline and exit
+    if (status == EXIT_SUCCESS)
+    {
+        error = pipeline_finish(p, done == todo);
+    }
+
+    progress_update(&prog, prog.base + done, 1);
+
+    complete = (done == todo && !error && status == EXIT_SUCCESS);
+
+    if (error)
+    {
+        fprintf(stderr, "Unable to write to %s: %s\n", opts->path,
+                strerror(error));
+        status = EXIT_FAILURE;
+    }
+
+    // With the image complete go back over the pages which have changed
+    if (complete && sm)
+    {
+        if (reduce_smear(dev, opts, out, sm, &prog.begin) == -1)
+        {
+            status = EXIT_FAILURE;
+        }
+
+        // Whatever was rewritten is part of the image and so must be hashed
+        if (output_sync(out) == -1 || (digest && hash_file(digest) == -1))
+        {
+            fprintf(stderr, "Unable to update %s: %s\n", opts->path,
+                    strerror(errno));
+            digest = NULL;
+            status = EXIT_FAILURE;
+        }
+
+        if (smear_write_times(sm, opts->times, epoch) == -1)
+        {
+            fprintf(stderr, "Unable to write page times %s: %s\n",
+                    opts->times, strerror(errno));
+            status = EXIT_FAILURE;
+        }
+    }
+
+    // Incomplete images are left as-is for a later run to resume
+    if (output_close(out, complete ? opts->size : 0) == -1 && !error)
+    {
+        fprintf(stderr, "Unable to close %s: %s\n", opts->path,
+                strerror(errno));
+        status = EXIT_FAILURE;
+    }
+
+    if (journal && journal_close(journal) == -1)
+    {
+        fprintf(stderr, "Unable to commit journal %s: %s\n", opts->journal,
+                strerror(errno));
+        status = EXIT_FAILURE;
+    }
+
+    if (!complete)
+    {
+        fprintf(stderr, "Acquisition incomplete; %s\n", journal
+                ? "rerun with -r to resume" : "unable to resume");
+        status = EXIT_FAILURE;
+    }
+    // Hashes are only meaningful for a complete image
+    else if (digest)
+    {
+        if (!opts->quiet)
+        {
+            digest_print(digest, stderr);
+        }
+
+        if (opts->manifest
+         && digest_write_manifest(digest, opts->manifest,
+                                  forensic1394_get_device_guid(dev)) == -1)
+        {
+            fprintf(stderr, "Unable to write hash manifest %s: %s\n",
+                    opts->manifest, strerror(errno));
+            status = EXIT_FAILURE;
+        }
+    }
+
+    if (nbad)
+    {
+        fprintf(stderr, "%" PRIu64 " bytes were unreadable and have been "
+                "zero-filled\n", nbad);
+    }
+
+    if (sm)
+    {
+        smear_free(sm);
+    }
+
+    pipeline_free(p);
+    free(req);
+
+    return status;
+}
+
+int reduce_smear(forensic1394_dev *dev, const dump_opts *opts,
+                 dump_output *out, dump_smear *sm,
+                 const struct timespec *begin)
+{
+    forensic1394_req *req;
+    forensic1394_result ret;
+    extent all, *ext = &all;
+    chunk c;
+    struct timespec start, now;
+    size_t i, next = 1, nreq;
+    size_t maxreq = forensic1394_get_device_request_size(dev);
+    size_t chunksz = opts->chunk - opts->chunk % DUMP_PAGE_SIZE;
+    int64_t n, nchanged, prev = -1;
+    int pass, status = 0;
+
+    // Pages acquired by an earlier run have yet to be hashed
+    if (smear_fill(sm, opts->path) == -1)
+    {
+        fprintf(stderr, "Unable to read %s: %s\n", opts->path,
+                strerror(errno));
+        return -1;
+    }
+
+    // Chunks must be page aligned so that pages can be compared whole
+    chunksz = (chunksz > DUMP_PAGE_SIZE) ? chunksz : DUMP_PAGE_SIZE;
+
+    c.buf = malloc(chunksz);
+    req = malloc(sizeof(*req) * (chunksz / maxreq + 1));
+
+    if (!c.buf || !req)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(c.buf);
+        free(req);
+        return -1;
+    }
+
+    // The first pass covers everything, later ones only what changed
+    all.addr = opts->start;
+    all.len = opts->size;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (pass = 1; status == 0; pass++)
+    {
+        for (i = 0, nchanged = 0; i < next && status == 0; i++)
+        {
+            uint64_t off;
+
+            for (off = 0; off < ext[i].len && !interrupted; off += c.len)
+            {
+                c.addr = ext[i].addr + off;
+                c.len = (ext[i].len - off < chunksz)
+                      ? ext[i].len - off : chunksz;
+
+                ret = read_chunk_v(dev, req, &c, &nreq);
+
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                c.when = elapsed_ns(begin, &now) / 1000000;
+
+                // Unreadable pages keep their state and are tried next pass
+                if (is_unreadable(ret))
+                {
+                    continue;
+                }
+                else if (ret != FORENSIC1394_RESULT_SUCCESS)
+                {
+                    fprintf(stderr, "Read failed at 0x%" PRIx64 ": %s\n",
+                            c.addr, forensic1394_get_result_str(ret));
+                    status = -1;
+                    break;
+                }
+
+                if ((n = smear_update(sm, &c, out)) == -1)
+                {
+                    fprintf(stderr, "Unable to write to %s: %s\n",
+                            opts->path, strerror(errno));
+                    status = -1;
+                    break;
+                }
+
+                nchanged += n;
+            }
+        }
+
+        if (ext != &all)
+        {
+            free(ext);
+        }
+
+        if (status == -1)
+        {
+            break;
+        }
+
+        if (!opts->quiet)
+        {
+            fprintf(stderr, "Smear pass %d: %" PRId64 " pages changed\n",
+                    pass, nchanged);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // Stop once the changed set no longer shrinks or time is up
+        if (interrupted || nchanged == 0 || (prev != -1 && nchanged >= prev)
+         || elapsed_ns(&start, &now) >= opts->smear_ns)
+        {
+            break;
+        }
+
+        prev = nchanged;
+
+        if (!(ext = smear_changed(sm, &next)))
+        {
+            fprintf(stderr, "Out of memory\n");
+            status = -1;
+        }
+    }
+
+    free(c.buf);
+    free(req);
+
+    return status;
+}
+
+int hash_file(dump_digest *digest)
+{
+    pipeline *p = pipeline_alloc(1);
+    stage s;
+    int i, error;
+
+    if (!p)
+    {
+        return -1;
+    }
+
+    // With no chunks passed through the stages read the whole image back
+    for (i = 0; i < digest_nstages(digest); i++)
+    {
+        digest_get_stage(digest, i, &s);
+        pipeline_add_stage(p, &s);
+    }
+
+    if (pipeline_start(p) == -1)
+    {
+        pipeline_free(p);
+        return -1;
+    }
+
+    error = pipeline_finish(p, 1);
+    pipeline_free(p);
+
+    errno = error;
+    return error ? -1 : 0;
+}
+
+int hash_workers(int share)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN) / share;
+
+    if (ncpu < 1)
+    {
+        return 1;
+    }
+
+    return (ncpu < DUMP_MAX_HASH_WORKERS) ? ncpu : DUMP_MAX_HASH_WORKERS;
+}
+
+int verify(const dump_opts *opts, const dump_manifest *m,
+           forensic1394_dev *dev)
+{
+    forensic1394_req *req = NULL;
+    forensic1394_result ret;
+    dump_verifier *v;
+    pipeline *p;
+    progress prog;
+    stage s;
+    uint64_t first = 0, last = m->nseg, seg, nbad = 0, nchanged = 0;
+    int fd = -1, i, error = 0, status = EXIT_SUCCESS;
+
+    // Restrict ourselves to the segments overlapping the requested range
+    if (opts->range_set)
+    {
+        uint64_t end = opts->start + opts->size;
+
+        first = (opts->start > m->start)
+              ? (opts->start - m->start) / m->segsz : 0;
+        last = (end > m->start)
+             ? (end - m->start + m->segsz - 1) / m->segsz : 0;
+        last = (last < m->nseg) ? last : m->nseg;
+        first = (first < last) ? first : last;
+    }
+
+    if (dev)
+    {
+        size_t maxreq = forensic1394_get_device_request_size(dev);
+
+        if (forensic1394_get_device_guid(dev) != m->guid)
+        {
+            fprintf(stderr, "Warning: manifest is for device %016" PRIx64
+                    " not %016" PRIx64 "\n", m->guid,
+                    forensic1394_get_device_guid(dev));
+        }
+
+        req = malloc(sizeof(*req) * (m->segsz / maxreq + 1));
+    }
+    else if ((fd = open(opts->path, O_RDONLY)) == -1)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", opts->path,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    v = verify_alloc(m, hash_workers(1));
+    p = pipeline_alloc(m->segsz);
+
+    if (!v || !p || (dev && !req))
+    {
+        fprintf(stderr, "Out of memory\n");
+        last = first;
+        status = EXIT_FAILURE;
+    }
+
+    for (i = 0; v && p && i < verify_nstages(v); i++)
+    {
+        verify_get_stage(v, i, &s);
+        pipeline_add_stage(p, &s);
+    }
+
+    if (status == EXIT_SUCCESS && pipeline_start(p) == -1)
+    {
+        fprintf(stderr, "Unable to start threads: %s\n", strerror(errno));
+        last = first;
+        status = EXIT_FAILURE;
+    }
+
+    memset(&prog, 0, sizeof(prog));
+    prog.enabled = !opts->quiet && isatty(STDERR_FILENO);
+    prog.total = (last - first)*m->segsz;
+    clock_gettime(CLOCK_MONOTONIC, &prog.begin);
+    prog.last = prog.begin;
+
+    // Segments are read in order, one chunk apiece, and checked in parallel
+    for (seg = first; seg < last; seg++)
+    {
+        chunk *c = pipeline_get_free(p);
+
+        if (!c)
+        {
+            break;
+        }
+
+        c->addr = m->start + seg*m->segsz;
+        c->len = (m->size - seg*m->segsz < m->segsz)
+               ? m->size - seg*m->segsz : m->segsz;
+
+        if (dev)
+        {
+            ret = read_chunk(dev, req, c, &nbad);
+
+            if (ret != FORENSIC1394_RESULT_SUCCESS)
+            {
+                fprintf(stderr, "\nRead failed at 0x%" PRIx64 ": %s\n",
+                        c->addr, forensic1394_get_result_str(ret));
+                break;
+            }
+        }
+        else if (read_image(fd, c->buf, c->len, c->addr - m->start) == -1)
+        {
+            fprintf(stderr, "\nUnable to read %s: %s\n", opts->path,
+                    strerror(errno));
+            break;
+        }
+
+        pipeline_publish(p);
+
+        progress_update(&prog, (seg + 1 - first)*m->segsz, 0);
+    }
+
+    if (status == EXIT_SUCCESS)
+    {
+        error = pipeline_finish(p, seg == last);
+        progress_update(&prog, (seg - first)*m->segsz, 1);
+    }
+
+    if (error)
+    {
+        fprintf(stderr, "Verification failed: %s\n", strerror(error));
+        status = EXIT_FAILURE;
+    }
+    else if (seg != last)
+    {
+        status = EXIT_FAILURE;
+    }
+
+    // Report those segments which were checked and did not match
+    for (seg = first; status == EXIT_SUCCESS && seg < last; seg++)
+    {
+        if (verify_mismatch(v, seg))
+        {
+            printf("0x%" PRIx64 " %s\n", m->start + seg*m->segsz,
+                   dev ? "changed" : "mismatch");
+            nchanged++;
+        }
+    }
+
+    if (status == EXIT_SUCCESS)
+    {
+        fflush(stdout);
+        fprintf(stderr, "%" PRIu64 " of %" PRIu64 " segments %s\n",
+                nchanged, last - first, dev
+                ? "have changed since the acquisition"
+                : "do not match the manifest");
+
+        status = nchanged ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (nbad)
+    {
+        fprintf(stderr, "%" PRIu64 " bytes were unreadable\n", nbad);
+    }
+
+    if (p)
+    {
+        pipeline_free(p);
+    }
+
+    if (v)
+    {
+        verify_free(v);
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    free(req);
+
+    return status;
+}
+
+int read_image(int fd, char *buf, size_t len, uint64_t off)
+{
+    while (len)
+    {
+        ssize_t got = pread(fd, buf, len, off);
+
+        if (got == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (got == -1)
+        {
+            return -1;
+        }
+        // Whatever lies beyond the end of the image is a hole
+        else if (got == 0)
+        {
+            memset(buf, 0, len);
+            break;
+        }
+
+        buf += got;
+        len -= got;
+        off += got;
+    }
+
+    return 0;
+}
+
+void on_signal(int sig)
+{
+    (void) sig;
+
+    interrupted = 1;
+}
+
+int parse_size(const char *s, uint64_t *size)
+{
+    char *end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(s, &end, 0);
+
+    if (errno || end == s)
+    {
+        return -1;
+    }
+
+    switch (*end)
+    {
+        case 'g':
+        case 'G':
+            v <<= 10;
+            // Fall through
+        case 'm':
+        case 'M':
+            v <<= 10;
+            // Fall through
+        case 'k':
+        case 'K':
+            v <<= 10;
+            end++;
+            // Fall through
+        case '\0':
+            break;
+        default:
+            return -1;
+    }
+
+    if (*end != '\0')
+    {
+        return -1;
+    }
+
+    *size = v;
+    return 0;
+}
+
+void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] OUTPUT\n"
+            "       %s -l [-s]\n"
+            "       %s -V [-L] [-a ADDR] [-n SIZE] [-m FILE] OUTPUT\n"
+            "\n"
+            "Acquires the memory of a FireWire device to OUTPUT, which may be\n"
+            "'-' for the standard output.  Sizes may be suffixed by k, m or g.\n"
+            "\n"
+            "  -l         list the devices attached to the bus and exit\n"
+            "  -d INDEX   the device to acquire, as listed by -l (default 0)\n"
+            "  -g GUID    the device to acquire, by GUID\n"
+            "  -s         enable SBP-2, required for DMA by many targets\n"
+            "  -a ADDR    the address to start at (default 0)\n"
+            "  -n SIZE    the number of bytes to acquire (default 4g)\n"
+            "  -c SIZE    the number of bytes per vectored read (default 1m)\n"
+            "  -p DEPTH   the number of requests to keep in flight\n"
+            "  -f FORMAT  raw, sparse or zlib (default raw)\n"
+            "  -r         resume an interrupted acquisition\n"
+            "  -j FILE    the journal used for resuming (default OUTPUT.journal)\n"
+            "  -m FILE    the hash manifest to write (default OUTPUT.hashes)\n"
+            "  -S SIZE    the size of each segment in the manifest (default 1m)\n"
+            "  -H         do not hash the image\n"
+            "  -R SECS    after acquiring re-read pages which have changed, for\n"
+            "             at most SECS, to reduce smear; page times are written\n"
+            "             to OUTPUT.pages\n"
+            "  -V         verify OUTPUT, or the range given by -a and -n of it,\n"
+            "             against its hash manifest\n"
+            "  -L         with -V verify the live device instead, showing where\n"
+            "             its memory has changed since the acquisition\n"
+            "  -q         do not display progress\n",
+            argv0, argv0, argv0);
+}
+
+int parse_opts(int argc, char **argv, dump_opts *opts)
+{
+    int c;
+    uint64_t chunk = DUMP_DEFAULT_CHUNK;
+    unsigned long long guid;
+    double secs;
+    char *end;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->size = DUMP_DEFAULT_SIZE;
+    opts->format = OUTPUT_RAW;
+    opts->segsz = DUMP_DEFAULT_SEGMENT;
+
+    while ((c = getopt(argc, argv, "ld:g:sa:n:c:p:f:rj:m:S:HR:VLq")) != -1)
+    {
+        switch (c)
+        {
+            case 'l':
+                opts->list = 1;
+                break;
+            case 'd':
+                opts->device = atoi(optarg);
+                opts->device_set = 1;
+                break;
+            case 'g':
+                // OUIs commonly have the top bit set so parse as unsigned
+                errno = 0;
+                guid = strtoull(optarg, &end, 16);
+
+                if (errno || end == optarg || *end != '\0')
+                {
+                    return -1;
+                }
+                opts->guid = (int64_t) guid;
+                break;
+            case 's':
+                opts->sbp2 = 1;
+                break;
+            case 'a':
+                if (parse_size(optarg, &opts->start) == -1)
+                {
+                    return -1;
+                }
+                opts->range_set = 1;
+                break;
+            case 'n':
+                if (parse_size(optarg, &opts->size) == -1)
+                {
+                    return -1;
+                }
+                opts->range_set = 1;
+                break;
+            case 'c':
+                if (parse_size(optarg, &chunk) == -1 || chunk == 0)
+                {
+                    return -1;
+                }
+                break;
+            case 'p':
+                if ((opts->depth = atoi(optarg)) <= 0)
+                {
+                    return -1;
+                }
+                break;
+            case 'f':
+                if (strcmp(optarg, "raw") == 0)
+                {
+                    opts->format = OUTPUT_RAW;
+                }
+                else if (strcmp(optarg, "sparse") == 0)
+                {
+                    opts->format = OUTPUT_SPARSE;
+                }
+                else if (strcmp(optarg, "zlib") == 0)
+                {
+                    opts->format = OUTPUT_ZLIB;
+                }
+                else
+                {
+                    return -1;
+                }
+                break;
+            case 'r':
+                opts->resume = 1;
+                break;
+            case 'j':
+                opts->journal = optarg;
+                break;
+            case 'm':
+                opts->manifest = optarg;
+                break;
+            case 'S':
+                if (parse_size(optarg, &opts->segsz) == -1 || !opts->segsz)
+                {
+                    return -1;
+                }
+                break;
+            case 'H':
+                opts->nohash = 1;
+                break;
+            case 'R':
+                if ((secs = strtod(optarg, NULL)) <= 0)
+                {
+                    return -1;
+                }
+                opts->smear_ns = secs*1e9;
+                break;
+            case 'V':
+                opts->verify = 1;
+                break;
+            case 'L':
+                opts->live = 1;
+                break;
+            case 'q':
+                opts->quiet = 1;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    opts->chunk = chunk;
+
+    if (opts->live && !opts->verify)
+    {
+        return -1;
+    }
+
+    if (opts->list)
+    {
+        return 0;
+    }
+
+    // Exactly one output file is required
+    if (optind != argc - 1)
+    {
+        return -1;
+    }
+
+    opts->path = argv[optind];
+
+    // Compressed and streamed images are written in order, hence no journal
+    if (opts->format == OUTPUT_ZLIB || strcmp(opts->path, "-") == 0)
+    {
+        opts->journal = NULL;
+    }
+    else if (!opts->journal)
+    {
+        static char journal[4096];
+
+        snprintf(journal, sizeof(journal), "%s" DUMP_JOURNAL_SUFFIX,
+                 opts->path);
+        opts->journal = journal;
+    }
+
+    // The manifest goes alongside the image, if there is somewhere to put it
+    if (opts->nohash && !opts->verify)
+    {
+        opts->manifest = NULL;
+    }
+    else if (!opts->manifest && strcmp(opts->path, "-") != 0)
+    {
+        static char manifest[4096];
+
+        snprintf(manifest, sizeof(manifest), "%s" DUMP_MANIFEST_SUFFIX,
+                 opts->path);
+        opts->manifest = manifest;
+    }
+
+    // Reducing smear rewrites pages and so needs a flat image file
+    if (opts->smear_ns)
+    {
+        static char times[4096];
+
+        if (opts->format == OUTPUT_ZLIB || strcmp(opts->path, "-") == 0)
+        {
+            return -1;
+        }
+
+        snprintf(times, sizeof(times), "%s" DUMP_TIMES_SUFFIX, opts->path);
+        opts->times = times;
+    }
+
+    return 0;
+}
+
+void list_devices(forensic1394_dev **dev, int ndev)
+{
+    int i;
+
+    for (i = 0; i < ndev; i++)
+    {
+        printf("%d: GUID %016" PRIx64 " node %04x vendor %06x '%s' "
+               "product %06x '%s'\n", i,
+               forensic1394_get_device_guid(dev[i]),
+               forensic1394_get_device_node_id(dev[i]),
+               forensic1394_get_device_vendor_id(dev[i]),
+               forensic1394_get_device_vendor_name(dev[i]),
+               forensic1394_get_device_product_id(dev[i]),
+               forensic1394_get_device_product_name(dev[i]));
+    }
+}
+
+forensic1394_dev *select_device(forensic1394_bus *bus, const dump_opts *opts)
+{
+    forensic1394_dev **dev;
+    forensic1394_filter filter;
+    int ndev;
+
+    // When a GUID is given only the matching node need be probed
+    memset(&filter, 0, sizeof(filter));
+    filter.guid = opts->guid;
+
+    dev = forensic1394_get_devices_filtered(bus, &filter, &ndev, NULL);
+
+    if (ndev < 0)
+    {
+        fprintf(stderr, "Unable to enumerate devices: %s\n",
+                forensic1394_get_result_str(ndev));
+        return NULL;
+    }
+
+    if (opts->list)
+    {
+        list_devices(dev, ndev);
+        return NULL;
+    }
+
+    if (opts->guid)
+    {
+        if (ndev == 0)
+        {
+            fprintf(stderr, "No device with GUID %016" PRIx64 " found\n",
+                    opts->guid);
+            return NULL;
+        }
+
+        return dev[0];
+    }
+
+    if (opts->device < 0 || opts->device >= ndev)
+    {
+        fprintf(stderr, "No such device %d; %d found\n", opts->device, ndev);
+        return NULL;
+    }
+
+    return dev[opts->device];
+}
+
+forensic1394_result read_chunk_v(forensic1394_dev *dev,
+                                 forensic1394_req *req, chunk *c, size_t *nreq)
+{
+    forensic1394_result ret = FORENSIC1394_RESULT_SUCCESS;
+    size_t maxreq = forensic1394_get_device_request_size(dev);
+    size_t off;
+    int attempt;
+
+    // Split the chunk up into requests
+    for (off = 0, *nreq = 0; off < c->len; off += maxreq, (*nreq)++)
+    {
+        req[*nreq].addr = c->addr + off;
+        req[*nreq].len = (c->len - off < maxreq) ? c->len - off : maxreq;
+        req[*nreq].buf = c->buf + off;
+    }
+
+    for (attempt = 0; attempt < DUMP_RETRIES; attempt++)
+    {
+        ret = forensic1394_read_device_v(dev, req, *nreq);
+
+        switch (ret)
+        {
+            case FORENSIC1394_RESULT_SUCCESS:
+                return ret;
+            // Following a bus reset wait for the device to settle
+            case FORENSIC1394_RESULT_BUS_RESET:
+                forensic1394_wait_device_ready(dev, DUMP_READY_TIMEOUT_MS);
+                break;
+            // Transient errors; just retry
+            case FORENSIC1394_RESULT_BUSY:
+            case FORENSIC1394_RESULT_IO_TIMEOUT:
+            case FORENSIC1394_RESULT_IO_ERROR:
+            case FORENSIC1394_RESULT_IO_SIZE:
+                break;
+            default:
+                return ret;
+        }
+    }
+
+    return ret;
+}
+
+int is_unreadable(forensic1394_result ret)
+{
+    return ret == FORENSIC1394_RESULT_IO_ERROR
+        || ret == FORENSIC1394_RESULT_IO_SIZE
+        || ret == FORENSIC1394_RESULT_IO_TIMEOUT
+        || ret == FORENSIC1394_RESULT_BUSY
+        || ret == FORENSIC1394_RESULT_BUS_RESET;
+}
+
+forensic1394_result read_chunk(forensic1394_dev *dev, forensic1394_req *req,
+                               chunk *c, uint64_t *nbad)
+{
+    forensic1394_result ret;
+    size_t i, nreq;
+
+    ret = read_chunk_v(dev, req, c, &nreq);
+
+    if (!is_unreadable(ret))
+    {
+        return ret;
+    }
+
+    // Some part of the chunk is unreadable; find out which
+    for (i = 0; i < nreq; i++)
+    {
+        ret = forensic1394_read_device(dev, req[i].addr, req[i].len,
+                                       req[i].buf);
+
+        if (is_unreadable(ret) && ret != FORENSIC1394_RESULT_BUS_RESET)
+        {
+            memset(req[i].buf, 0, req[i].len);
+            *nbad += req[i].len;
+        }
+        else if (ret != FORENSIC1394_RESULT_SUCCESS)
+        {
+            return ret;
+        }
+    }
+
+    return FORENSIC1394_RESULT_SUCCESS;
+}
+
+int write_chunk(void *ctx, const chunk *c)
+{
+    dump_writer *w = ctx;
+    struct timespec now;
+
+    if (output_write(w->out, c->addr - w->start, c->buf, c->len) == -1
+     || (w->journal && journal_add(w->journal, c->addr, c->len) == -1))
+    {
+        return -1;
+    }
+
+    // Periodically commit what has been written
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (w->journal
+     && (journal_pending(w->journal) >= DUMP_JOURNAL_BATCH
+      || elapsed_ns(&w->last, &now) >= DUMP_JOURNAL_NS))
+    {
+        if (commit(w, 0) == -1)
+        {
+            return -1;
+        }
+
+        w->last = now;
+    }
+
+    return 0;
+}
+
+int commit(void *ctx, int complete)
+{
+    dump_writer *w = ctx;
+
+    (void) complete;
+
+    // Whatever was written is committed, whether or not we are complete
+    if (!w->journal || journal_pending(w->journal) == 0)
+    {
+        return 0;
+    }
+
+    // Data must be on disk before the journal can claim that it is
+    if (output_sync(w->out) == -1 || journal_commit(w->journal) == -1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int64_t elapsed_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t) (b->tv_sec - a->tv_sec) * 1000000000LL
+         + (b->tv_nsec - a->tv_nsec);
+}
+
+void progress_update(progress *p, uint64_t done, int final)
+{
+    struct timespec now;
+    double secs, rate;
+
+    if (!p->enabled)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!final && elapsed_ns(&p->last, &now) < DUMP_PROGRESS_NS)
+    {
+        return;
+    }
+
+    p->last = now;
+
+    // Only count what has been read by this run towards the rate
+    secs = elapsed_ns(&p->begin, &now) / 1e9;
+    rate = (secs > 0) ? (done - p->base) / secs : 0;
+
+    fprintf(stderr, "\r%8.1f MiB of %.1f MiB (%5.1f%%) %7.2f MiB/s",
+            done / 1048576.0, p->total / 1048576.0,
+            p->total ? 100.0 * done / p->total : 100.0, rate / 1048576.0);
+
+    if (final)
+    {
+        fputc('\n', stderr);
+    }
+    else if (rate > 0)
+    {
+        int eta = (p->total - done) / rate;
+        fprintf(stderr, "  ETA %d:%02d:%02d ", eta / 3600, eta / 60 % 60,
+                eta % 60);
+    }
+}
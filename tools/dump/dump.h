@@ -0,0 +1,408 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FORENSIC1394_DUMP_H
+#define FORENSIC1394_DUMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "hash.h"
+
+/*
+ * Internal definitions shared between the modules of forensic1394-dump.
+ */
+
+/**
+ * Output formats supported by the dumper.
+ */
+typedef enum
+{
+    /// A flat image; byte i of the file is byte start + i of the target
+    OUTPUT_RAW,
+    /// As with OUTPUT_RAW except that zero-filled chunks are left as holes
+    OUTPUT_SPARSE,
+    /// A gzip compressed flat image
+    OUTPUT_ZLIB
+} output_format;
+
+typedef struct _dump_output dump_output;
+
+/**
+ * Opens the output file \a path, which may be "-" for the standard output.
+ *  If \a resume is non-zero then an existing file is not truncated and the
+ *  number of bytes it already contains is stored in \a *resume_off.
+ *
+ *   \param path The file to write the image to.
+ *   \param format The format of the image.
+ *   \param resume If the file should be appended to.
+ *   \param[out] resume_off The size of the existing image; may be NULL unless
+ *                          \a resume is non-zero.
+ *  \return The output handle or NULL, with errno set, on error.
+ */
+dump_output *output_open(const char *path, output_format format,
+                         int resume, uint64_t *resume_off);
+
+/**
+ * Writes \a len bytes of \a buf to \a out at offset \a off into the image.
+ *  Compressed and streamed images must be written in order.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int output_write(dump_output *out, uint64_t off, const void *buf, size_t len);
+
+/**
+ * Overwrites \a len bytes at offset \a off into the image with \a buf.
+ *  Only raw and sparse images written to a file can be rewritten.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int output_rewrite(dump_output *out, uint64_t off, const void *buf,
+                   size_t len);
+
+/**
+ * Flushes all data written to \a out to stable storage.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int output_sync(dump_output *out);
+
+/**
+ * Closes \a out, ensuring that the image is at least \a size bytes long.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int output_close(dump_output *out, uint64_t size);
+
+/**
+ * Returns non-zero if the \a len bytes at \a buf are all zero.
+ */
+int is_zero(const void *buf, size_t len);
+
+/**
+ * A chunk of memory read from the target.
+ */
+typedef struct
+{
+    uint64_t addr;
+    size_t len;
+    char *buf;
+
+    /// When the chunk was read, in milliseconds since the acquisition began
+    uint32_t when;
+} chunk;
+
+/**
+ * A stage of the acquisition pipeline.  Each stage runs on its own thread and
+ *  is passed every chunk, in address order, followed by a call to \a finish
+ *  once the final chunk has been processed.  Stages run concurrently and must
+ *  not modify the chunks.
+ */
+typedef struct
+{
+    /// Processes a chunk; returns 0 on success or -1 with errno set
+    int (*process)(void *ctx, const chunk *c);
+
+    /**
+     * Called once all chunks have been processed, with \a complete zero if
+     *  the acquisition was cut short; may be NULL.
+     */
+    int (*finish)(void *ctx, int complete);
+
+    void *ctx;
+} stage;
+
+typedef struct _pipeline pipeline;
+
+/**
+ * Allocates a pipeline whose chunk buffers are each \a chunksz bytes.
+ *
+ *  \return The pipeline or NULL if memory could not be allocated.
+ */
+pipeline *pipeline_alloc(size_t chunksz);
+
+/**
+ * Adds a copy of \a s to \a p; stages must be added before ::pipeline_start.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int pipeline_add_stage(pipeline *p, const stage *s);
+
+/**
+ * Starts a thread for each stage of \a p.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int pipeline_start(pipeline *p);
+
+/**
+ * Waits for a free chunk buffer for the reader to fill.  Once filled it is
+ *  handed over to the stages by calling ::pipeline_publish.
+ *
+ *  \return The chunk or NULL should a stage have failed.
+ */
+chunk *pipeline_get_free(pipeline *p);
+
+/**
+ * Passes the chunk last returned by ::pipeline_get_free on to the stages.
+ */
+void pipeline_publish(pipeline *p);
+
+/**
+ * Waits for the stages of \a p to process all published chunks and finish.
+ *  Should the reader have stopped early \a complete must be zero.
+ *
+ *  \return 0 on success or the errno value of the first stage to fail.
+ */
+int pipeline_finish(pipeline *p, int complete);
+
+void pipeline_free(pipeline *p);
+
+/**
+ * A range of addresses on the target.
+ */
+typedef struct
+{
+    uint64_t addr;
+    uint64_t len;
+} extent;
+
+/**
+ * Identifies the acquisition a journal belongs to.
+ */
+typedef struct
+{
+    /// GUID of the target device
+    int64_t guid;
+
+    /// Range of addresses being acquired
+    uint64_t start;
+    uint64_t size;
+} journal_info;
+
+typedef struct _dump_journal dump_journal;
+
+/**
+ * Loads the journal at \a path, returning the extents it records as having
+ *  been acquired.  These are sorted and coalesced.  Any partially written
+ *  record at the end of the journal, as left by a crash, is ignored.
+ *
+ *   \param path The journal to load.
+ *   \param[out] info The acquisition the journal belongs to.
+ *   \param[out] ext The acquired extents; to be freed by the caller.
+ *   \param[out] next The number of extents in \a ext.
+ *  \return 0 on success or -1, with errno set, on error.  EINVAL indicates
+ *          that \a path is not a journal.
+ */
+int journal_load(const char *path, journal_info *info,
+                 extent **ext, size_t *next);
+
+/**
+ * Opens the journal at \a path for appending.  Unless \a resume is non-zero
+ *  any existing journal is replaced by a new one for \a info.
+ *
+ *  \return The journal or NULL, with errno set, on error.
+ */
+dump_journal *journal_open(const char *path, const journal_info *info,
+                           int resume);
+
+/**
+ * Records the extent [\a addr, \a addr + \a len) as having been written to
+ *  the image.  Records are buffered until ::journal_commit is called.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int journal_add(dump_journal *j, uint64_t addr, uint64_t len);
+
+/**
+ * Returns the number of records buffered since the last commit.
+ */
+size_t journal_pending(const dump_journal *j);
+
+/**
+ * Writes all buffered records to the journal and flushes it to stable
+ *  storage.  The image must be flushed beforehand so that the journal never
+ *  refers to data which has not reached the disk.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int journal_commit(dump_journal *j);
+
+/**
+ * Closes \a j; records which have not been committed are discarded.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int journal_close(dump_journal *j);
+
+typedef struct _dump_digest dump_digest;
+
+/**
+ * Allocates the state required to hash an image of \a size bytes starting at
+ *  \a start.  The whole image is hashed with both SHA-256 and MD5, and each
+ *  \a segsz byte segment of it with SHA-256 by one of \a nworker workers.
+ *
+ * Parts of the image not passed through the pipeline, such as those acquired
+ *  by a previous run, are read back from the image file at \a path.
+ *
+ *  \return The digest state or NULL, with errno set, on error.
+ */
+dump_digest *digest_alloc(uint64_t start, uint64_t size, uint64_t segsz,
+                          int nworker, const char *path);
+
+/**
+ * Returns the number of pipeline stages required by \a d.
+ */
+int digest_nstages(const dump_digest *d);
+
+/**
+ * Gets the \a i-th pipeline stage of \a d.
+ */
+void digest_get_stage(dump_digest *d, int i, stage *s);
+
+/**
+ * Writes a manifest of the hashes computed by \a d to \a path.  This
+ *  should only be called once all of the stages have finished.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int digest_write_manifest(const dump_digest *d, const char *path,
+                          int64_t guid);
+
+/**
+ * Prints the whole-image hashes computed by \a d to \a f.
+ */
+void digest_print(const dump_digest *d, FILE *f);
+
+void digest_free(dump_digest *d);
+
+/**
+ * A hash manifest, as written by ::digest_write_manifest.
+ */
+typedef struct
+{
+    int64_t guid;
+    uint64_t start, size, segsz;
+
+    /// The SHA-256 digest of each segment of the image
+    uint64_t nseg;
+    uint8_t (*seg)[SHA256_DIGEST_SZ];
+
+    /// The Merkle root recorded in the manifest
+    uint8_t root[SHA256_DIGEST_SZ];
+} dump_manifest;
+
+/**
+ * Loads the hash manifest at \a path.  The segment hashes are checked
+ *  against the recorded Merkle root.
+ *
+ *  \return The manifest or NULL, with errno set, on error.  EINVAL indicates
+ *          that \a path is not a manifest and EBADMSG that it is not
+ *          consistent with its Merkle root.
+ */
+dump_manifest *manifest_load(const char *path);
+
+void manifest_free(dump_manifest *m);
+
+typedef struct _dump_verifier dump_verifier;
+
+/**
+ * Allocates the state required to check segments against the manifest \a m
+ *  using \a nworker workers.  Chunks passed through the pipeline must each
+ *  be a whole segment.
+ *
+ *  \return The verifier or NULL, with errno set, on error.
+ */
+dump_verifier *verify_alloc(const dump_manifest *m, int nworker);
+
+/**
+ * Returns the number of pipeline stages required by \a v.
+ */
+int verify_nstages(const dump_verifier *v);
+
+/**
+ * Gets the \a i-th pipeline stage of \a v.
+ */
+void verify_get_stage(dump_verifier *v, int i, stage *s);
+
+/**
+ * Returns non-zero if segment \a seg was checked and found not to match the
+ *  manifest.  This should only be called once all of the stages have
+ *  finished.
+ */
+int verify_mismatch(const dump_verifier *v, uint64_t seg);
+
+void verify_free(dump_verifier *v);
+
+typedef struct _dump_smear dump_smear;
+
+/**
+ * Allocates the state required to track the consistency of each \a pagesz
+ *  byte page of an image of \a size bytes starting at \a start.
+ *
+ *  \return The state or NULL if memory could not be allocated.
+ */
+dump_smear *smear_alloc(uint64_t start, uint64_t size, uint64_t pagesz);
+
+/**
+ * Gets the pipeline stage recording the hash of each page acquired.
+ */
+void smear_get_stage(dump_smear *sm, stage *s);
+
+/**
+ * Hashes those pages whose hash was not recorded during acquisition, such as
+ *  those acquired by a previous run, by reading them from the image \a path.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int smear_fill(dump_smear *sm, const char *path);
+
+/**
+ * Compares the pages of \a c, which must be page aligned, with their hashes.
+ *  Pages which differ are rewritten in \a out and flagged as having changed;
+ *  others have the flag cleared.  Either way their consistency time becomes
+ *  that of \a c.
+ *
+ *  \return The number of pages which changed or -1, with errno set, on
+ *           error.
+ */
+int64_t smear_update(dump_smear *sm, const chunk *c, dump_output *out);
+
+/**
+ * Returns the runs of pages flagged as having changed.
+ *
+ *   \param[out] next The number of extents.
+ *  \return The extents, to be freed by the caller, or NULL if memory could
+ *          not be allocated.
+ */
+extent *smear_changed(const dump_smear *sm, size_t *next);
+
+/**
+ * Writes the consistency time of each page to \a path; \a epoch is the wall
+ *  clock time at which the acquisition began.
+ *
+ *  \return 0 on success or -1, with errno set, on error.
+ */
+int smear_write_times(const dump_smear *sm, const char *path, time_t epoch);
+
+void smear_free(dump_smear *sm);
+
+#endif // FORENSIC1394_DUMP_H
@@ -0,0 +1,83 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FORENSIC1394_DUMP_HASH_H
+#define FORENSIC1394_DUMP_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Self-contained implementations of the SHA-256 (FIPS 180-4) and MD5
+ *  (RFC 1321) message digests.
+ */
+
+#define SHA256_DIGEST_SZ    32
+#define MD5_DIGEST_SZ       16
+
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t nbytes;
+    uint8_t block[64];
+} sha256_ctx;
+
+typedef struct
+{
+    uint32_t state[4];
+    uint64_t nbytes;
+    uint8_t block[64];
+} md5_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SZ]);
+
+/**
+ * Computes the SHA-256 digest of \a len bytes of \a data in one go.
+ */
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SZ]);
+
+void md5_init(md5_ctx *ctx);
+void md5_update(md5_ctx *ctx, const void *data, size_t len);
+void md5_final(md5_ctx *ctx, uint8_t digest[MD5_DIGEST_SZ]);
+
+/**
+ * Formats the \a len byte digest \a digest as lower-case hexadecimal into
+ *  \a hex, which must have space for 2*\a len + 1 characters.
+ */
+void hash_hex(const uint8_t *digest, size_t len, char *hex);
+
+/**
+ * Parses the \a len byte digest in hexadecimal at \a hex into \a digest.
+ *
+ *  \return 0 on success, -1 if \a hex is not a valid digest.
+ */
+int hash_unhex(const char *hex, size_t len, uint8_t *digest);
+
+/**
+ * Computes the root of a Merkle tree whose \a n leaves are the SHA-256
+ *  digests \a leaf, as in RFC 6962.  Leaves are hashed as H(0x00 || leaf)
+ *  and interior nodes as H(0x01 || left || right), with the left subtree of
+ *  a node having the largest power of two leaves less than its total.
+ */
+void merkle_root(const uint8_t (*leaf)[SHA256_DIGEST_SZ], uint64_t n,
+                 uint8_t root[SHA256_DIGEST_SZ]);
+
+#endif // FORENSIC1394_DUMP_HASH_H
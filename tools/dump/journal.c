@@ -0,0 +1,322 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The journal is an append-only text file.  The first line identifies the
+ *  acquisition, with each subsequent line recording an extent of the image
+ *  which has been committed to disk:
+ *
+ *   forensic1394-dump journal 1 guid <guid> start <addr> size <bytes>
+ *   <addr> <len>
+ *   ...
+ *
+ *  All numbers are in hexadecimal.  As records are only ever appended a crash
+ *  can at worst leave a partial final line, which is ignored.
+ */
+
+#include "dump.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC       "forensic1394-dump journal 1"
+
+/// Size of the longest possible record, including the newline
+#define JOURNAL_RECORD_SZ   (2*16 + 2)
+
+struct _dump_journal
+{
+    int fd;
+
+    /// Records which are yet to be committed
+    char *buf;
+    size_t buflen, bufsz;
+    size_t npending;
+};
+
+static int cmp_extent(const void *a, const void *b);
+
+/**
+ * Writes all \a len bytes of \a buf to \a fd, retrying short writes.
+ */
+static int write_all(int fd, const char *buf, size_t len);
+
+/**
+ * Flushes \a fd to stable storage.
+ */
+static int sync_fd(int fd);
+
+/**
+ * Truncates the journal open on \a fd to its last complete record.  This
+ *  stops any partial record left by a crash from running into new records.
+ */
+static int trim_partial(int fd);
+
+int journal_load(const char *path, journal_info *info,
+                 extent **ext, size_t *next)
+{
+    FILE *f;
+    char line[256];
+    size_t n = 0, sz = 0, i, j;
+    extent *e = NULL;
+
+    if (!(f = fopen(path, "r")))
+    {
+        return -1;
+    }
+
+    // Validate the header
+    if (!fgets(line, sizeof(line), f)
+     || strncmp(line, JOURNAL_MAGIC " ", sizeof(JOURNAL_MAGIC)) != 0
+     || sscanf(line + sizeof(JOURNAL_MAGIC),
+               "guid %" SCNx64 " start %" SCNx64 " size %" SCNx64,
+               (uint64_t *) &info->guid, &info->start, &info->size) != 3)
+    {
+        fclose(f);
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        extent x;
+
+        // Stop at the first incomplete or malformed record
+        if (!strchr(line, '\n')
+         || sscanf(line, "%" SCNx64 " %" SCNx64, &x.addr, &x.len) != 2)
+        {
+            break;
+        }
+
+        if (n == sz)
+        {
+            extent *ne = realloc(e, sizeof(*e) * (sz = 2*sz + 64));
+
+            if (!ne)
+            {
+                free(e);
+                fclose(f);
+                return -1;
+            }
+
+            e = ne;
+        }
+
+        e[n++] = x;
+    }
+
+    fclose(f);
+
+    // Sort and then coalesce adjacent and overlapping extents
+    qsort(e, n, sizeof(*e), cmp_extent);
+
+    for (i = 0, j = 0; i < n; i++)
+    {
+        if (j > 0 && e[i].addr <= e[j - 1].addr + e[j - 1].len)
+        {
+            uint64_t end = e[i].addr + e[i].len;
+
+            if (end > e[j - 1].addr + e[j - 1].len)
+            {
+                e[j - 1].len = end - e[j - 1].addr;
+            }
+        }
+        else
+        {
+            e[j++] = e[i];
+        }
+    }
+
+    *ext = e;
+    *next = j;
+
+    return 0;
+}
+
+dump_journal *journal_open(const char *path, const journal_info *info,
+                           int resume)
+{
+    dump_journal *j = calloc(1, sizeof(*j));
+    int flags = O_RDWR | O_CREAT | O_APPEND;
+
+    if (!j)
+    {
+        return NULL;
+    }
+
+    if ((j->fd = open(path, flags | (resume ? 0 : O_TRUNC), 0644)) == -1)
+    {
+        free(j);
+        return NULL;
+    }
+
+    if (resume && trim_partial(j->fd) == -1)
+    {
+        int serrno = errno;
+        close(j->fd);
+        free(j);
+        errno = serrno;
+        return NULL;
+    }
+
+    // New journals need a header
+    if (!resume)
+    {
+        char hdr[128];
+        int len = snprintf(hdr, sizeof(hdr), JOURNAL_MAGIC " guid %016" PRIx64
+                           " start %" PRIx64 " size %" PRIx64 "\n",
+                           (uint64_t) info->guid, info->start, info->size);
+
+        if (write_all(j->fd, hdr, len) == -1 || sync_fd(j->fd) == -1)
+        {
+            int serrno = errno;
+            close(j->fd);
+            free(j);
+            errno = serrno;
+            return NULL;
+        }
+    }
+
+    return j;
+}
+
+int journal_add(dump_journal *j, uint64_t addr, uint64_t len)
+{
+    // Ensure there is space for the record (and snprintf's terminator)
+    if (j->buflen + JOURNAL_RECORD_SZ + 1 > j->bufsz)
+    {
+        size_t nsz = 2*j->bufsz + 64*JOURNAL_RECORD_SZ;
+        char *nbuf = realloc(j->buf, nsz);
+
+        if (!nbuf)
+        {
+            return -1;
+        }
+
+        j->buf = nbuf;
+        j->bufsz = nsz;
+    }
+
+    j->buflen += snprintf(j->buf + j->buflen, j->bufsz - j->buflen,
+                          "%" PRIx64 " %" PRIx64 "\n", addr, len);
+    j->npending++;
+
+    return 0;
+}
+
+size_t journal_pending(const dump_journal *j)
+{
+    return j->npending;
+}
+
+int journal_commit(dump_journal *j)
+{
+    if (j->buflen == 0)
+    {
+        return 0;
+    }
+
+    if (write_all(j->fd, j->buf, j->buflen) == -1 || sync_fd(j->fd) == -1)
+    {
+        return -1;
+    }
+
+    j->buflen = 0;
+    j->npending = 0;
+
+    return 0;
+}
+
+int journal_close(dump_journal *j)
+{
+    int ret = close(j->fd);
+
+    free(j->buf);
+    free(j);
+
+    return ret;
+}
+
+int cmp_extent(const void *a, const void *b)
+{
+    const extent *ea = a, *eb = b;
+
+    return (ea->addr > eb->addr) - (ea->addr < eb->addr);
+}
+
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write(fd, buf, len);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int trim_partial(int fd)
+{
+    char buf[256];
+    off_t size = lseek(fd, 0, SEEK_END), off;
+    ssize_t n, i;
+
+    if (size <= 0)
+    {
+        return size;
+    }
+
+    // Records are short so the last newline is near the end
+    off = (size > (off_t) sizeof(buf)) ? size - sizeof(buf) : 0;
+
+    if ((n = pread(fd, buf, size - off, off)) == -1)
+    {
+        return -1;
+    }
+
+    for (i = n; i > 0 && buf[i - 1] != '\n'; i--);
+
+    return (i == n) ? 0 : ftruncate(fd, off + i);
+}
+
+int sync_fd(int fd)
+{
+#ifdef __APPLE__
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
@@ -0,0 +1,167 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+#include "hash.h"
+
+#include <string.h>
+
+#define ROL(x, n) ((x) << (n) | (x) >> (32 - (n)))
+
+/// Per-round shift amounts
+static const int r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+/// Integer parts of abs(sin(i + 1)) * 2^32
+static const uint32_t k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+/**
+ * Processes the 64-byte block \a p.
+ */
+static void md5_block(uint32_t state[4], const uint8_t *p);
+
+void md5_init(md5_ctx *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->nbytes = 0;
+}
+
+void md5_update(md5_ctx *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t used = ctx->nbytes % 64;
+
+    ctx->nbytes += len;
+
+    // Top up any partial block
+    if (used)
+    {
+        size_t n = (len < 64 - used) ? len : 64 - used;
+
+        memcpy(ctx->block + used, p, n);
+        p += n;
+        len -= n;
+
+        if (used + n < 64)
+        {
+            return;
+        }
+
+        md5_block(ctx->state, ctx->block);
+    }
+
+    // Process whole blocks directly from the input
+    for (; len >= 64; p += 64, len -= 64)
+    {
+        md5_block(ctx->state, p);
+    }
+
+    memcpy(ctx->block, p, len);
+}
+
+void md5_final(md5_ctx *ctx, uint8_t digest[MD5_DIGEST_SZ])
+{
+    uint64_t nbits = ctx->nbytes * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t npad = 64 - (ctx->nbytes + 8) % 64;
+    int i;
+
+    // Pad to 56 mod 64 bytes and append the little-endian length in bits
+    for (i = 0; i < 8; i++)
+    {
+        pad[npad + i] = nbits >> 8*i;
+    }
+
+    md5_update(ctx, pad, npad + 8);
+
+    for (i = 0; i < 16; i++)
+    {
+        digest[i] = ctx->state[i / 4] >> 8*(i % 4);
+    }
+}
+
+void md5_block(uint32_t state[4], const uint8_t *p)
+{
+    uint32_t m[16], a = state[0], b = state[1], c = state[2], d = state[3];
+    int i;
+
+    for (i = 0; i < 16; i++)
+    {
+        m[i] = (uint32_t) p[4*i] | (uint32_t) p[4*i + 1] << 8
+             | (uint32_t) p[4*i + 2] << 16 | (uint32_t) p[4*i + 3] << 24;
+    }
+
+    for (i = 0; i < 64; i++)
+    {
+        uint32_t f, t;
+        int g;
+
+        if (i < 16)
+        {
+            f = (b & c) | (~b & d);
+            g = i;
+        }
+        else if (i < 32)
+        {
+            f = (d & b) | (~d & c);
+            g = (5*i + 1) % 16;
+        }
+        else if (i < 48)
+        {
+            f = b ^ c ^ d;
+            g = (3*i + 5) % 16;
+        }
+        else
+        {
+            f = c ^ (b | ~d);
+            g = (7*i) % 16;
+        }
+
+        t = d;
+        d = c;
+        c = b;
+        b = b + ROL(a + f + k[i] + m[g], r[i]);
+        a = t;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+}
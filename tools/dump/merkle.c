@@ -0,0 +1,62 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+#include "hash.h"
+
+/// Domain separation prefixes, preventing a leaf from passing as a node
+#define MERKLE_LEAF_PREFIX  0x00
+#define MERKLE_NODE_PREFIX  0x01
+
+void merkle_root(const uint8_t (*leaf)[SHA256_DIGEST_SZ], uint64_t n,
+                 uint8_t root[SHA256_DIGEST_SZ])
+{
+    sha256_ctx ctx;
+
+    sha256_init(&ctx);
+
+    if (n == 1)
+    {
+        uint8_t prefix = MERKLE_LEAF_PREFIX;
+
+        sha256_update(&ctx, &prefix, 1);
+        sha256_update(&ctx, leaf[0], SHA256_DIGEST_SZ);
+    }
+    else if (n > 1)
+    {
+        uint8_t prefix = MERKLE_NODE_PREFIX;
+        uint8_t left[SHA256_DIGEST_SZ], right[SHA256_DIGEST_SZ];
+        uint64_t k = 1;
+
+        // Find the largest power of two less than n
+        while (2*k < n)
+        {
+            k *= 2;
+        }
+
+        merkle_root(leaf, k, left);
+        merkle_root(leaf + k, n - k, right);
+
+        sha256_update(&ctx, &prefix, 1);
+        sha256_update(&ctx, left, SHA256_DIGEST_SZ);
+        sha256_update(&ctx, right, SHA256_DIGEST_SZ);
+    }
+
+    // An empty tree is the hash of nothing at all
+    sha256_final(&ctx, root);
+}
@@ -0,0 +1,283 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+#include "dump.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef FORENSIC1394_DUMP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+struct _dump_output
+{
+    output_format format;
+
+    int fd;
+
+    /// If the output is a stream (pipe or terminal) and so must use write
+    int stream;
+
+#ifdef FORENSIC1394_DUMP_HAVE_ZLIB
+    gzFile gz;
+#endif
+};
+
+/**
+ * Writes all \a len bytes of \a buf to \a out at \a off, retrying short
+ *  writes.
+ */
+static int write_all(dump_output *out, uint64_t off,
+                     const char *buf, size_t len);
+
+dump_output *output_open(const char *path, output_format format,
+                         int resume, uint64_t *resume_off)
+{
+    dump_output *out;
+    struct stat st;
+    int flags = O_WRONLY | O_CREAT;
+
+#ifndef FORENSIC1394_DUMP_HAVE_ZLIB
+    if (format == OUTPUT_ZLIB)
+    {
+        errno = ENOTSUP;
+        return NULL;
+    }
+#endif
+
+    // There is no way to tell how much data a compressed image holds
+    if (resume && format == OUTPUT_ZLIB)
+    {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    out = calloc(1, sizeof(*out));
+
+    if (!out)
+    {
+        return NULL;
+    }
+
+    out->format = format;
+
+    if (strcmp(path, "-") == 0)
+    {
+        out->fd = dup(STDOUT_FILENO);
+    }
+    else
+    {
+        out->fd = open(path, flags | (resume ? 0 : O_TRUNC), 0644);
+    }
+
+    if (out->fd == -1 || fstat(out->fd, &st) == -1)
+    {
+        goto err;
+    }
+
+    out->stream = !S_ISREG(st.st_mode);
+
+    // Streams can neither be resumed nor have holes
+    if (out->stream && (resume || format == OUTPUT_SPARSE))
+    {
+        errno = ESPIPE;
+        goto err;
+    }
+
+    if (resume)
+    {
+        *resume_off = st.st_size;
+    }
+
+#ifdef FORENSIC1394_DUMP_HAVE_ZLIB
+    if (format == OUTPUT_ZLIB)
+    {
+        // Favour speed over size; the bus is the bottleneck, not the disk
+        if (!(out->gz = gzdopen(out->fd, "wb1")))
+        {
+            goto err;
+        }
+
+        gzbuffer(out->gz, 1 << 20);
+    }
+#endif
+
+    return out;
+
+err:
+    if (out->fd != -1)
+    {
+        int serrno = errno;
+        close(out->fd);
+        errno = serrno;
+    }
+
+    free(out);
+    return NULL;
+}
+
+int output_write(dump_output *out, uint64_t off, const void *buf, size_t len)
+{
+#ifdef FORENSIC1394_DUMP_HAVE_ZLIB
+    if (out->format == OUTPUT_ZLIB)
+    {
+        const char *cbuf = buf;
+
+        while (len)
+        {
+            // gzwrite takes an unsigned int length
+            unsigned n = len > (1U << 30) ? (1U << 30) : len;
+
+            if (gzwrite(out->gz, cbuf, n) != (int) n)
+            {
+                errno = EIO;
+                return -1;
+            }
+
+            cbuf += n;
+            len -= n;
+        }
+
+        return 0;
+    }
+#endif
+
+    // Leave all-zero chunks as holes in sparse images
+    if (out->format == OUTPUT_SPARSE && is_zero(buf, len))
+    {
+        return 0;
+    }
+
+    return write_all(out, off, buf, len);
+}
+
+int output_sync(dump_output *out)
+{
+#ifdef FORENSIC1394_DUMP_HAVE_ZLIB
+    if (out->format == OUTPUT_ZLIB)
+    {
+        return (gzflush(out->gz, Z_SYNC_FLUSH) == Z_OK) ? 0 : -1;
+    }
+#endif
+
+    if (out->stream)
+    {
+        return 0;
+    }
+
+#ifdef __APPLE__
+    return fsync(out->fd);
+#else
+    return fdatasync(out->fd);
+#endif
+}
+
+int output_close(dump_output *out, uint64_t size)
+{
+    int ret = 0;
+
+#ifdef FORENSIC1394_DUMP_HAVE_ZLIB
+    if (out->format == OUTPUT_ZLIB)
+    {
+        // gzclose also closes the underlying descriptor
+        ret = (gzclose(out->gz) == Z_OK) ? 0 : -1;
+        free(out);
+        return ret;
+    }
+#endif
+
+    // Trailing holes in sparse images need the file to be extended
+    if (!out->stream)
+    {
+        struct stat st;
+
+        if (fstat(out->fd, &st) == 0 && (uint64_t) st.st_size < size)
+        {
+            ret = ftruncate(out->fd, size);
+        }
+    }
+
+    if (close(out->fd) == -1)
+    {
+        ret = -1;
+    }
+
+    free(out);
+    return ret;
+}
+
+int output_rewrite(dump_output *out, uint64_t off, const void *buf,
+                   size_t len)
+{
+    // Only flat images support random writes
+    if (out->stream || out->format == OUTPUT_ZLIB)
+    {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    // Unlike output_write zeros must be written out to replace the old data
+    return write_all(out, off, buf, len);
+}
+
+int is_zero(const void *buf, size_t len)
+{
+    const char *cbuf = buf;
+
+    // If the first byte is zero and every byte equals its successor
+    return len == 0 || (cbuf[0] == 0 && memcmp(cbuf, cbuf + 1, len - 1) == 0);
+}
+
+int write_all(dump_output *out, uint64_t off, const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n;
+
+        if (out->stream)
+        {
+            n = write(out->fd, buf, len);
+        }
+        else
+        {
+            n = pwrite(out->fd, buf, len, off);
+        }
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        buf += n;
+        off += n;
+        len -= n;
+    }
+
+    return 0;
+}
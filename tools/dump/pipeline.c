@@ -0,0 +1,282 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Chunks are passed from the reader to the stages through a ring of buffers.
+ *  The reader fills the buffer after the last one published; a buffer only
+ *  becomes free again once every stage has consumed it.  As each stage keeps
+ *  its own position in the ring the slowest stage bounds the throughput,
+ *  rather than the sum of them.
+ */
+
+#include "dump.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+/// Number of chunk buffers in the ring
+#define PIPELINE_NBUF       8
+
+/// Maximum number of stages in a pipeline
+#define PIPELINE_MAX_STAGES 32
+
+typedef struct
+{
+    pipeline *p;
+    int idx;
+    pthread_t thread;
+} stage_thread;
+
+struct _pipeline
+{
+    chunk slot[PIPELINE_NBUF];
+
+    /// Number of chunks published by the reader
+    uint64_t tail;
+
+    stage stages[PIPELINE_MAX_STAGES];
+    stage_thread threads[PIPELINE_MAX_STAGES];
+    int nstage;
+
+    /// Number of chunks consumed by each stage
+    uint64_t head[PIPELINE_MAX_STAGES];
+
+    /// Set by the reader once the final chunk has been published
+    int done;
+
+    /// If the reader published every chunk it set out to
+    int complete;
+
+    /// Set, to an errno value, should a stage fail
+    int error;
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+};
+
+static void *stage_main(void *arg);
+
+/**
+ * Returns the number of chunks consumed by the slowest stage.  The lock must
+ *  be held.
+ */
+static uint64_t min_head(const pipeline *p);
+
+pipeline *pipeline_alloc(size_t chunksz)
+{
+    pipeline *p = calloc(1, sizeof(*p));
+    int i;
+
+    if (!p)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < PIPELINE_NBUF; i++)
+    {
+        if (!(p->slot[i].buf = malloc(chunksz)))
+        {
+            pipeline_free(p);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->filled, NULL);
+    pthread_cond_init(&p->emptied, NULL);
+
+    return p;
+}
+
+int pipeline_add_stage(pipeline *p, const stage *s)
+{
+    if (p->nstage == PIPELINE_MAX_STAGES)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    p->stages[p->nstage++] = *s;
+
+    return 0;
+}
+
+int pipeline_start(pipeline *p)
+{
+    int i;
+
+    for (i = 0; i < p->nstage; i++)
+    {
+        p->threads[i].p = p;
+        p->threads[i].idx = i;
+
+        if ((errno = pthread_create(&p->threads[i].thread, NULL, stage_main,
+                                    &p->threads[i])))
+        {
+            // Have any stages which did start exit
+            p->nstage = i;
+            pipeline_finish(p, 0);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+chunk *pipeline_get_free(pipeline *p)
+{
+    chunk *c = NULL;
+
+    pthread_mutex_lock(&p->lock);
+
+    while (p->tail - min_head(p) == PIPELINE_NBUF && !p->error)
+    {
+        pthread_cond_wait(&p->emptied, &p->lock);
+    }
+
+    if (!p->error)
+    {
+        c = &p->slot[p->tail % PIPELINE_NBUF];
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return c;
+}
+
+void pipeline_publish(pipeline *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->tail++;
+    pthread_cond_broadcast(&p->filled);
+    pthread_mutex_unlock(&p->lock);
+}
+
+int pipeline_finish(pipeline *p, int complete)
+{
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    p->done = 1;
+    p->complete = complete;
+    pthread_cond_broadcast(&p->filled);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < p->nstage; i++)
+    {
+        pthread_join(p->threads[i].thread, NULL);
+    }
+
+    p->nstage = 0;
+
+    return p->error;
+}
+
+void pipeline_free(pipeline *p)
+{
+    int i;
+
+    for (i = 0; i < PIPELINE_NBUF; i++)
+    {
+        free(p->slot[i].buf);
+    }
+
+    pthread_cond_destroy(&p->emptied);
+    pthread_cond_destroy(&p->filled);
+    pthread_mutex_destroy(&p->lock);
+
+    free(p);
+}
+
+void *stage_main(void *arg)
+{
+    stage_thread *t = arg;
+    pipeline *p = t->p;
+    stage *s = &p->stages[t->idx];
+    int failed = 0, complete;
+
+    pthread_mutex_lock(&p->lock);
+
+    for (;;)
+    {
+        chunk *c;
+
+        while (p->head[t->idx] == p->tail && !p->done && !p->error)
+        {
+            pthread_cond_wait(&p->filled, &p->lock);
+        }
+
+        // Stop once drained, or straight away if another stage has failed
+        if (p->head[t->idx] == p->tail || p->error)
+        {
+            break;
+        }
+
+        c = &p->slot[p->head[t->idx] % PIPELINE_NBUF];
+
+        // Process the chunk without holding the lock
+        pthread_mutex_unlock(&p->lock);
+
+        failed = (s->process(s->ctx, c) == -1);
+
+        pthread_mutex_lock(&p->lock);
+
+        if (failed)
+        {
+            p->error = p->error ? p->error : errno;
+            pthread_cond_broadcast(&p->filled);
+            pthread_cond_signal(&p->emptied);
+            break;
+        }
+
+        p->head[t->idx]++;
+
+        pthread_cond_signal(&p->emptied);
+    }
+
+    complete = p->complete && !p->error;
+
+    pthread_mutex_unlock(&p->lock);
+
+    // Let the stage wrap up; this happens even after a failure
+    if (s->finish && s->finish(s->ctx, complete) == -1)
+    {
+        pthread_mutex_lock(&p->lock);
+        p->error = p->error ? p->error : errno;
+        pthread_cond_signal(&p->emptied);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    return NULL;
+}
+
+uint64_t min_head(const pipeline *p)
+{
+    uint64_t h = p->tail;
+    int i;
+
+    for (i = 0; i < p->nstage; i++)
+    {
+        h = (p->head[i] < h) ? p->head[i] : h;
+    }
+
+    return h;
+}
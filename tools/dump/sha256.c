@@ -0,0 +1,207 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+#include "hash.h"
+
+#include <string.h>
+
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * Processes the 64-byte block \a p.
+ */
+static void sha256_block(uint32_t state[8], const uint8_t *p);
+
+void sha256_init(sha256_ctx *ctx)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->nbytes = 0;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t used = ctx->nbytes % 64;
+
+    ctx->nbytes += len;
+
+    // Top up any partial block
+    if (used)
+    {
+        size_t n = (len < 64 - used) ? len : 64 - used;
+
+        memcpy(ctx->block + used, p, n);
+        p += n;
+        len -= n;
+
+        if (used + n < 64)
+        {
+            return;
+        }
+
+        sha256_block(ctx->state, ctx->block);
+    }
+
+    // Process whole blocks directly from the input
+    for (; len >= 64; p += 64, len -= 64)
+    {
+        sha256_block(ctx->state, p);
+    }
+
+    memcpy(ctx->block, p, len);
+}
+
+void sha256_final(sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SZ])
+{
+    uint64_t nbits = ctx->nbytes * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t npad = 64 - (ctx->nbytes + 8) % 64;
+    int i;
+
+    // Pad to 56 mod 64 bytes and append the big-endian length in bits
+    for (i = 0; i < 8; i++)
+    {
+        pad[npad + i] = nbits >> (56 - 8*i);
+    }
+
+    sha256_update(ctx, pad, npad + 8);
+
+    for (i = 0; i < 32; i++)
+    {
+        digest[i] = ctx->state[i / 4] >> (24 - 8*(i % 4));
+    }
+}
+
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SZ])
+{
+    sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+void sha256_block(uint32_t state[8], const uint8_t *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t) p[4*i] << 24 | (uint32_t) p[4*i + 1] << 16
+             | (uint32_t) p[4*i + 2] << 8 | p[4*i + 3];
+    }
+
+    for (i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for (i = 0; i < 64; i++)
+    {
+        uint32_t s1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + k[i] + w[i];
+        uint32_t s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void hash_hex(const uint8_t *digest, size_t len, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        hex[2*i] = digits[digest[i] >> 4];
+        hex[2*i + 1] = digits[digest[i] & 0xf];
+    }
+
+    hex[2*len] = '\0';
+}
+
+int hash_unhex(const char *hex, size_t len, uint8_t *digest)
+{
+    size_t i;
+
+    for (i = 0; i < 2*len; i++)
+    {
+        int c = hex[i], v;
+
+        if (c >= '0' && c <= '9')
+        {
+            v = c - '0';
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            v = c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            v = c - 'A' + 10;
+        }
+        else
+        {
+            return -1;
+        }
+
+        digest[i / 2] = (i % 2) ? digest[i / 2] | v : v << 4;
+    }
+
+    // The digest must be exactly the right length
+    return (hex[2*len] == '\0' || hex[2*len] == '\n') ? 0 : -1;
+}
@@ -0,0 +1,373 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Smear reduction.  As the target keeps running while it is acquired the
+ *  pages of an image are captured at different times, some having changed
+ *  in the meantime.  A cheap hash of each page is recorded as it is
+ *  acquired; further passes then re-read pages, rewriting those whose hash
+ *  has changed, until few enough do.
+ *
+ * The time at which the contents of each page were last seen on the target
+ *  is written out as a list of runs of pages:
+ *
+ *   # forensic1394-dump page times 1
+ *   epoch <unix time>
+ *   page-size <bytes>
+ *   <addr> <len> <ms> [changing]
+ *   ...
+ *
+ *  Addresses and lengths are in hexadecimal, with times in decimal
+ *  milliseconds since the epoch.  Pages still changing when the last pass
+ *  finished are marked as such, while those acquired by an earlier run and
+ *  not since re-read have a time of '-'.
+ */
+
+#include "dump.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// The page hash has been recorded
+#define SMEAR_KNOWN     0x1
+
+/// The page changed when it was last re-read
+#define SMEAR_CHANGED   0x2
+
+/// The page has been read by this run and so has a time
+#define SMEAR_TIMED     0x4
+
+/// Flags which must match for pages to be part of the same run of times
+#define SMEAR_RUN_MASK  (SMEAR_CHANGED | SMEAR_TIMED)
+
+struct _dump_smear
+{
+    uint64_t start, size, pagesz, npage;
+
+    uint64_t *hash;
+    uint32_t *time;
+    uint8_t *flags;
+};
+
+/**
+ * A fast, non-cryptographic, hash of \a len bytes at \a buf.
+ */
+static uint64_t page_hash(const char *buf, size_t len);
+
+static int process_pages(void *ctx, const chunk *c);
+
+static uint64_t page_len(const dump_smear *sm, uint64_t page);
+
+dump_smear *smear_alloc(uint64_t start, uint64_t size, uint64_t pagesz)
+{
+    dump_smear *sm = calloc(1, sizeof(*sm));
+
+    if (!sm)
+    {
+        return NULL;
+    }
+
+    sm->start = start;
+    sm->size = size;
+    sm->pagesz = pagesz;
+    sm->npage = (size + pagesz - 1) / pagesz;
+
+    sm->hash = calloc(sm->npage ? sm->npage : 1, sizeof(*sm->hash));
+    sm->time = calloc(sm->npage ? sm->npage : 1, sizeof(*sm->time));
+    sm->flags = calloc(sm->npage ? sm->npage : 1, sizeof(*sm->flags));
+
+    if (!sm->hash || !sm->time || !sm->flags)
+    {
+        smear_free(sm);
+        return NULL;
+    }
+
+    return sm;
+}
+
+void smear_get_stage(dump_smear *sm, stage *s)
+{
+    s->process = process_pages;
+    s->finish = NULL;
+    s->ctx = sm;
+}
+
+int smear_fill(dump_smear *sm, const char *path)
+{
+    char *buf = NULL;
+    uint64_t i;
+    int fd = -1;
+
+    for (i = 0; i < sm->npage; i++)
+    {
+        uint64_t len = page_len(sm, i);
+        ssize_t got;
+
+        if (sm->flags[i] & SMEAR_KNOWN)
+        {
+            continue;
+        }
+
+        // Only open the image once there is something to read
+        if (fd == -1)
+        {
+            if ((fd = open(path, O_RDONLY)) == -1
+             || !(buf = malloc(sm->pagesz)))
+            {
+                int serrno = errno;
+
+                if (fd != -1)
+                {
+                    close(fd);
+                }
+
+                errno = serrno;
+                return -1;
+            }
+        }
+
+        // Pages are small enough that a short read means the end of file
+        if ((got = pread(fd, buf, len, i*sm->pagesz)) == -1)
+        {
+            int serrno = errno;
+
+            close(fd);
+            free(buf);
+
+            errno = serrno;
+            return -1;
+        }
+
+        memset(buf + got, 0, len - got);
+
+        sm->hash[i] = page_hash(buf, len);
+        sm->flags[i] |= SMEAR_KNOWN;
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+int64_t smear_update(dump_smear *sm, const chunk *c, dump_output *out)
+{
+    uint64_t page = (c->addr - sm->start) / sm->pagesz;
+    uint64_t off = 0;
+    int64_t nchanged = 0;
+
+    while (off < c->len)
+    {
+        uint64_t len = page_len(sm, page);
+        uint64_t h = page_hash(c->buf + off, len);
+
+        if (h != sm->hash[page])
+        {
+            if (output_rewrite(out, c->addr - sm->start + off, c->buf + off,
+                               len) == -1)
+            {
+                return -1;
+            }
+
+            sm->hash[page] = h;
+            sm->flags[page] |= SMEAR_CHANGED;
+            nchanged++;
+        }
+        else
+        {
+            sm->flags[page] &= ~SMEAR_CHANGED;
+        }
+
+        sm->time[page] = c->when;
+        sm->flags[page] |= SMEAR_TIMED;
+
+        off += len;
+        page++;
+    }
+
+    return nchanged;
+}
+
+extent *smear_changed(const dump_smear *sm, size_t *next)
+{
+    extent *ext;
+    uint64_t i;
+    size_t n = 0;
+
+    // Count the runs first so that the list can be allocated in one go
+    for (i = 0; i < sm->npage; i++)
+    {
+        n += (sm->flags[i] & SMEAR_CHANGED)
+          && (i == 0 || !(sm->flags[i - 1] & SMEAR_CHANGED));
+    }
+
+    if (!(ext = malloc(sizeof(*ext) * (n ? n : 1))))
+    {
+        return NULL;
+    }
+
+    for (i = 0, n = 0; i < sm->npage; i++)
+    {
+        if (!(sm->flags[i] & SMEAR_CHANGED))
+        {
+            continue;
+        }
+
+        // Either extend the current run or start a new one
+        if (i > 0 && (sm->flags[i - 1] & SMEAR_CHANGED))
+        {
+            ext[n - 1].len += page_len(sm, i);
+        }
+        else
+        {
+            ext[n].addr = sm->start + i*sm->pagesz;
+            ext[n].len = page_len(sm, i);
+            n++;
+        }
+    }
+
+    *next = n;
+    return ext;
+}
+
+int smear_write_times(const dump_smear *sm, const char *path, time_t epoch)
+{
+    FILE *f = fopen(path, "w");
+    uint64_t i, first;
+    char when[16];
+
+    if (!f)
+    {
+        return -1;
+    }
+
+    fprintf(f, "# forensic1394-dump page times 1\n");
+    fprintf(f, "epoch %lld\n", (long long) epoch);
+    fprintf(f, "page-size %" PRIx64 "\n", sm->pagesz);
+
+    // Coalesce runs of pages with the same time and state
+    for (first = 0, i = 1; first < sm->npage; i++)
+    {
+        if (i < sm->npage && sm->time[i] == sm->time[first]
+         && (sm->flags[i] & SMEAR_RUN_MASK)
+         == (sm->flags[first] & SMEAR_RUN_MASK))
+        {
+            continue;
+        }
+
+        if (sm->flags[first] & SMEAR_TIMED)
+        {
+            snprintf(when, sizeof(when), "%" PRIu32, sm->time[first]);
+        }
+        else
+        {
+            strcpy(when, "-");
+        }
+
+        fprintf(f, "%" PRIx64 " %" PRIx64 " %s%s\n",
+                sm->start + first*sm->pagesz,
+                (i == sm->npage) ? sm->size - first*sm->pagesz
+                                 : (i - first)*sm->pagesz,
+                when,
+                (sm->flags[first] & SMEAR_CHANGED) ? " changing" : "");
+
+        first = i;
+    }
+
+    if (fflush(f) == EOF || fsync(fileno(f)) == -1)
+    {
+        int serrno = errno;
+        fclose(f);
+        errno = serrno;
+        return -1;
+    }
+
+    return (fclose(f) == EOF) ? -1 : 0;
+}
+
+void smear_free(dump_smear *sm)
+{
+    free(sm->flags);
+    free(sm->time);
+    free(sm->hash);
+    free(sm);
+}
+
+uint64_t page_hash(const char *buf, size_t len)
+{
+    uint64_t h = len, w;
+    size_t i;
+
+    // Mix in a word at a time, with any trailing bytes as a final word
+    for (i = 0; i + 8 <= len; i += 8)
+    {
+        memcpy(&w, buf + i, 8);
+        h = (h ^ w) * UINT64_C(0x9e3779b97f4a7c15);
+        h ^= h >> 29;
+    }
+
+    if (i < len)
+    {
+        w = 0;
+        memcpy(&w, buf + i, len - i);
+        h = (h ^ w) * UINT64_C(0x9e3779b97f4a7c15);
+        h ^= h >> 29;
+    }
+
+    return h;
+}
+
+int process_pages(void *ctx, const chunk *c)
+{
+    dump_smear *sm = ctx;
+    uint64_t off = c->addr - sm->start, end = off + c->len;
+    uint64_t page = (off + sm->pagesz - 1) / sm->pagesz;
+
+    // Only whole pages can be hashed; the rest are left to smear_fill
+    for (; page < sm->npage; page++)
+    {
+        uint64_t poff = page*sm->pagesz, len = page_len(sm, page);
+
+        if (poff + len > end)
+        {
+            break;
+        }
+
+        sm->hash[page] = page_hash(c->buf + (poff - off), len);
+        sm->time[page] = c->when;
+        sm->flags[page] |= SMEAR_KNOWN | SMEAR_TIMED;
+    }
+
+    return 0;
+}
+
+uint64_t page_len(const dump_smear *sm, uint64_t page)
+{
+    uint64_t off = page*sm->pagesz;
+
+    return (sm->size - off < sm->pagesz) ? sm->size - off : sm->pagesz;
+}
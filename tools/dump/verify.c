@@ -0,0 +1,242 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Verification of segments against a hash manifest.  As segments are
+ *  independent of one another they are spread over a number of workers, with
+ *  worker i checking segments i, i + n, ...; where they come from, be it the
+ *  image or the live device, is up to the reader.
+ */
+
+#include "dump.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MANIFEST_MAGIC      "# forensic1394-dump hash manifest 1\n"
+
+/// Size of the longest line in a manifest we care about
+#define MANIFEST_LINE_SZ    256
+
+typedef struct
+{
+    dump_verifier *v;
+    int idx;
+} verify_worker;
+
+struct _dump_verifier
+{
+    const dump_manifest *m;
+
+    /// Non-zero for each segment found not to match
+    char *mismatch;
+
+    int nworker;
+    verify_worker *worker;
+};
+
+static int process_verify(void *ctx, const chunk *c);
+
+dump_manifest *manifest_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    dump_manifest *m;
+    char line[MANIFEST_LINE_SZ], hex[MANIFEST_LINE_SZ];
+    uint8_t root[SHA256_DIGEST_SZ];
+    uint64_t n = 0, v;
+    int have_root = 0;
+
+    if (!f)
+    {
+        return NULL;
+    }
+
+    if (!(m = calloc(1, sizeof(*m))))
+    {
+        fclose(f);
+        return NULL;
+    }
+
+    if (!fgets(line, sizeof(line), f) || strcmp(line, MANIFEST_MAGIC) != 0)
+    {
+        goto invalid;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "guid %" SCNx64, &v) == 1)
+        {
+            m->guid = v;
+        }
+        else if (sscanf(line, "start %" SCNx64, &m->start) == 1
+              || sscanf(line, "size %" SCNx64, &m->size) == 1
+              || sscanf(line, "segment-size %" SCNx64, &m->segsz) == 1)
+        {
+            continue;
+        }
+        else if (sscanf(line, "merkle-root %255s", hex) == 1)
+        {
+            if (hash_unhex(hex, SHA256_DIGEST_SZ, m->root) == -1)
+            {
+                goto invalid;
+            }
+
+            have_root = 1;
+        }
+        else if (sscanf(line, "segment %" SCNx64 " %255s", &v, hex) == 2)
+        {
+            // The range and segment size come first
+            if (!m->seg)
+            {
+                if (!m->segsz)
+                {
+                    goto invalid;
+                }
+
+                m->nseg = (m->size + m->segsz - 1) / m->segsz;
+
+                if (!(m->seg = calloc(m->nseg ? m->nseg : 1,
+                                      sizeof(*m->seg))))
+                {
+                    manifest_free(m);
+                    fclose(f);
+                    return NULL;
+                }
+            }
+
+            // Segments are listed in order without gaps
+            if (n == m->nseg || v != m->start + n*m->segsz
+             || hash_unhex(hex, SHA256_DIGEST_SZ, m->seg[n]) == -1)
+            {
+                goto invalid;
+            }
+
+            n++;
+        }
+        // Anything else is a comment or a field we do not need
+    }
+
+    if (!have_root || !m->segsz || n != (m->size + m->segsz - 1) / m->segsz)
+    {
+        goto invalid;
+    }
+
+    fclose(f);
+
+    // Make sure the segment hashes are those the manifest was written with
+    merkle_root((const uint8_t (*)[SHA256_DIGEST_SZ]) m->seg, m->nseg, root);
+
+    if (memcmp(root, m->root, SHA256_DIGEST_SZ) != 0)
+    {
+        manifest_free(m);
+        errno = EBADMSG;
+        return NULL;
+    }
+
+    return m;
+
+invalid:
+    manifest_free(m);
+    fclose(f);
+    errno = EINVAL;
+    return NULL;
+}
+
+void manifest_free(dump_manifest *m)
+{
+    free(m->seg);
+    free(m);
+}
+
+dump_verifier *verify_alloc(const dump_manifest *m, int nworker)
+{
+    dump_verifier *v = calloc(1, sizeof(*v));
+    int i;
+
+    if (!v)
+    {
+        return NULL;
+    }
+
+    v->m = m;
+    v->nworker = nworker;
+    v->mismatch = calloc(m->nseg ? m->nseg : 1, 1);
+    v->worker = calloc(nworker, sizeof(*v->worker));
+
+    if (!v->mismatch || !v->worker)
+    {
+        verify_free(v);
+        return NULL;
+    }
+
+    for (i = 0; i < nworker; i++)
+    {
+        v->worker[i].v = v;
+        v->worker[i].idx = i;
+    }
+
+    return v;
+}
+
+int verify_nstages(const dump_verifier *v)
+{
+    return v->nworker;
+}
+
+void verify_get_stage(dump_verifier *v, int i, stage *s)
+{
+    s->process = process_verify;
+    s->finish = NULL;
+    s->ctx = &v->worker[i];
+}
+
+int verify_mismatch(const dump_verifier *v, uint64_t seg)
+{
+    return v->mismatch[seg];
+}
+
+void verify_free(dump_verifier *v)
+{
+    free(v->worker);
+    free(v->mismatch);
+    free(v);
+}
+
+int process_verify(void *ctx, const chunk *c)
+{
+    verify_worker *w = ctx;
+    const dump_manifest *m = w->v->m;
+    uint64_t seg = (c->addr - m->start) / m->segsz;
+    uint8_t digest[SHA256_DIGEST_SZ];
+
+    // See if the segment is ours
+    if (seg % w->v->nworker != (uint64_t) w->idx)
+    {
+        return 0;
+    }
+
+    sha256(c->buf, c->len, digest);
+
+    // Each worker sets distinct flags so no locking is required
+    w->v->mismatch[seg] = (memcmp(digest, m->seg[seg], SHA256_DIGEST_SZ) != 0);
+
+    return 0;
+}
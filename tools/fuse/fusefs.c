@@ -0,0 +1,1251 @@
+/*
+    This file is part of libforensic1394.
+    Copyright (C) 2010  Freddie Witherden <freddie@witherden.org>
+
+    libforensic1394 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    libforensic1394 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with libforensic1394.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * forensic1394-fuse: exposes the memory of FireWire devices as files.
+ *
+ * Each device attached to the bus appears as a read-only file, named by its
+ *  GUID, whose contents are the memory of the device.  Reads are served from a
+ *  cache of blocks, each read from the device as a single vectored request.
+ *  When reads run sequentially a thread per device reads the blocks which
+ *  follow ahead of time, so that the bus is kept busy while the blocks
+ *  already read are being consumed.  Parts of memory found to be unreadable
+ *  read as zeros and are listed in a second file, GUID.holes; they are not
+ *  requested of the device again.
+ *
+ * FUSE requests are handled by many threads; as such the devices are opened
+ *  with an I/O thread of their own, through which all requests are made.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include "forensic1394.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// Default size of the files; the limit of most physical DMA filters
+#define FUSE_DEFAULT_SIZE       (UINT64_C(4) << 30)
+
+/// Default size of a cache block, read as a single vectored request
+#define FUSE_DEFAULT_BLOCK      (1 << 20)
+
+/// Default number of blocks cached per device
+#define FUSE_DEFAULT_NBLOCK     16
+
+/// Default number of blocks read ahead of a sequential reader
+#define FUSE_DEFAULT_DEPTH      4
+
+/// Default time for which a cached block remains valid
+#define FUSE_DEFAULT_TTL_MS     1000
+
+/// Number of times a failed block is retried before reading it piecemeal
+#define FUSE_RETRIES            3
+
+/// How long to wait for a device to become ready after a bus reset
+#define FUSE_READY_TIMEOUT_MS   5000
+
+/// Suffix of the files listing the holes of each device
+#define FUSE_HOLES_SUFFIX       ".holes"
+
+/// Length of a line of a holes file
+#define FUSE_HOLES_LINE         34
+
+typedef enum
+{
+    BLOCK_EMPTY,
+    BLOCK_LOADING,
+    BLOCK_READY
+} block_state;
+
+/**
+ * A block of device memory held in the cache.
+ */
+typedef struct
+{
+    uint64_t addr;
+    block_state state;
+
+    /// Number of readers copying out of the block; it is not evicted if set
+    int pins;
+
+    /// When the block was read, and when it was last used
+    struct timespec loaded;
+    uint64_t used;
+
+    char *buf;
+} cache_block;
+
+/**
+ * A range of device addresses.
+ */
+typedef struct
+{
+    uint64_t addr;
+    uint64_t len;
+} extent;
+
+typedef struct _fuse_state fuse_state;
+
+/**
+ * A device exposed by the filesystem.
+ */
+typedef struct
+{
+    fuse_state *fs;
+    forensic1394_dev *dev;
+
+    char name[17];
+    char holes_name[17 + sizeof(FUSE_HOLES_SUFFIX)];
+
+    /// If the device could be opened
+    int open;
+
+    /// Guards everything below
+    pthread_mutex_t lock;
+
+    /// Broadcast whenever a block finishes loading
+    pthread_cond_t loaded;
+
+    /// Signalled when there are blocks to read ahead, or when stopping
+    pthread_cond_t wanted;
+
+    cache_block *blocks;
+    uint64_t tick;
+
+    /// The block last read from; a read of the block after it is sequential
+    uint64_t last;
+
+    /// Blocks [pf_next, pf_end) are to be read ahead
+    uint64_t pf_next;
+    uint64_t pf_end;
+
+    pthread_t thread;
+    int has_thread;
+    int stop;
+
+    /// Sorted, disjoint, ranges found to be unreadable
+    extent *holes;
+    size_t nholes;
+    size_t holesz;
+} fuse_target;
+
+struct _fuse_state
+{
+    /// Options; strings are as given on the command line
+    char *size_str;
+    char *block_str;
+    int nblock;
+    int depth;
+    int ttl_ms;
+    int sbp2;
+
+    /// If help was asked for; FUSE then prints its own and exits
+    int help;
+
+    uint64_t size;
+    size_t block;
+
+    forensic1394_bus *bus;
+
+    fuse_target *targets;
+    int ntarget;
+};
+
+/**
+ * The contents of an open holes file; taken when the file is opened so that
+ *  readers see a consistent list.
+ */
+typedef struct
+{
+    size_t len;
+    char data[];
+} holes_text;
+
+enum
+{
+    KEY_HELP
+};
+
+static const struct fuse_opt fs_opts[] = {
+    { "size=%s",   offsetof(fuse_state, size_str),  0 },
+    { "block=%s",  offsetof(fuse_state, block_str), 0 },
+    { "blocks=%d", offsetof(fuse_state, nblock),    0 },
+    { "depth=%d",  offsetof(fuse_state, depth),     0 },
+    { "ttl=%d",    offsetof(fuse_state, ttl_ms),    0 },
+    { "sbp2",      offsetof(fuse_state, sbp2),      1 },
+    FUSE_OPT_KEY("-h",      KEY_HELP),
+    FUSE_OPT_KEY("--help",  KEY_HELP),
+    FUSE_OPT_END
+};
+
+/**
+ * Parses a size, optionally suffixed with k, m or g (binary multiples).
+ *
+ *  \return 0 on success, -1 if \a s is not a valid size.
+ */
+static int parse_size(const char *s, uint64_t *size);
+
+static void usage(const char *argv0);
+
+static int opt_proc(void *data, const char *arg, int key,
+                    struct fuse_args *outargs);
+
+/**
+ * Finds the target whose memory, or with \a holes non-zero whose holes file,
+ *  is at \a path.
+ *
+ *  \return The target or NULL if there is none.
+ */
+static fuse_target *find_target(fuse_state *fs, const char *path, int *holes);
+
+/**
+ * Sets up \a t for the device \a dev, allocating its cache.
+ *
+ *  \return 0 on success or -1 if memory could not be allocated.
+ */
+static int target_init(fuse_target *t, fuse_state *fs, forensic1394_dev *dev);
+
+static void target_free(fuse_target *t);
+
+/**
+ * Returns the block of \a t at \a addr, reading it should it not be cached
+ *  or have expired.  The block is pinned and must be released through
+ *  ::put_block.  The lock must be held.
+ *
+ *  \return The block or NULL if the device could not be read.
+ */
+static cache_block *get_block(fuse_target *t, uint64_t addr);
+
+static void put_block(fuse_target *t, cache_block *b);
+
+/**
+ * Returns the cached block of \a t at \a addr, or NULL if there is none.  The
+ *  lock must be held.
+ */
+static cache_block *find_block(fuse_target *t, uint64_t addr);
+
+/**
+ * Picks a block of \a t to be evicted, or NULL should all be in use.  The
+ *  lock must be held.
+ */
+static cache_block *victim_block(fuse_target *t);
+
+/**
+ * Returns non-zero if \a b was read within the lifetime of a block.
+ */
+static int is_fresh(const fuse_target *t, const cache_block *b);
+
+/**
+ * Reads \a b in from address \a addr of the device.  The lock must be held;
+ *  it is released while the read is in progress.
+ *
+ *  \return 0 on success or -1 if the device could not be read.
+ */
+static int load_block(fuse_target *t, cache_block *b, uint64_t addr);
+
+/**
+ * Reads \a len bytes at \a addr of the device of \a t into \a buf.  Known
+ *  holes, along with any newly found, are zero-filled.
+ *
+ *  \return A result code; errors other than those from unreadable memory
+ *          are fatal.
+ */
+static forensic1394_result read_range(fuse_target *t, uint64_t addr,
+                                      size_t len, char *buf);
+
+/**
+ * Returns non-zero if \a ret indicates that memory could not be read but
+ *  that the device itself remains usable.
+ */
+static int is_unreadable(forensic1394_result ret);
+
+/**
+ * Returns non-zero if [\a addr, \a addr + \a len) lies within a hole of \a t.
+ *  The lock must be held.
+ */
+static int in_hole(const fuse_target *t, uint64_t addr, uint64_t len);
+
+/**
+ * Records [\a addr, \a addr + \a len) as a hole of \a t.  The lock must be
+ *  held.
+ */
+static void add_hole(fuse_target *t, uint64_t addr, uint64_t len);
+
+/**
+ * Reads ahead the blocks of a target as requested by its readers.
+ */
+static void *prefetch_main(void *arg);
+
+static int64_t elapsed_ms(const struct timespec *a, const struct timespec *b);
+
+static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
+
+static void fs_destroy(void *private_data);
+
+static int fs_getattr(const char *path, struct stat *st,
+                      struct fuse_file_info *fi);
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                      off_t off, struct fuse_file_info *fi,
+                      enum fuse_readdir_flags flags);
+
+static int fs_open(const char *path, struct fuse_file_info *fi);
+
+static int fs_read(const char *path, char *buf, size_t size, off_t off,
+                   struct fuse_file_info *fi);
+
+static int fs_release(const char *path, struct fuse_file_info *fi);
+
+static const struct fuse_operations fs_ops = {
+    .init       = fs_init,
+    .destroy    = fs_destroy,
+    .getattr    = fs_getattr,
+    .readdir    = fs_readdir,
+    .open       = fs_open,
+    .read       = fs_read,
+    .release    = fs_release
+};
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    fuse_state fs;
+    forensic1394_dev **dev;
+    forensic1394_result ret;
+    int i, ndev, status = EXIT_FAILURE;
+
+    memset(&fs, 0, sizeof(fs));
+    fs.size = FUSE_DEFAULT_SIZE;
+    fs.block = FUSE_DEFAULT_BLOCK;
+    fs.nblock = FUSE_DEFAULT_NBLOCK;
+    fs.depth = FUSE_DEFAULT_DEPTH;
+    fs.ttl_ms = FUSE_DEFAULT_TTL_MS;
+
+    if (fuse_opt_parse(&args, &fs, fs_opts, opt_proc) == -1)
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Our usage has been printed; leave the rest to FUSE
+    if (fs.help)
+    {
+        status = fuse_main(args.argc, args.argv, &fs_ops, &fs) ? EXIT_FAILURE
+                                                                 : EXIT_SUCCESS;
+        goto out;
+    }
+
+    if (fs.size_str && (parse_size(fs.size_str, &fs.size) == -1 || !fs.size))
+    {
+        usage(argv[0]);
+        goto out;
+    }
+
+    if (fs.block_str)
+    {
+        uint64_t block;
+
+        // Blocks must be a whole number of quadlets
+        if (parse_size(fs.block_str, &block) == -1 || !block || block % 4
+         || block > (1 << 30))
+        {
+            usage(argv[0]);
+            goto out;
+        }
+
+        fs.block = block;
+    }
+
+    // Enough blocks must remain for those being read ahead
+    if (fs.depth < 0 || fs.ttl_ms < 0 || fs.nblock < fs.depth + 2)
+    {
+        usage(argv[0]);
+        goto out;
+    }
+
+    if (!(fs.bus = forensic1394_alloc()))
+    {
+        fprintf(stderr, "Unable to allocate a bus\n");
+        goto out;
+    }
+
+    if (fs.sbp2)
+    {
+        ret = forensic1394_enable_sbp2(fs.bus);
+
+        if (ret != FORENSIC1394_RESULT_SUCCESS)
+        {
+            fprintf(stderr, "Unable to enable SBP-2: %s\n",
+                    forensic1394_get_result_str(ret));
+            goto out;
+        }
+    }
+
+    dev = forensic1394_get_devices(fs.bus, &ndev, NULL);
+
+    if (ndev < 0)
+    {
+        fprintf(stderr, "Unable to enumerate devices: %s\n",
+                forensic1394_get_result_str(ndev));
+        goto out;
+    }
+
+    if (ndev == 0)
+    {
+        fprintf(stderr, "No devices found\n");
+        goto out;
+    }
+
+    if (!(fs.targets = calloc(ndev, sizeof(*fs.targets))))
+    {
+        fprintf(stderr, "Unable to allocate memory\n");
+        goto out;
+    }
+
+    for (i = 0; i < ndev; i++, fs.ntarget++)
+    {
+        if (target_init(&fs.targets[i], &fs, dev[i]) == -1)
+        {
+            fprintf(stderr, "Unable to allocate memory\n");
+            goto out;
+        }
+    }
+
+    // The devices are opened in fs_init, once FUSE has daemonised
+    status = fuse_main(args.argc, args.argv, &fs_ops, &fs) ? EXIT_FAILURE
+                                                             : EXIT_SUCCESS;
+
+out:
+    for (i = 0; i < fs.ntarget; i++)
+    {
+        target_free(&fs.targets[i]);
+    }
+
+    free(fs.targets);
+
+    if (fs.bus)
+    {
+        forensic1394_destroy(fs.bus);
+    }
+
+    free(fs.size_str);
+    free(fs.block_str);
+    fuse_opt_free_args(&args);
+
+    return status;
+}
+
+int parse_size(const char *s, uint64_t *size)
+{
+    char *end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(s, &end, 0);
+
+    if (errno || end == s)
+    {
+        return -1;
+    }
+
+    switch (*end)
+    {
+        case 'g':
+        case 'G':
+            v <<= 10;
+            // Fall through
+        case 'm':
+        case 'M':
+            v <<= 10;
+            // Fall through
+        case 'k':
+        case 'K':
+            v <<= 10;
+            end++;
+            // Fall through
+        case '\0':
+            break;
+        default:
+            return -1;
+    }
+
+    if (*end != '\0')
+    {
+        return -1;
+    }
+
+    *size = v;
+    return 0;
+}
+
+void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] MOUNTPOINT\n"
+            "\n"
+            "Mounts a read-only filesystem at MOUNTPOINT with a file for each\n"
+            "FireWire device attached to the bus, named by its GUID, holding\n"
+            "the memory of the device.  Unreadable parts of memory read as\n"
+            "zeros and are listed, one 'START-END' line of hexadecimal\n"
+            "addresses per range, in the file GUID" FUSE_HOLES_SUFFIX ".  "
+            "Sizes may be\n"
+            "suffixed by k, m or g.\n"
+            "\n"
+            "  -o size=SIZE   the size of each file (default 4g)\n"
+            "  -o block=SIZE  the number of bytes per vectored read (default "
+            "1m)\n"
+            "  -o blocks=N    the number of blocks cached per device (default "
+            "%d)\n"
+            "  -o depth=N     the number of blocks to read ahead of sequential\n"
+            "                 reads (default %d)\n"
+            "  -o ttl=MS      how long a cached block remains valid (default "
+            "%d)\n"
+            "  -o sbp2        enable SBP-2, required for DMA by many targets\n"
+            "\n",
+            argv0, FUSE_DEFAULT_NBLOCK, FUSE_DEFAULT_DEPTH,
+            FUSE_DEFAULT_TTL_MS);
+}
+
+int opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    if (key == KEY_HELP)
+    {
+        ((fuse_state *) data)->help = 1;
+        usage(outargs->argv[0]);
+    }
+
+    // Pass everything on to FUSE, which prints its own options after ours
+    return 1;
+}
+
+fuse_target *find_target(fuse_state *fs, const char *path, int *holes)
+{
+    int i;
+
+    if (*path++ != '/')
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < fs->ntarget; i++)
+    {
+        if (strcmp(path, fs->targets[i].name) == 0)
+        {
+            *holes = 0;
+            return &fs->targets[i];
+        }
+        else if (strcmp(path, fs->targets[i].holes_name) == 0)
+        {
+            *holes = 1;
+            return &fs->targets[i];
+        }
+    }
+
+    return NULL;
+}
+
+int target_init(fuse_target *t, fuse_state *fs, forensic1394_dev *dev)
+{
+    int i;
+
+    t->fs = fs;
+    t->dev = dev;
+    t->last = UINT64_MAX;
+
+    snprintf(t->name, sizeof(t->name), "%016" PRIx64,
+             forensic1394_get_device_guid(dev));
+    snprintf(t->holes_name, sizeof(t->holes_name), "%s" FUSE_HOLES_SUFFIX,
+             t->name);
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->loaded, NULL);
+    pthread_cond_init(&t->wanted, NULL);
+
+    if (!(t->blocks = calloc(fs->nblock, sizeof(*t->blocks))))
+    {
+        return -1;
+    }
+
+    for (i = 0; i < fs->nblock; i++)
+    {
+        if (!(t->blocks[i].buf = malloc(fs->block)))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void target_free(fuse_target *t)
+{
+    int i;
+
+    if (t->blocks)
+    {
+        for (i = 0; i < t->fs->nblock; i++)
+        {
+            free(t->blocks[i].buf);
+        }
+    }
+
+    free(t->blocks);
+    free(t->holes);
+
+    pthread_cond_destroy(&t->wanted);
+    pthread_cond_destroy(&t->loaded);
+    pthread_mutex_destroy(&t->lock);
+}
+
+cache_block *get_block(fuse_target *t, uint64_t addr)
+{
+    for (;;)
+    {
+        cache_block *b = find_block(t, addr);
+
+        // Another thread is reading it in; wait for it to finish
+        if (b && b->state == BLOCK_LOADING)
+        {
+            pthread_cond_wait(&t->loaded, &t->lock);
+            continue;
+        }
+
+        // Use expired blocks which can not be re-read as they are in use
+        if (b && (is_fresh(t, b) || b->pins))
+        {
+            b->pins++;
+            b->used = ++t->tick;
+            return b;
+        }
+
+        if (!b && !(b = victim_block(t)))
+        {
+            pthread_cond_wait(&t->loaded, &t->lock);
+            continue;
+        }
+
+        if (load_block(t, b, addr) == -1)
+        {
+            return NULL;
+        }
+
+        b->pins++;
+        return b;
+    }
+}
+
+void put_block(fuse_target *t, cache_block *b)
+{
+    // Blocks may be waited on to become free for eviction
+    if (--b->pins == 0)
+    {
+        pthread_cond_broadcast(&t->loaded);
+    }
+}
+
+cache_block *find_block(fuse_target *t, uint64_t addr)
+{
+    int i;
+
+    for (i = 0; i < t->fs->nblock; i++)
+    {
+        if (t->blocks[i].state != BLOCK_EMPTY && t->blocks[i].addr == addr)
+        {
+            return &t->blocks[i];
+        }
+    }
+
+    return NULL;
+}
+
+cache_block *victim_block(fuse_target *t)
+{
+    cache_block *v = NULL;
+    int i;
+
+    for (i = 0; i < t->fs->nblock; i++)
+    {
+        cache_block *b = &t->blocks[i];
+
+        if (b->state == BLOCK_EMPTY)
+        {
+            return b;
+        }
+
+        // Evict the least recently used block not otherwise occupied
+        if (b->state == BLOCK_READY && !b->pins && (!v || b->used < v->used))
+        {
+            v = b;
+        }
+    }
+
+    return v;
+}
+
+int is_fresh(const fuse_target *t, const cache_block *b)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return b->state == BLOCK_READY
+        && elapsed_ms(&b->loaded, &now) < t->fs->ttl_ms;
+}
+
+int load_block(fuse_target *t, cache_block *b, uint64_t addr)
+{
+    forensic1394_result ret;
+    size_t len = t->fs->block;
+
+    // The final block may be cut short by the end of the file
+    if (t->fs->size - addr < len)
+    {
+        len = t->fs->size - addr;
+    }
+
+    b->addr = addr;
+    b->state = BLOCK_LOADING;
+    b->used = ++t->tick;
+
+    pthread_mutex_unlock(&t->lock);
+
+    ret = read_range(t, addr, len, b->buf);
+
+    pthread_mutex_lock(&t->lock);
+
+    b->state = (ret == FORENSIC1394_RESULT_SUCCESS) ? BLOCK_READY
+                                                    : BLOCK_EMPTY;
+    clock_gettime(CLOCK_MONOTONIC, &b->loaded);
+
+    pthread_cond_broadcast(&t->loaded);
+
+    return (ret == FORENSIC1394_RESULT_SUCCESS) ? 0 : -1;
+}
+
+forensic1394_result read_range(fuse_target *t, uint64_t addr, size_t len,
+                               char *buf)
+{
+    forensic1394_result ret = FORENSIC1394_RESULT_SUCCESS;
+    forensic1394_req *req;
+    size_t maxreq = forensic1394_get_device_request_size(t->dev);
+    size_t off, i, nreq = 0;
+    int attempt;
+
+    if (!(req = malloc((len / maxreq + 1) * sizeof(*req))))
+    {
+        return FORENSIC1394_RESULT_OTHER_ERROR;
+    }
+
+    // Split the range up into requests, leaving out those in known holes
+    pthread_mutex_lock(&t->lock);
+
+    for (off = 0; off < len; off += maxreq)
+    {
+        size_t rlen = (len - off < maxreq) ? len - off : maxreq;
+
+        if (in_hole(t, addr + off, rlen))
+        {
+            memset(buf + off, 0, rlen);
+            continue;
+        }
+
+        req[nreq].addr = addr + off;
+        req[nreq].len = rlen;
+        req[nreq].buf = buf + off;
+        nreq++;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    for (attempt = 0; nreq && attempt < FUSE_RETRIES; attempt++)
+    {
+        ret = forensic1394_read_device_v(t->dev, req, nreq);
+
+        if (ret == FORENSIC1394_RESULT_SUCCESS || !is_unreadable(ret))
+        {
+            break;
+        }
+        // Following a bus reset wait for the device to settle
+        else if (ret == FORENSIC1394_RESULT_BUS_RESET)
+        {
+            forensic1394_wait_device_ready(t->dev, FUSE_READY_TIMEOUT_MS);
+        }
+    }
+
+    // Some part of the range is unreadable; find out which
+    if (is_unreadable(ret))
+    {
+        ret = FORENSIC1394_RESULT_SUCCESS;
+
+        for (i = 0; i < nreq && ret == FORENSIC1394_RESULT_SUCCESS; i++)
+        {
+            ret = forensic1394_read_device(t->dev, req[i].addr, req[i].len,
+                                           req[i].buf);
+
+            if (is_unreadable(ret) && ret != FORENSIC1394_RESULT_BUS_RESET)
+            {
+                memset(req[i].buf, 0, req[i].len);
+
+                pthread_mutex_lock(&t->lock);
+                add_hole(t, req[i].addr, req[i].len);
+                pthread_mutex_unlock(&t->lock);
+
+                ret = FORENSIC1394_RESULT_SUCCESS;
+            }
+        }
+    }
+
+    free(req);
+
+    return ret;
+}
+
+int is_unreadable(forensic1394_result ret)
+{
+    return ret == FORENSIC1394_RESULT_IO_ERROR
+        || ret == FORENSIC1394_RESULT_IO_SIZE
+        || ret == FORENSIC1394_RESULT_IO_TIMEOUT
+        || ret == FORENSIC1394_RESULT_BUSY
+        || ret == FORENSIC1394_RESULT_BUS_RESET;
+}
+
+int in_hole(const fuse_target *t, uint64_t addr, uint64_t len)
+{
+    size_t lo = 0, hi = t->nholes;
+
+    // Find the first hole ending after addr
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+
+        if (t->holes[mid].addr + t->holes[mid].len <= addr)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo < t->nholes && t->holes[lo].addr <= addr
+        && addr + len <= t->holes[lo].addr + t->holes[lo].len;
+}
+
+void add_hole(fuse_target *t, uint64_t addr, uint64_t len)
+{
+    uint64_t end = addr + len;
+    size_t lo = 0, hi = t->nholes, last;
+
+    // Find the first hole which ends at or after addr
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+
+        if (t->holes[mid].addr + t->holes[mid].len < addr)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    // Absorb every hole which touches the new one
+    for (last = lo; last < t->nholes && t->holes[last].addr <= end; last++)
+    {
+        uint64_t hend = t->holes[last].addr + t->holes[last].len;
+
+        addr = (t->holes[last].addr < addr) ? t->holes[last].addr : addr;
+        end = (hend > end) ? hend : end;
+    }
+
+    // A hole of its own; make room for it
+    if (last == lo)
+    {
+        if (t->nholes == t->holesz)
+        {
+            size_t nsz = t->holesz ? 2 * t->holesz : 16;
+            extent *nh = realloc(t->holes, nsz * sizeof(*nh));
+
+            // Not fatal; the hole will just be found again
+            if (!nh)
+            {
+                return;
+            }
+
+            t->holes = nh;
+            t->holesz = nsz;
+        }
+
+        memmove(t->holes + lo + 1, t->holes + lo,
+                (t->nholes - lo) * sizeof(*t->holes));
+        t->nholes++;
+    }
+    // Otherwise the first of those absorbed takes the place of the rest
+    else
+    {
+        memmove(t->holes + lo + 1, t->holes + last,
+                (t->nholes - last) * sizeof(*t->holes));
+        t->nholes -= last - lo - 1;
+    }
+
+    t->holes[lo].addr = addr;
+    t->holes[lo].len = end - addr;
+}
+
+void *prefetch_main(void *arg)
+{
+    fuse_target *t = arg;
+
+    pthread_mutex_lock(&t->lock);
+
+    while (!t->stop)
+    {
+        cache_block *b;
+        uint64_t addr;
+
+        if (t->pf_next >= t->pf_end)
+        {
+            pthread_cond_wait(&t->wanted, &t->lock);
+            continue;
+        }
+
+        addr = t->pf_next;
+        t->pf_next += t->fs->block;
+
+        // Already cached, or being read in by a reader
+        if ((b = find_block(t, addr)))
+        {
+            if (b->state == BLOCK_LOADING || is_fresh(t, b) || b->pins)
+            {
+                continue;
+            }
+        }
+        // Should everything be in use give up on reading ahead for now
+        else if (!(b = victim_block(t)))
+        {
+            t->pf_next = t->pf_end;
+            continue;
+        }
+
+        load_block(t, b, addr);
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+int64_t elapsed_ms(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec)*1000LL
+         + (b->tv_nsec - a->tv_nsec)/1000000LL;
+}
+
+void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    fuse_state *fs = fuse_get_context()->private_data;
+    forensic1394_result ret;
+    int i;
+
+    // Memory changes underneath us; have the kernel drop its cache on open
+    cfg->kernel_cache = 0;
+
+    for (i = 0; i < fs->ntarget; i++)
+    {
+        fuse_target *t = &fs->targets[i];
+
+        // Requests are made of the device by many threads at once
+        forensic1394_set_device_io_thread(t->dev, 1);
+
+        ret = forensic1394_open_device(t->dev);
+
+        if (ret != FORENSIC1394_RESULT_SUCCESS)
+        {
+            fprintf(stderr, "Unable to open device %s: %s\n", t->name,
+                    forensic1394_get_result_str(ret));
+            continue;
+        }
+
+        t->open = 1;
+
+        // Reads are already cached and read ahead here
+        forensic1394_set_device_read_ahead(t->dev, 0);
+
+        // After enabling SBP-2 targets take a moment to permit DMA
+        if (fs->sbp2)
+        {
+            forensic1394_wait_device_ready(t->dev, FUSE_READY_TIMEOUT_MS);
+        }
+
+        if (fs->depth)
+        {
+            t->has_thread = !pthread_create(&t->thread, NULL, prefetch_main,
+                                            t);
+        }
+    }
+
+    return fs;
+}
+
+void fs_destroy(void *private_data)
+{
+    fuse_state *fs = private_data;
+    int i;
+
+    for (i = 0; i < fs->ntarget; i++)
+    {
+        fuse_target *t = &fs->targets[i];
+
+        if (t->has_thread)
+        {
+            pthread_mutex_lock(&t->lock);
+            t->stop = 1;
+            pthread_cond_signal(&t->wanted);
+            pthread_mutex_unlock(&t->lock);
+
+            pthread_join(t->thread, NULL);
+            t->has_thread = 0;
+        }
+
+        if (t->open)
+        {
+            forensic1394_close_device(t->dev);
+            t->open = 0;
+        }
+    }
+}
+
+int fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    fuse_state *fs = fuse_get_context()->private_data;
+    fuse_target *t;
+    int holes;
+
+    memset(st, 0, sizeof(*st));
+
+    if (strcmp(path, "/") == 0)
+    {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return 0;
+    }
+
+    if (!(t = find_target(fs, path, &holes)))
+    {
+        return -ENOENT;
+    }
+
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+
+    if (holes)
+    {
+        pthread_mutex_lock(&t->lock);
+        st->st_size = t->nholes * FUSE_HOLES_LINE;
+        pthread_mutex_unlock(&t->lock);
+    }
+    else
+    {
+        st->st_size = fs->size;
+    }
+
+    return 0;
+}
+
+int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+               off_t off, struct fuse_file_info *fi,
+               enum fuse_readdir_flags flags)
+{
+    fuse_state *fs = fuse_get_context()->private_data;
+    int i;
+
+    if (strcmp(path, "/") != 0)
+    {
+        return -ENOENT;
+    }
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+
+    for (i = 0; i < fs->ntarget; i++)
+    {
+        filler(buf, fs->targets[i].name, NULL, 0, 0);
+        filler(buf, fs->targets[i].holes_name, NULL, 0, 0);
+    }
+
+    return 0;
+}
+
+int fs_open(const char *path, struct fuse_file_info *fi)
+{
+    fuse_state *fs = fuse_get_context()->private_data;
+    fuse_target *t;
+    holes_text *text;
+    size_t i;
+    int holes;
+
+    if (!(t = find_target(fs, path, &holes)))
+    {
+        return -ENOENT;
+    }
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+        return -EACCES;
+    }
+
+    if (!holes)
+    {
+        return t->open ? 0 : -EIO;
+    }
+
+    pthread_mutex_lock(&t->lock);
+
+    if (!(text = malloc(sizeof(*text) + t->nholes * FUSE_HOLES_LINE + 1)))
+    {
+        pthread_mutex_unlock(&t->lock);
+        return -ENOMEM;
+    }
+
+    for (i = 0, text->len = 0; i < t->nholes; i++)
+    {
+        text->len += sprintf(text->data + text->len,
+                             "%016" PRIx64 "-%016" PRIx64 "\n",
+                             t->holes[i].addr,
+                             t->holes[i].addr + t->holes[i].len);
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    // The size of the file changes as holes are found
+    fi->fh = (uintptr_t) text;
+    fi->direct_io = 1;
+
+    return 0;
+}
+
+int fs_read(const char *path, char *buf, size_t size, off_t off,
+            struct fuse_file_info *fi)
+{
+    fuse_state *fs = fuse_get_context()->private_data;
+    fuse_target *t;
+    size_t done = 0;
+    int holes;
+
+    if (!(t = find_target(fs, path, &holes)))
+    {
+        return -ENOENT;
+    }
+
+    if (holes)
+    {
+        holes_text *text = (holes_text *) (uintptr_t) fi->fh;
+
+        if ((uint64_t) off >= text->len)
+        {
+            return 0;
+        }
+
+        size = (text->len - off < size) ? text->len - off : size;
+        memcpy(buf, text->data + off, size);
+
+        return size;
+    }
+
+    if ((uint64_t) off >= fs->size)
+    {
+        return 0;
+    }
+
+    size = (fs->size - off < size) ? fs->size - off : size;
+
+    pthread_mutex_lock(&t->lock);
+
+    while (done < size)
+    {
+        uint64_t addr = off + done;
+        uint64_t baddr = addr - addr % fs->block;
+        size_t boff = addr - baddr, n;
+        cache_block *b;
+
+        // Moving on to the next block; have those after it read ahead
+        if (baddr == t->last + fs->block && fs->depth)
+        {
+            uint64_t end = baddr + (fs->depth + 1)*fs->block;
+
+            end = (end < fs->size) ? end : fs->size;
+
+            if (t->pf_next <= baddr || t->pf_next > end)
+            {
+                t->pf_next = baddr + fs->block;
+            }
+
+            t->pf_end = end;
+            pthread_cond_signal(&t->wanted);
+        }
+
+        t->last = baddr;
+
+        if (!(b = get_block(t, baddr)))
+        {
+            break;
+        }
+
+        n = fs->block - boff;
+        n = (size - done < n) ? size - done : n;
+
+        // Copy out without holding the lock; the pin keeps the block around
+        pthread_mutex_unlock(&t->lock);
+        memcpy(buf + done, b->buf + boff, n);
+        pthread_mutex_lock(&t->lock);
+
+        put_block(t, b);
+
+        done += n;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    // Report a short read should the device fail part way through
+    return (done || !size) ? (int) done : -EIO;
+}
+
+int fs_release(const char *path, struct fuse_file_info *fi)
+{
+    fuse_state *fs = fuse_get_context()->private_data;
+    int holes;
+
+    if (find_target(fs, path, &holes) && holes)
+    {
+        free((holes_text *) (uintptr_t) fi->fh);
+    }
+
+    return 0;
+}